@@ -0,0 +1,743 @@
+/**********************************************************************  Minishell benchmarks
+ *
+ * Builds the shell source into this program (without its main) and times the
+ * hot paths directly: tokenizing (against the byte-at-a-time tokenizer it replaced), parsing script lines (against running
+ * them from the compile cache), built-in dispatch, launching a command (also
+ * from a shell with 512 MiB of touched memory), moving data through a pipeline and
+ * running commands on a --serve server instead of starting a shell for each, and glob
+ * and brace expansion. Results go to stdout as one JSON object so
+ * runs of different versions can be compared.
+ *
+ * Usage: lsh-bench [name...]   (no names runs every benchmark)
+ **********************************************************************/
+#define LSH_NO_MAIN
+#include "../src/shell-modify.c"
+
+#ifndef LSH_VERSION
+#define LSH_VERSION "unknown"
+#endif
+
+#define BENCH_REPS 5                 // Timed runs per benchmark; the median is reported.
+#define BENCH_LINE_BYTES (8 << 20)   // Size of the lines fed to the tokenizer.
+#define BENCH_PIPE_BYTES (64 << 20)  // Bytes pushed through the pipeline benchmark.
+#define BENCH_BALLAST_BYTES (512 << 20) // Memory the *_big launch benchmarks add to the shell.
+#define BENCH_SCRIPT_LINES 4096      // Lines of the script the parse and cache benchmarks go through.
+#define BENCH_GLOB_FILES 100000      // Files in the directory the glob benchmarks expand.
+
+typedef double (*bench_fn)(long iterations); // Runs once; returns the measured value.
+
+/**********************************************************************  Monotonic clock in seconds **********************************************************************/
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**********************************************************************  Sort helper for medians **********************************************************************/
+int bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**********************************************************************  Tokenizer: MB/s on large lines **********************************************************************/
+char *bench_line = NULL;  // Mixed words, quotes and operators.
+char *bench_paths = NULL; // A generated file list: long words, single spaces.
+
+/**********************************************************************  The tokenizer lsh_lex replaced, kept as a baseline **********************************************************************/
+char **bench_split_legacy(char *line)
+{
+    int bufsize = LSH_TOK_BUFSIZE;
+    int position = 0;
+    char *line_copy = lsh_arena_strdup(&lsh_cmd_arena, line);
+    char **tokens = lsh_arena_alloc(&lsh_cmd_arena, bufsize * sizeof(char *));
+    int i = 0;
+    int start = 0;
+    int in_quote = 0;
+    char quote_char = 0;
+    int len = strlen(line_copy);
+
+    while (i <= len)
+    {
+        if (position + 3 > bufsize)
+        {
+            tokens = lsh_arena_grow(&lsh_cmd_arena, tokens, bufsize * sizeof(char *), 2 * bufsize * sizeof(char *));
+            bufsize *= 2;
+        }
+        if ((line_copy[i] == '"' || line_copy[i] == '\'') && (i == 0 || line_copy[i - 1] != '\\'))
+        {
+            if (!in_quote)
+            {
+                in_quote = 1;
+                quote_char = line_copy[i];
+                start = i + 1;
+            }
+            else if (line_copy[i] == quote_char)
+            {
+                line_copy[i] = '\0';
+                tokens[position++] = &line_copy[start];
+                start = i + 1;
+                in_quote = 0;
+            }
+        }
+        else if (!in_quote && i < len - 1 && line_copy[i] == '>' && line_copy[i + 1] == '>')
+        {
+            if (i > start)
+            {
+                line_copy[i] = '\0';
+                tokens[position++] = &line_copy[start];
+            }
+            tokens[position++] = REDIRECT_OUTPUT_APPEND;
+            i += 2;
+            start = i;
+            continue;
+        }
+        else if (!in_quote && (line_copy[i] == '<' || line_copy[i] == '>' || line_copy[i] == '|' || line_copy[i] == '&'))
+        {
+            char special = line_copy[i];
+            if (i > start)
+            {
+                line_copy[i] = '\0';
+                tokens[position++] = &line_copy[start];
+            }
+            tokens[position++] = special == '<' ? REDIRECT_INPUT : special == '>' ? REDIRECT_OUTPUT : special == '|' ? PIPE_TOKEN : BACKGROUND_TOKEN;
+            start = i + 1;
+        }
+        else if (!in_quote && line_copy[i] == '#' && i == start)
+        {
+            line_copy[i] = '\0';
+            len = i;
+            continue;
+        }
+        else if (!in_quote && (isspace(line_copy[i]) || line_copy[i] == '\0'))
+        {
+            if (i > start)
+            {
+                line_copy[i] = '\0';
+                tokens[position++] = &line_copy[start];
+            }
+            start = i + 1;
+        }
+        i++;
+    }
+    tokens[position] = NULL;
+    return tokens;
+}
+
+/**********************************************************************  Tokenize one line repeatedly with a given tokenizer **********************************************************************/
+double bench_split(char **(*split)(char *), char *line, long iterations)
+{
+    long i;
+    size_t bytes = strlen(line);
+    double start = bench_now();
+
+    for (i = 0; i < iterations; i++)
+    {
+        split(line);
+        lsh_arena_reset(&lsh_cmd_arena);
+    }
+    return bytes * iterations / (bench_now() - start) / 1e6;
+}
+
+/**********************************************************************  The lexer with a fixed scanner **********************************************************************/
+double bench_split_with(const char *(*scan)(const char *, const char *), char *line, long iterations)
+{
+    double mbs;
+
+    lsh_lex_init();
+    const char *(*best)(const char *, const char *) = lsh_lex_scan;
+    lsh_lex_scan = scan ? scan : best;
+    mbs = bench_split(lsh_split_line, line, iterations);
+    lsh_lex_scan = best;
+    return mbs;
+}
+
+double bench_tokenize(long iterations)
+{
+    return bench_split_with(NULL, bench_line, iterations);
+}
+
+double bench_tokenize_scalar(long iterations)
+{
+    return bench_split_with(lsh_lex_scan_scalar, bench_line, iterations);
+}
+
+double bench_tokenize_legacy(long iterations)
+{
+    return bench_split(bench_split_legacy, bench_line, iterations);
+}
+
+double bench_tokenize_paths(long iterations)
+{
+    return bench_split_with(NULL, bench_paths, iterations);
+}
+
+double bench_tokenize_paths_scalar(long iterations)
+{
+    return bench_split_with(lsh_lex_scan_scalar, bench_paths, iterations);
+}
+
+double bench_tokenize_paths_legacy(long iterations)
+{
+    return bench_split(bench_split_legacy, bench_paths, iterations);
+}
+
+/**********************************************************************  Built-in dispatch: ns per lookup **********************************************************************/
+double bench_dispatch(long iterations)
+{
+    long i;
+    int n = lsh_num_builtins(), found = 0;
+    double start = bench_now();
+
+    for (i = 0; i < iterations; i++)
+    {
+        found += lsh_find_builtin(builtin_str[i % n]) >= 0;
+        found += lsh_find_builtin("ls") >= 0; // A miss, like every external command
+    }
+    if (found != iterations)
+    {
+        fprintf(stderr, "lsh-bench: dispatch lookups went wrong\n");
+    }
+    return (bench_now() - start) / (iterations * 2) * 1e9;
+}
+
+/**********************************************************************  Run lines through the shell the way lsh_loop does **********************************************************************/
+double bench_lines(const char *line, long iterations)
+{
+    long i;
+    char buf[256];
+    double start = bench_now();
+
+    for (i = 0; i < iterations; i++)
+    {
+        snprintf(buf, sizeof(buf), "%s", line);
+        lsh_execute(lsh_split_line(buf));
+        lsh_arena_reset(&lsh_cmd_arena);
+    }
+    return (bench_now() - start) / iterations * 1e6;
+}
+
+/**********************************************************************  Built-in command: us per line **********************************************************************/
+double bench_builtin_line(long iterations)
+{
+    return bench_lines("true", iterations);
+}
+
+/**********************************************************************  External command: us from line to reaped child **********************************************************************/
+double bench_launch_spawn(long iterations)
+{
+    lsh_opt_spawn = 1;
+    return bench_lines("/bin/true", iterations);
+}
+
+double bench_launch_fork(long iterations)
+{
+    double us;
+    lsh_opt_spawn = 0;
+    us = bench_lines("/bin/true", iterations);
+    lsh_opt_spawn = 1;
+    return us;
+}
+
+double bench_launch_zygote(long iterations)
+{
+    double us;
+    lsh_opt_zygote = 1;
+    us = bench_lines("/bin/true", iterations);
+    lsh_opt_zygote = 0;
+    return us;
+}
+
+/**********************************************************************  Command substitution: us per line **********************************************************************/
+double bench_subst_builtin(long iterations)
+{
+    return bench_lines("x=$(pwd)", iterations);
+}
+
+double bench_subst_external(long iterations)
+{
+    return bench_lines("x=$(/bin/pwd)", iterations);
+}
+
+/**********************************************************************  The same launches from a shell that has grown big **********************************************************************/
+void bench_ballast(void)
+{
+    static char *ballast = NULL;
+
+    // Touched memory is what fork has to copy page tables for
+    if (ballast == NULL && (ballast = malloc(BENCH_BALLAST_BYTES)) != NULL)
+    {
+        memset(ballast, 1, BENCH_BALLAST_BYTES);
+    }
+}
+
+double bench_launch_spawn_big(long iterations)
+{
+    bench_ballast();
+    return bench_launch_spawn(iterations);
+}
+
+double bench_launch_fork_big(long iterations)
+{
+    bench_ballast();
+    return bench_launch_fork(iterations);
+}
+
+double bench_launch_zygote_big(long iterations)
+{
+    bench_ballast();
+    return bench_launch_zygote(iterations);
+}
+
+/**********************************************************************  Pipeline: MB/s through three stages **********************************************************************/
+char bench_pipe_file[] = "/tmp/lsh-bench-XXXXXX";
+
+double bench_pipeline(long iterations)
+{
+    char line[256];
+    long i;
+
+    snprintf(line, sizeof(line), "cat %s | /bin/cat | /bin/cat > /dev/null", bench_pipe_file);
+    double start = bench_now();
+    for (i = 0; i < iterations; i++)
+    {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s", line);
+        lsh_execute(lsh_split_line(buf));
+        lsh_arena_reset(&lsh_cmd_arena);
+    }
+    return (double)BENCH_PIPE_BYTES * iterations / (bench_now() - start) / 1e6;
+}
+
+double bench_pipeline_64k(long iterations)
+{
+    double mbs;
+    lsh_pipe_size = 0; // Kernel default pipes
+    mbs = bench_pipeline(iterations);
+    lsh_pipe_size = LSH_PIPE_SIZE;
+    return mbs;
+}
+
+double bench_pipeline_pinned(long iterations)
+{
+    double mbs;
+    lsh_var_set("PIPE_CPUS", 9, "auto", 0);
+    mbs = bench_pipeline(iterations);
+    lsh_var_unset("PIPE_CPUS");
+    return mbs;
+}
+
+/**********************************************************************  Server mode: us per command against a shell per command **********************************************************************/
+char bench_serve_path[] = "/tmp/lsh-bench-serve.sock";
+pid_t bench_serve_pid = 0;
+
+int bench_serve_start(void)
+{
+    char *argv[] = {"lsh-bench", "--serve", bench_serve_path, NULL};
+    int i, sock;
+
+    // The server is this binary too; poll until its socket takes connections
+    if (bench_serve_pid == 0 && posix_spawn(&bench_serve_pid, "/proc/self/exe", NULL, NULL, argv, lsh_env()) != 0)
+    {
+        return -1;
+    }
+    for (i = 0; i < 1000; i++)
+    {
+        if ((sock = lsh_serve_connect(bench_serve_path)) != -1)
+        {
+            return sock;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+double bench_serve(const char *line, long iterations, int reconnect)
+{
+    int sock = bench_serve_start(), fds[LSH_SERVE_FDS];
+    long i;
+
+    if (sock == -1)
+    {
+        fprintf(stderr, "lsh-bench: server did not start\n");
+        return 0;
+    }
+    fds[0] = fds[1] = fds[2] = open("/dev/null", O_RDWR | O_CLOEXEC);
+    double start = bench_now();
+    for (i = 0; i < iterations; i++)
+    {
+        if (reconnect && i > 0)
+        {
+            // What a client process per command costs the server: a new session each time
+            close(sock);
+            sock = lsh_serve_connect(bench_serve_path);
+        }
+        if (lsh_serve_request(sock, line, "", NULL, 0, fds) != 0)
+        {
+            fprintf(stderr, "lsh-bench: request failed\n");
+            break;
+        }
+    }
+    double us = (bench_now() - start) / iterations * 1e6;
+    close(sock);
+    close(fds[0]);
+    return us;
+}
+
+double bench_serve_builtin(long iterations)
+{
+    return bench_serve("true", iterations, 0);
+}
+
+double bench_serve_external(long iterations)
+{
+    return bench_serve("/bin/true", iterations, 0);
+}
+
+double bench_serve_connect(long iterations)
+{
+    return bench_serve("true", iterations, 1);
+}
+
+double bench_shell_per_command(long iterations)
+{
+    char *argv[] = {"lsh-bench", "-c", "true", NULL};
+    long i;
+    double start = bench_now();
+
+    // The baseline the server replaces: a fresh shell for every command
+    for (i = 0; i < iterations; i++)
+    {
+        pid_t pid;
+        if (posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, lsh_env()) != 0 || waitpid(pid, NULL, 0) == -1)
+        {
+            fprintf(stderr, "lsh-bench: shell did not start\n");
+            break;
+        }
+    }
+    return (bench_now() - start) / iterations * 1e6;
+}
+
+/**********************************************************************  Globbing: ms per line over a directory of 100k files **********************************************************************/
+char bench_glob_dir[] = "/tmp/lsh-bench-glob-XXXXXX";
+int bench_glob_ready = 0;
+
+double bench_glob_lines(const char *line, long iterations)
+{
+    char cwd[PATH_MAX], name[64];
+    double ms;
+    int i;
+
+    // Made on first use only: creating the files takes longer than every other benchmark's setup
+    if (!bench_glob_ready)
+    {
+        if (mkdtemp(bench_glob_dir) == NULL)
+        {
+            perror("lsh-bench");
+            return 0;
+        }
+        for (i = 0; i < BENCH_GLOB_FILES; i++)
+        {
+            snprintf(name, sizeof(name), "%s/file%06d.log", bench_glob_dir, i);
+            close(open(name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+        }
+        bench_glob_ready = 1;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL || chdir(bench_glob_dir) == -1)
+    {
+        return 0;
+    }
+    ms = bench_lines(line, iterations) / 1000;
+    chdir(cwd);
+    return ms;
+}
+
+double bench_glob(long iterations)
+{
+    return bench_glob_lines("true *.log", iterations);
+}
+
+double bench_glob_x4(long iterations)
+{
+    // Four patterns over the same directory: one read, four passes over the cached names
+    return bench_glob_lines("true *0.log *1.log *2.log *3?.log", iterations);
+}
+
+double bench_glob_path(long iterations)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "true %s/*.log", bench_glob_dir);
+    return bench_glob_lines(line, iterations);
+}
+
+double bench_glob_sh(long iterations)
+{
+    // What the same expansion cost before: a /bin/sh started to do it
+    return bench_glob_lines("/bin/sh -c 'true *.log'", iterations);
+}
+
+double bench_brace(long iterations)
+{
+    return bench_lines("true file{1..1000}.log", iterations);
+}
+
+void bench_glob_cleanup(void)
+{
+    char name[64];
+    int i;
+
+    if (!bench_glob_ready)
+    {
+        return;
+    }
+    for (i = 0; i < BENCH_GLOB_FILES; i++)
+    {
+        snprintf(name, sizeof(name), "%s/file%06d.log", bench_glob_dir, i);
+        unlink(name);
+    }
+    rmdir(bench_glob_dir);
+}
+
+/**********************************************************************  Script lines: us per line parsed or taken from the cache **********************************************************************/
+char *bench_script[BENCH_SCRIPT_LINES]; // Lines of a typical script.
+struct lsh_cache bench_cache;           // The same script compiled.
+
+double bench_script_parse(long iterations)
+{
+    long i;
+    int error;
+    double start = bench_now();
+
+    // What lsh_loop does for every line before running it
+    for (i = 0; i < iterations; i++)
+    {
+        lsh_parse(lsh_split_line(bench_script[i % BENCH_SCRIPT_LINES]), &error);
+        lsh_arena_reset(&lsh_cmd_arena);
+    }
+    return (bench_now() - start) / iterations * 1e6;
+}
+
+double bench_script_cached(long iterations)
+{
+    long i;
+    double start = bench_now();
+
+    // What lsh_cache_loop does instead
+    for (i = 0; i < iterations; i++)
+    {
+        lsh_cache_thaw(&bench_cache, &bench_cache.lines[i % BENCH_SCRIPT_LINES]);
+        lsh_arena_reset(&lsh_cmd_arena);
+    }
+    return (bench_now() - start) / iterations * 1e6;
+}
+
+/**********************************************************************  Inputs shared by the benchmarks **********************************************************************/
+int bench_setup(void)
+{
+    static const char *words[] = {"ls", "-la", "\"quoted words here\"", "|", "grep", "'x y'", ">", "out.txt", ">>", "log", "<", "in", "--flag=value", "/usr/local/bin/tool"};
+    size_t len = 0;
+    unsigned int seed = 12345;
+    char chunk[65536];
+    size_t i;
+
+    // Fixed seed: every run tokenizes the same line
+    bench_line = malloc(BENCH_LINE_BYTES + 64);
+    if (!bench_line)
+    {
+        return -1;
+    }
+    while (len < BENCH_LINE_BYTES)
+    {
+        seed = seed * 1103515245 + 12345;
+        len += sprintf(bench_line + len, "%s ", words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))]);
+    }
+
+    // What `ls $(find ...)` style commands look like: thousands of long path arguments
+    bench_paths = malloc(BENCH_LINE_BYTES + 128);
+    if (!bench_paths)
+    {
+        return -1;
+    }
+    len = sprintf(bench_paths, "ls -l");
+    for (i = 0; len < BENCH_LINE_BYTES; i++)
+    {
+        len += sprintf(bench_paths + len, " src/module_%zu/include/generated/component_%zu_interface.h", i % 97, i);
+    }
+
+    // A script made of typical lines, and its compiled form
+    static const char *lines[] = {"cd /var/log/app && find . -name '*.log' -mtime +7 | xargs rm -f",
+                                  "echo \"rotating $LOGDIR at $(date)\" >> /var/log/rotate.log",
+                                  "if_missing=1; test -d /srv/backup || mkdir -p /srv/backup",
+                                  "( cd /srv/data && tar cf - . ) | gzip -c > /srv/backup/data.tar.gz",
+                                  "{ grep -c ERROR app.log; grep -c WARN app.log; } > counts.txt && echo counted",
+                                  "rsync -a --delete /srv/data/ backup:/srv/data/ || echo 'rsync failed' >> errors",
+                                  "# comment lines cost a lexer pass too",
+                                  "awk '{ s += $3 } END { print s }' usage.csv | sort -n | tail -1"};
+    struct lsh_input in;
+    struct stat st;
+    size_t size, script_len = 0;
+    for (i = 0; i < BENCH_SCRIPT_LINES; i++)
+    {
+        bench_script[i] = (char *)lines[i % (sizeof(lines) / sizeof(lines[0]))];
+        script_len += strlen(bench_script[i]) + 1;
+    }
+    char *script = malloc(script_len + 1), *p = script;
+    if (!script)
+    {
+        return -1;
+    }
+    for (i = 0; i < BENCH_SCRIPT_LINES; i++)
+    {
+        p += sprintf(p, "%s\n", bench_script[i]);
+    }
+    memset(&st, 0, sizeof(st));
+    lsh_input_string(&in, script);
+    char *image = lsh_cache_compile(&in, "bench", &st, &size);
+    lsh_input_close(&in);
+    free(script);
+    if (lsh_cache_load(&bench_cache, image, size, "bench", &st) == -1)
+    {
+        fprintf(stderr, "lsh-bench: compiled script does not load\n");
+        return -1;
+    }
+
+    int fd = mkstemp(bench_pipe_file);
+    if (fd == -1)
+    {
+        perror("lsh-bench");
+        return -1;
+    }
+    for (i = 0; i < sizeof(chunk); i++)
+    {
+        chunk[i] = 'a' + i % 26;
+    }
+    for (i = 0; i < BENCH_PIPE_BYTES; i += sizeof(chunk))
+    {
+        if (lsh_write_all(fd, chunk, sizeof(chunk)) == -1)
+        {
+            perror("lsh-bench");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+/**********************************************************************  Benchmark table **********************************************************************/
+struct bench_case
+{
+    const char *name; // Name used on the command line and in the output.
+    const char *unit; // Unit of the value bench_fn returns.
+    int higher;       // Higher is better (rates) rather than lower (latencies).
+    long iterations;  // Operations per timed run.
+    bench_fn fn;      // Benchmark body.
+};
+
+struct bench_case bench_cases[] = {
+    {"tokenize", "MB/s", 1, 10, bench_tokenize},
+    {"tokenize_scalar", "MB/s", 1, 10, bench_tokenize_scalar},
+    {"tokenize_legacy", "MB/s", 1, 10, bench_tokenize_legacy},
+    {"tokenize_paths", "MB/s", 1, 10, bench_tokenize_paths},
+    {"tokenize_paths_scalar", "MB/s", 1, 10, bench_tokenize_paths_scalar},
+    {"tokenize_paths_legacy", "MB/s", 1, 10, bench_tokenize_paths_legacy},
+    {"script_parse", "us/line", 0, 1000000, bench_script_parse},
+    {"script_cached", "us/line", 0, 1000000, bench_script_cached},
+    {"builtin_dispatch", "ns/lookup", 0, 10000000, bench_dispatch},
+    {"builtin_line", "us/line", 0, 100000, bench_builtin_line},
+    {"launch_spawn", "us/command", 0, 500, bench_launch_spawn},
+    {"launch_fork", "us/command", 0, 500, bench_launch_fork},
+    {"launch_zygote", "us/command", 0, 500, bench_launch_zygote},
+    {"pipeline_3_stages", "MB/s", 1, 3, bench_pipeline},
+    {"pipeline_3_stages_64k", "MB/s", 1, 3, bench_pipeline_64k},
+    {"pipeline_3_stages_pinned", "MB/s", 1, 3, bench_pipeline_pinned},
+    {"subst_builtin", "us/line", 0, 100000, bench_subst_builtin},
+    {"subst_external", "us/line", 0, 500, bench_subst_external},
+    {"serve_builtin", "us/command", 0, 10000, bench_serve_builtin},
+    {"serve_external", "us/command", 0, 500, bench_serve_external},
+    {"serve_connect", "us/command", 0, 1000, bench_serve_connect},
+    {"shell_per_command", "us/command", 0, 500, bench_shell_per_command},
+    {"glob_100k", "ms/line", 0, 20, bench_glob},
+    {"glob_100k_x4", "ms/line", 0, 20, bench_glob_x4},
+    {"glob_100k_path", "ms/line", 0, 20, bench_glob_path},
+    {"glob_100k_sh", "ms/line", 0, 20, bench_glob_sh},
+    {"brace_1000", "us/line", 0, 2000, bench_brace},
+    {"launch_spawn_big", "us/command", 0, 500, bench_launch_spawn_big},
+    {"launch_fork_big", "us/command", 0, 500, bench_launch_fork_big},
+    {"launch_zygote_big", "us/command", 0, 500, bench_launch_zygote_big},
+};
+
+/**********************************************************************  Main **********************************************************************/
+int main(int argc, char **argv)
+{
+    int ncases = sizeof(bench_cases) / sizeof(bench_cases[0]);
+    int i, j, first = 1;
+
+    // The spawn helper re-executes this binary (/proc/self/exe), so it must answer to --zygote too
+    if (argc == 3 && strcmp(argv[1], "--zygote") == 0)
+    {
+        return lsh_zygote_serve(atoi(argv[2]));
+    }
+    // So do the server and the shells of the shell-per-command baseline
+    if (argc == 3 && (strcmp(argv[1], "--serve") == 0 || strcmp(argv[1], "-c") == 0))
+    {
+        struct lsh_input in;
+        lsh_init_signals();
+        lsh_vars_init();
+        if (argv[1][1] == '-')
+        {
+            return lsh_serve(argv[2], 4);
+        }
+        lsh_input_string(&in, argv[2]);
+        lsh_loop(&in);
+        lsh_input_close(&in);
+        return lsh_last_status;
+    }
+
+    lsh_init_signals();
+    if (bench_setup() == -1)
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf("{\n  \"version\": \"%s\",\n  \"reps\": %d,\n  \"benchmarks\": [", LSH_VERSION, BENCH_REPS);
+    for (i = 0; i < ncases; i++)
+    {
+        struct bench_case *c = &bench_cases[i];
+        double runs[BENCH_REPS];
+
+        // Only the benchmarks named on the command line, if any
+        for (j = 1; j < argc && strcmp(argv[j], c->name) != 0; j++)
+        {
+        }
+        if (argc > 1 && j == argc)
+        {
+            continue;
+        }
+
+        // One untimed run to warm caches and the command path table
+        c->fn(c->iterations / 10 + 1);
+        for (j = 0; j < BENCH_REPS; j++)
+        {
+            runs[j] = c->fn(c->iterations);
+        }
+        qsort(runs, BENCH_REPS, sizeof(double), bench_cmp);
+
+        printf("%s\n    {\"name\": \"%s\", \"value\": %.3f, \"best\": %.3f, \"unit\": \"%s\", \"iterations\": %ld}",
+               first ? "" : ",", c->name, runs[BENCH_REPS / 2], c->higher ? runs[BENCH_REPS - 1] : runs[0], c->unit, c->iterations);
+        fflush(stdout);
+        first = 0;
+    }
+    printf("\n  ]\n}\n");
+
+    unlink(bench_pipe_file);
+    bench_glob_cleanup();
+    if (bench_serve_pid > 0)
+    {
+        kill(bench_serve_pid, SIGTERM);
+        waitpid(bench_serve_pid, NULL, 0);
+        unlink(bench_serve_path);
+    }
+    return 0;
+}
@@ -3,6 +3,7 @@
 /*================================================================================================================================================================*/
 
 /************************************************************************  Includes *******************************************************************************/
+#define _GNU_SOURCE    // Linux extensions (pipe2 and friends).
 #include <sys/wait.h>  // Wait for the child process to terminate.
 #include <unistd.h>    // Standard symbolic constants and types.
 #include <stdlib.h>    // Standard library definitions.
@@ -12,6 +13,31 @@
 #include <fcntl.h>     // File control operations.
 #include <errno.h>     // Error number definitions.
 #include <ctype.h>     // For character type checking
+#include <sys/mman.h>  // Memory mapping of script files.
+#include <sys/stat.h>  // File status for script files.
+#include <signal.h>    // Job-control signal dispositions.
+#include <spawn.h>     // posix_spawn launch path.
+#include <sys/resource.h> // Resource usage for memstat and time.
+#include <sys/time.h>     // timeradd and timersub for time reports.
+#include <limits.h>    // PATH_MAX.
+#include <time.h>      // nanosleep for the sleep built-in.
+#include <sys/sendfile.h> // Zero-copy file output for cat.
+#include <termios.h>   // Terminal modes saved across jobs.
+#include <poll.h>      // Waiting on several parallel items at once.
+#include <sys/syscall.h> // pidfd_open for parallel items, clone for the spawn helper.
+#include <sys/socket.h> // Spawn helper socket and descriptor passing.
+#include <sys/prctl.h>  // Spawn helper exits with the shell.
+#include <sched.h>      // CLONE_PARENT.
+#include <sys/uio.h>    // writev for history lines.
+#include <dirent.h>     // Command and file name completion.
+#include <stdint.h>     // Fixed-width fields of compiled scripts.
+#include <sys/ioctl.h>  // FIONREAD on pipes of a timed pipeline.
+#include <sys/epoll.h>  // Event loop over child pidfds and the signalfd.
+#include <sys/signalfd.h> // SIGCHLD and SIGINT read as events.
+#include <sys/un.h>     // Socket address of the server mode.
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // SSE2/AVX2 byte classification in the lexer.
+#endif
 /************************************************************************  Define constants **********************************************************************/
 #define LSH_RL_BUFSIZE 1024         // Buffer size for reading the command.
 #define LSH_TOK_BUFSIZE 64          // Buffer size for storing the tokens.
@@ -20,6 +46,500 @@
 #define REDIRECT_OUTPUT ">"         // Output redirection symbol.
 #define REDIRECT_OUTPUT_APPEND ">>" // Output redirection append symbol.
 #define PIPE_TOKEN "|"              // Pipe symbol.
+#define BACKGROUND_TOKEN "&"        // Background job symbol.
+#define SEMI_TOKEN ";"              // Command separator.
+#define AND_TOKEN "&&"              // Run the next command if this one succeeded.
+#define OR_TOKEN "||"               // Run the next command if this one failed.
+#define LPAREN_TOKEN "("            // Start of a subshell.
+#define RPAREN_TOKEN ")"            // End of a subshell.
+#define HEREDOC_TOKEN "<<"          // Here-document: the following lines up to a delimiter are the input.
+#define HEREDOC_STRIP_TOKEN "<<-"   // Here-document with leading tabs removed.
+#define HERESTRING_TOKEN "<<<"      // Here-string: one word is the input.
+#define DUPIN_TOKEN "<&"            // Duplicate an input descriptor.
+#define DUPOUT_TOKEN ">&"           // Duplicate an output descriptor.
+#define OUTERR_TOKEN "&>"           // Standard output and error to a file.
+#define APPENDERR_TOKEN "&>>"       // Standard output and error appended to a file.
+#define LSH_IN_BUFSIZE 65536        // Block size for batch-mode reads.
+#define LSH_IN_DROP (1 << 20)       // Release consumed script pages in steps of this size.
+#define LSH_PROMPT "T-12_MiniShell_Sasken >" // Interactive prompt.
+#define LSH_PATH_BUCKETS 256        // Buckets in the command path hash table.
+#define LSH_ARENA_BLOCK 65536       // Default block size of the per-command arena.
+#define LSH_BUILTIN_SLOTS 128       // Slots in the built-in dispatch table (power of two).
+#define LSH_IO_BUFSIZE 65536        // Buffer size of the cat, head and wc built-ins.
+#define LSH_FALLBACK -1             // Built-in declined the arguments; run the external command instead.
+#define LSH_COPY_CHUNK (1 << 20)    // Bytes per splice/sendfile/copy_file_range call.
+#define LSH_PIPE_SIZE (1 << 20)     // Requested capacity of pipes between pipeline stages.
+#define LSH_HEREDOC_PIPE 4096       // Here-documents up to this size go through a pipe; bigger ones are memfd-backed.
+#define LSH_PIPE_SAMPLE_MS 1        // Interval between pipe fill samples of a timed pipeline.
+#define LSH_EVENT_MAX 64            // Events taken from epoll in one call.
+#define LSH_IOPRIO_CLASS_SHIFT 13   // ioprio_set(2) takes the class above a 13-bit level.
+#define LSH_IOPRIO_WHO_PROCESS 1    // ioprio_set(2) target is a single process.
+/**********************************************************************  Batch input source **********************************************************************/
+struct lsh_input
+{
+    int fd;         // Descriptor to read blocks from (-1 for mapped or in-memory input).
+    char *buf;      // Buffered input; lines are NUL-terminated in place.
+    size_t len;     // Number of valid bytes in buf.
+    size_t pos;     // Start of the next unread line.
+    size_t cap;     // Allocated size of buf (0 when buf is a mapping).
+    char *tail;     // Copy of a final unterminated line of a mapping.
+    size_t dropped; // Leading bytes of a mapping already released.
+    int eof;        // No more data can be read from fd.
+};
+/**********************************************************************  Redirections and pipeline stages **********************************************************************/
+#define LSH_REDIR_FILE 0  // Open a file (<, >, >>).
+#define LSH_REDIR_DATA 1  // Read text held by the shell (here-document, here-string).
+#define LSH_REDIR_DUP 2   // Copy another descriptor (2>&1, <&3).
+#define LSH_REDIR_CLOSE 3 // Close the descriptor (2>&-).
+
+struct lsh_redir
+{
+    int fd;           // Descriptor being redirected.
+    int type;         // LSH_REDIR_FILE, _DATA, _DUP or _CLOSE.
+    int flags;        // open(2) flags for the target file.
+    const char *path; // Target file, or the text of a here-document.
+    int src;          // Descriptor opened on the target, -1 until opened.
+    int dup;          // Descriptor copied by LSH_REDIR_DUP.
+};
+
+/**********************************************************************  Per-command arena **********************************************************************/
+struct lsh_arena_block
+{
+    struct lsh_arena_block *next; // Older block.
+    size_t size;                  // Usable bytes in data.
+    size_t used;                  // Bytes handed out so far.
+    char data[];                  // Allocation space.
+};
+
+struct lsh_arena
+{
+    struct lsh_arena_block *head; // Newest block; allocations bump through it.
+    void *last;                   // Newest allocation, which can grow in place.
+    size_t in_use;                // Bytes handed out since the last reset.
+    size_t peak;                  // Largest in_use seen.
+    size_t reserved;              // Bytes held in blocks.
+    size_t blocks;                // Number of blocks held.
+    unsigned long allocs;         // Allocations served since startup.
+};
+
+struct lsh_path_entry
+{
+    char *name;                  // Command name as typed.
+    char *path;                  // Absolute location found on $PATH.
+    int hits;                    // Number of times the entry was used.
+    struct lsh_path_entry *next; // Next entry in the same bucket.
+};
+
+struct lsh_stage
+{
+    char **args;              // Command and arguments of the stage.
+    struct lsh_redir *redirs; // Redirections stripped from args.
+    int nredirs;              // Number of redirections.
+    pid_t pid;                // Child running the stage (0 if it never started).
+    int status;               // Shell exit status once reaped or if it failed to start.
+    int text_off;             // Offset of the stage in the job text.
+    struct timespec start;    // When the stage was started (timed jobs only).
+    struct lsh_node *node;    // Subshell, group or list run by a forked shell instead of args.
+};
+
+struct lsh_pipe_cpus
+{
+    const char *spec; // PIPE_CPUS value the list was worked out for, NULL before the first stage.
+    int *cpus;        // CPUs stages take in turn (command arena), NULL if spec is invalid.
+    int n;            // Number of CPUs.
+    int start;        // Position in cpus of the first stage.
+};
+/**********************************************************************  Job table **********************************************************************/
+#define LSH_JOB_RUNNING 0 // Process or job is running.
+#define LSH_JOB_STOPPED 1 // Process or job is stopped.
+#define LSH_JOB_DONE 2    // Process or job has exited.
+
+struct lsh_proc
+{
+    pid_t pid;  // Child running one stage (0 if it never started).
+    int status; // Shell exit status once done.
+    int state;  // LSH_JOB_RUNNING, LSH_JOB_STOPPED or LSH_JOB_DONE.
+    int text_off;           // Offset of the stage in the job text.
+    struct timespec start;  // When the stage was started (timed jobs only).
+    struct timespec end;    // When the stage was reaped.
+    struct rusage ru;       // Resource usage reported by wait4.
+    int pidfd;              // pidfd in the event loop, -1 if none.
+    int blind;              // Running without a pidfd; found by scanning on SIGCHLD.
+    int pipe_fd;            // Shell's copy of the read end of the pipe the stage writes, -1 if not sampled.
+    int pipe_size;          // Capacity of that pipe.
+    int pipe_peak;          // Most bytes seen waiting in it.
+    long pipe_total;        // Sum of all samples, for the mean.
+    int pipe_samples;       // Number of samples taken.
+    int pipe_full;          // Samples with less than a page free.
+    int pipe_empty;         // Samples with nothing waiting.
+};
+
+struct lsh_job
+{
+    int id;                // Job number shown as [id].
+    pid_t pgid;            // Process group of the job.
+    char *text;            // Command text for jobs listings.
+    int background;        // Listed by jobs (started with & or stopped).
+    int notified;          // A stop has been reported.
+    int has_tmodes;        // tmodes holds the terminal modes the job left.
+    struct termios tmodes; // Terminal modes to restore on fg.
+    int timed;             // Started with the time prefix.
+    struct timespec start; // When the first stage was started.
+    long spawn_ns;         // Time the shell spent starting the stages.
+    long parse_ns;         // Time the shell spent tokenizing the line.
+    int watched;           // Its pipes are sampled while the shell waits.
+    struct lsh_job *next;  // Next job by number.
+    int nprocs;            // Number of stages.
+    struct lsh_proc procs[]; // One entry per stage.
+};
+
+/**********************************************************************  Parallel built-in **********************************************************************/
+struct lsh_par_slot
+{
+    long seq;    // Position of the item in the input.
+    char **argv; // Command for the item (argv and strings in one allocation).
+    pid_t pid;   // Child running the item.
+    int pidfd;   // pidfd of the child, -1 if unavailable.
+    int out;     // Anonymous file holding the item's output.
+    int status;  // Exit status once done.
+    int state;   // -1 free, LSH_JOB_RUNNING or LSH_JOB_DONE.
+};
+/**********************************************************************  Spawn helper (zygote) protocol **********************************************************************/
+#define LSH_ZYGOTE_FDS 4 // stdin, stdout, stderr and the working directory travel with each request.
+
+struct lsh_zygote_req
+{
+    size_t len;  // Bytes of path, argv and environment strings that follow.
+    int argc;    // Number of argv strings.
+    int envc;    // Number of environment strings, -1 to reuse the last ones sent.
+    pid_t pgid;  // Process group to join (0: a new one).
+    int setpgid; // Job control is on; join pgid.
+};
+
+struct lsh_zygote_reply
+{
+    pid_t pid; // Started child, or -1.
+    int err;   // errno of a failed clone or exec, 0 on success.
+};
+/**********************************************************************  Server mode protocol **********************************************************************/
+#define LSH_SERVE_FDS 3                  // stdin, stdout and stderr may travel with a request.
+#define LSH_SERVE_MAX_REQUEST (16 << 20) // Largest request a session accepts.
+#define LSH_SERVE_STDOUT 1               // Frame of collected standard output.
+#define LSH_SERVE_STDERR 2               // Frame of collected standard error.
+#define LSH_SERVE_EXIT 3                 // Last frame of a request.
+
+struct lsh_serve_req
+{
+    size_t len; // Bytes of command, directory and NAME=value strings that follow.
+    int envc;   // Number of NAME=value strings after the directory.
+};
+
+struct lsh_serve_frame
+{
+    int type; // LSH_SERVE_STDOUT, LSH_SERVE_STDERR or LSH_SERVE_EXIT.
+    int len;  // Bytes that follow, or the exit status of an LSH_SERVE_EXIT frame.
+};
+/**********************************************************************  Command history **********************************************************************/
+#define LSH_HIST_FILE ".minishell_history" // History file in $HOME unless $HISTFILE is set.
+#define LSH_HIST_SIZE 100000               // Entries kept when $HISTSIZE is not set.
+#define LSH_HIST_CHUNK 65536               // Storage block for lines added this session.
+#define LSH_HIST_BLOCK 64                  // Entries covered by one trigram filter.
+#define LSH_HIST_BLOOM_SHIFT 12            // log2 of the bits in a block filter.
+#define LSH_HIST_QUERY_TRIGRAMS 16         // Trigrams of a query checked against the filters.
+
+struct lsh_hist_entry
+{
+    const char *line; // Command text, not NUL-terminated (may point into the file mapping).
+    size_t len;       // Length of the text.
+};
+
+struct lsh_history
+{
+    char *path;                     // History file.
+    int fd;                         // History file opened for appending, or -1.
+    char *map;                      // Read-only mapping of the file as it was at startup.
+    size_t map_len;                 // Length of the mapping.
+    struct lsh_hist_entry *entries; // Entries, oldest first.
+    long count;                     // Number of entries.
+    long cap;                       // Allocated entries.
+    long max;                       // $HISTSIZE: entries kept in memory.
+    long file_max;                  // $HISTFILESIZE: lines kept in the file.
+    long file_lines;                // Lines in the file, counted at startup and on every append.
+    int ignoredups;                 // $HISTCONTROL ignoredups: skip a repeat of the previous line.
+    int ignorespace;                // $HISTCONTROL ignorespace: skip lines starting with a space.
+    char *chunk;                    // Current storage block for new lines.
+    size_t chunk_used;              // Bytes used in chunk.
+    unsigned char (*blooms)[1 << (LSH_HIST_BLOOM_SHIFT - 3)]; // Trigram filter per full block.
+    long nblooms;                   // Blocks with a filter.
+};
+/**********************************************************************  Lexer **********************************************************************/
+#define LSH_LEX_SPACE 1  // Whitespace between words.
+#define LSH_LEX_QUOTE 2  // ' or " opening a quoted string.
+#define LSH_LEX_ESCAPE 3 // Backslash.
+#define LSH_LEX_OP 4     // < > | & ; ( ) operators.
+#define LSH_LEX_HASH 5   // '#', a comment at the start of a word.
+#define LSH_LEX_TICK 6   // Backquote, an old-style command substitution.
+
+#define LSH_TOK_WORD 0           // Word text.
+#define LSH_TOK_INPUT 1          // <
+#define LSH_TOK_OUTPUT 2         // >
+#define LSH_TOK_APPEND 3         // >>
+#define LSH_TOK_PIPE 4           // |
+#define LSH_TOK_BACKGROUND 5     // &
+#define LSH_TOK_SEMI 6           // ;
+#define LSH_TOK_AND 7            // &&
+#define LSH_TOK_OR 8             // ||
+#define LSH_TOK_LPAREN 9         // (
+#define LSH_TOK_RPAREN 10        // )
+#define LSH_TOK_HEREDOC 11       // <<
+#define LSH_TOK_HEREDOC_STRIP 12 // <<- (leading tabs of the body are dropped)
+#define LSH_TOK_HERESTRING 13    // <<<
+#define LSH_TOK_DUPIN 14         // <&
+#define LSH_TOK_DUPOUT 15        // >&
+#define LSH_TOK_OUTERR 16        // &>
+#define LSH_TOK_APPENDERR 17     // &>>
+#define LSH_TOK_FD0 18           // Descriptor number 0-9 written straight before a redirection (2>file).
+#define LSH_TOK_KINDS 28         // Number of token kinds.
+#define LSH_TOK_RBRACE 28        // } closing a group (a word, only meaningful to the parser).
+
+struct lsh_token
+{
+    unsigned int off;    // Start of the slice in the line.
+    unsigned int len;    // Length of the slice (quotes excluded).
+    unsigned char kind;  // LSH_TOK_WORD or an operator.
+    unsigned char join;  // The word continues the previous one ("a"b, a'b').
+    unsigned char quote; // ' or " around the slice, 0 if unquoted.
+    unsigned char tick;  // The slice holds a backquote.
+};
+/**********************************************************************  Variables and environment **********************************************************************/
+#define LSH_VAR_BUCKETS 512      // Buckets in the variable hash table.
+#define LSH_CTL_DOLLAR '\001'    // Stands for a quoted or escaped $ between lexing and expansion.
+#define LSH_CTL_TICK '\002'      // Stands for a quoted or escaped backquote.
+#define LSH_CTL_QSUBST '\003'    // $( inside double quotes: the output stays one word.
+#define LSH_CTL_QTICK '\004'     // Opening backquote inside double quotes.
+#define LSH_CTL_FIELD '\005'     // Field break left by an unquoted command substitution.
+#define LSH_EXPAND_CHARS "$`\001\002\003\004" // Bytes that make a word go through expansion.
+#define LSH_NAME_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_" // Characters of a variable name.
+
+struct lsh_var
+{
+    char *entry;          // "NAME=value"; exported variables put this very string in envp.
+    size_t name_len;      // Length of NAME.
+    int exported;         // Passed to commands in their environment.
+    struct lsh_var *next; // Next variable in the same bucket.
+};
+
+struct lsh_saved_var
+{
+    char *name;   // Variable set for one command by a NAME=value prefix.
+    char *value;  // Value before the command, NULL if it was unset.
+    int exported; // Export flag before the command.
+};
+
+struct lsh_expand_buf
+{
+    char *buf;  // Expanded word (in the command arena).
+    size_t len; // Bytes used.
+    size_t cap; // Bytes allocated.
+};
+/**********************************************************************  Glob and brace expansion **********************************************************************/
+#define LSH_CTL_GLOB '\016'      // A quoted or escaped byte of LSH_GLOB_QUOTE becomes LSH_CTL_GLOB plus its index there.
+#define LSH_GLOB_QUOTE "*?[{,}"  // Pattern and brace bytes that only count unquoted.
+#define LSH_GLOB_CTL "\016\017\020\021\022\023" // The markers.
+#define LSH_GLOB_CHARS "*?[{" LSH_GLOB_CTL // Bytes that make a word go through braces, globbing or marker removal.
+#define LSH_GLOB_DENTS (256 << 10) // Buffer for one getdents64 call.
+#define LSH_GLOB_BUCKETS 256     // Buckets of the per-command directory cache.
+
+struct lsh_brace_seq
+{
+    long first; // First item ({1..9}, or a character for {a..z}).
+    long last;  // Last item, reached or passed.
+    long step;  // Distance between items, always positive; 0 for a list of alternatives.
+    int width;  // Zero-padded width, 0 for none.
+    int chars;  // Items are characters.
+};
+
+struct lsh_glob_dir
+{
+    struct lsh_glob_dir *next; // Next directory in the same bucket.
+    const char *path;          // Directory as patterns name it ("" for the current one).
+    char **names;              // Entry names, sorted; the byte before each name is its d_type.
+    int count;                 // Number of entries.
+};
+
+struct lsh_glob
+{
+    struct lsh_glob_dir *dirs[LSH_GLOB_BUCKETS]; // Directories read while expanding this command.
+    char path[PATH_MAX];                         // Path matched so far, with a trailing slash.
+    char **comps;                                // Pattern split at slashes.
+    int ncomps;                                  // Number of components.
+    char ***out;                                 // Expanded words of the command.
+    int *n, *cap;                                // Words used and allocated.
+    int matches;                                 // Matches of the current pattern.
+};
+/**********************************************************************  Parser **********************************************************************/
+#define LSH_NODE_COMMAND 0  // Simple command: words and redirections.
+#define LSH_NODE_PIPELINE 1 // Stages joined by |, or a timed command.
+#define LSH_NODE_AND 2      // left && right.
+#define LSH_NODE_OR 3       // left || right.
+#define LSH_NODE_LIST 4     // left ; right (or left & right).
+#define LSH_NODE_SUBSHELL 5 // ( left ), run in a child.
+#define LSH_NODE_GROUP 6    // { left; }, run in the shell.
+
+struct lsh_node
+{
+    int type;                 // LSH_NODE_*.
+    int background;           // Ended with &: run as a background job.
+    int timed;                // Pipeline prefixed with time.
+    char **args;              // Command words, or the redirections after ( ) and { }.
+    struct lsh_node *left;    // First operand, or the body of ( ) and { }.
+    struct lsh_node *right;   // Second operand.
+    struct lsh_node **stages; // Pipeline stages.
+    int nstages;              // Number of stages.
+    char **words;             // Tokens the node was parsed from, for job texts.
+    int nwords;               // Number of tokens.
+};
+
+struct lsh_parser
+{
+    char **tokens; // Line split by lsh_split_line.
+    int pos;       // Next token.
+    int error;     // A syntax error has been reported.
+};
+/**********************************************************************  Script compile cache **********************************************************************/
+#define LSH_CACHE_MAGIC "LSHCACHE" // First bytes of a compiled script.
+#define LSH_CACHE_VERSION 5        // Bumped whenever the layout or the parser output changes.
+#define LSH_CACHE_NONE 0xffffffffu // Line without source text.
+#define LSH_CACHE_NIL 0xffff       // Absent node or token run; also the most nodes, tokens or stages a compiled line has.
+#define LSH_CACHE_OP 0x80000000u   // Token entry holding an operator kind rather than a string offset.
+
+// A compiled script is the header followed by the line, token, node, stage and string tables, in that order.
+// Nodes, tokens and stages are numbered from the first one of their line, so they fit in 16 bits.
+struct lsh_cache_header
+{
+    char magic[8];         // LSH_CACHE_MAGIC.
+    uint32_t version;      // LSH_CACHE_VERSION.
+    uint32_t nlines;       // Entries of the line table.
+    uint64_t src_size;     // Size of the script it was compiled from.
+    int64_t src_mtime;     // Modification time of the script, seconds.
+    int64_t src_mtime_ns;  // Nanoseconds of the modification time.
+    uint32_t path;         // Absolute path of the script, in the string table.
+    uint32_t nnodes;       // Entries of the node table.
+    uint32_t ntokens;      // Entries of the token table.
+    uint32_t nstages;      // Entries of the stage table.
+    uint32_t strings_len;  // Bytes of the string table.
+    uint32_t reserved;     // Keeps the tables 8-byte aligned.
+};
+
+struct lsh_cache_line
+{
+    uint32_t nodes;   // First node of the line.
+    uint32_t tokens;  // First token of the line.
+    uint32_t stages;  // First stage entry of the line.
+    uint32_t text;    // Source of a line that is parsed when it runs (syntax error, or too big), else LSH_CACHE_NONE.
+    uint16_t nnodes;  // Nodes of the line.
+    uint16_t ntokens; // Tokens of the line.
+    uint16_t nstages; // Stage entries of the line.
+    uint16_t root;    // Root node, LSH_CACHE_NIL for a line without commands.
+};
+
+struct lsh_cache_node
+{
+    uint8_t type;       // LSH_NODE_*.
+    uint8_t background; // Ended with &.
+    uint8_t timed;      // Prefixed with time.
+    uint8_t unused;     // Padding.
+    uint16_t left;      // First operand or body; children always come after their parent.
+    uint16_t right;     // Second operand.
+    uint16_t stages;    // First stage entry.
+    uint16_t nstages;   // Number of stages.
+    uint16_t args;      // First token of argv, LSH_CACHE_NIL for no argv.
+    uint16_t nargs;     // Words of argv.
+    uint16_t words;     // First token of the job text, LSH_CACHE_NIL for none.
+    uint16_t nwords;    // Tokens of the job text.
+};
+
+struct lsh_cache
+{
+    char *image;                  // The compiled script, mapped from the cache file or built in memory.
+    size_t size;                  // Bytes of image.
+    int mapped;                   // image is a mapping rather than malloc'd.
+    struct lsh_cache_header *hdr; // Header at the start of image.
+    struct lsh_cache_line *lines; // Line table.
+    struct lsh_cache_node *nodes; // Node table.
+    uint32_t *tokens;             // Token table.
+    uint16_t *stages;             // Stage table.
+    char *strings;                // String table.
+};
+
+struct lsh_cache_buf
+{
+    char *data; // Table being built (malloc'd).
+    size_t len; // Bytes used.
+    size_t cap; // Bytes allocated.
+};
+
+struct lsh_cache_build
+{
+    struct lsh_cache_buf lines, nodes, tokens, stages, strings; // Tables of the script being compiled.
+    uint32_t *str_slots; // Open-addressed set of string offsets plus one, so equal words are stored once.
+    size_t str_cap;      // Slots in str_slots (power of two).
+    size_t str_count;    // Strings in the table.
+    int failed;          // The current line could not be flattened.
+};
+/**********************************************************************  Line editor and completion **********************************************************************/
+#define LSH_CTRL(c) ((c) & 0x1f)     // Key code of Ctrl plus a letter.
+#define LSH_KEY_ALT 0x100            // Added to a key typed with Alt (ESC prefix).
+#define LSH_KEY_UP 0x200             // Cursor keys and friends, decoded from escape sequences.
+#define LSH_KEY_DOWN 0x201
+#define LSH_KEY_LEFT 0x202
+#define LSH_KEY_RIGHT 0x203
+#define LSH_KEY_HOME 0x204
+#define LSH_KEY_END 0x205
+#define LSH_KEY_DELETE 0x206
+#define LSH_KEY_JOBS 0x300           // Not a key: a background job finished while the line was edited (set -o notify).
+#define LSH_KEY_ESC_MS 50            // How long after ESC the rest of an escape sequence may take.
+#define LSH_COMPLETE_SHOW 100        // Candidates listed on a second Tab.
+
+struct lsh_editor
+{
+    const char *prompt; // Prompt in front of the line, for full redraws.
+    char *buf;          // Line being edited.
+    size_t len;         // Bytes in buf.
+    size_t cap;         // Allocated bytes.
+    size_t pos;         // Cursor position in buf.
+    size_t pos_shown;   // Where the terminal cursor is now.
+    long hist_pos;      // History entry shown (count: the line being typed).
+    char *saved;        // The line being typed while browsing history.
+    char *yank;         // Kill buffer (Ctrl-K/U/W, Ctrl-Y).
+    char out[4096];     // Terminal output of the current key.
+    size_t out_len;     // Bytes in out.
+};
+
+struct lsh_cmd_dir
+{
+    char *path;            // Directory from $PATH.
+    struct timespec mtime; // Modification time when it was scanned.
+    char **names;          // Executables found in it.
+    int count;             // Number of names.
+    int cap;               // Allocated names.
+};
+
+struct lsh_cmd_index
+{
+    char *path_env;          // $PATH the index was built for.
+    struct lsh_cmd_dir *dirs; // One entry per $PATH directory.
+    int ndirs;               // Number of directories.
+    char **names;            // Built-ins and executables, sorted and unique.
+    int count;               // Number of names.
+};
+
+struct lsh_completion
+{
+    char **items; // Candidates (in the command arena); directories end in '/'.
+    int count;    // Number of candidates.
+    int cap;      // Allocated candidates.
+};
 /**********************************************************************  Function Prototypes **********************************************************************/
 
 int lsh_cd(char **args);             // Change directory.
@@ -28,17 +548,328 @@ int lsh_exit(char **args);           // Exit the shell.
 int lsh_pwd(char **args);            // Print working directory.
 int lsh_echo(char **args);           // Echo arguments.
 int handle_redirection(char **args); // Handle input/output redirection.
-int find_pipe(char **args);          // Find pipe in the command.
-int execute_pipeline(char **args);   // Execute command pipeline.
-int lsh_launch(char **args);         // Launch a new process.
+int lsh_launch(char **args, int background);       // Launch a new process.
 int lsh_execute(char **args);        // Execute a command.
+struct lsh_node *lsh_parse(char **tokens, int *error);              // Parse a line into a tree.
+size_t lsh_cache_put(struct lsh_cache_buf *b, const void *data, size_t n); // Append to a table being built.
+uint32_t lsh_cache_string(struct lsh_cache_build *b, const char *s); // Offset of a string in the string table.
+uint16_t lsh_cache_put_node(struct lsh_cache_build *b, struct lsh_node *node, char **tokens, struct lsh_cache_line *l); // Flatten a tree.
+char *lsh_cache_compile(struct lsh_input *in, const char *path, struct stat *st, size_t *size); // Compile a script.
+int lsh_cache_load(struct lsh_cache *c, char *image, size_t size, const char *path, struct stat *st); // Check a compiled script.
+char *lsh_cache_file(const char *path);                             // Cache file of a script.
+void lsh_cache_write(const char *file, const char *image, size_t size); // Save a compiled script.
+int lsh_cache_open(struct lsh_cache *c, const char *script);         // Map or compile a script.
+void lsh_cache_close(struct lsh_cache *c);                          // Release a compiled script.
+struct lsh_node *lsh_cache_thaw(struct lsh_cache *c, struct lsh_cache_line *l); // Tree of one compiled line.
+void lsh_cache_loop(struct lsh_cache *c);                           // Run a compiled script.
+struct lsh_node *lsh_parse_list(struct lsh_parser *p, int closer);  // Parse and-or lists up to a closer.
+struct lsh_node *lsh_parse_and_or(struct lsh_parser *p);            // Parse pipelines joined by && and ||.
+struct lsh_node *lsh_parse_pipeline(struct lsh_parser *p);          // Parse commands joined by |.
+struct lsh_node *lsh_parse_command(struct lsh_parser *p);           // Parse a command, subshell or group.
+char **lsh_parse_words(struct lsh_parser *p, int redirs_only);      // Collect words and redirections.
+struct lsh_node *lsh_parse_error(struct lsh_parser *p);             // Report a syntax error.
+int lsh_parse_closes(const char *tok, int closer);                  // Token ends the current list.
+struct lsh_node *lsh_node_new(int type, struct lsh_node *left, struct lsh_node *right); // Allocate a tree node.
+int lsh_tok_kind(const char *tok);                                  // Operator kind of a token.
+int lsh_tok_redirect(int kind);                                     // Token kind is a redirection operator.
+int lsh_exec_node(struct lsh_node *node);                           // Evaluate a tree.
+int lsh_exec_pipeline(struct lsh_node *node, int background);       // Run a pipeline as a job.
+int lsh_exec_group(struct lsh_node *node);                          // Run a group in the shell.
+int lsh_exec_subshell(struct lsh_node *node);                       // Evaluate a tree in a forked child.
+int *lsh_save_redirections(struct lsh_redir *redirs, int n);        // Park descriptors a redirection replaces.
+void lsh_restore_redirections(struct lsh_redir *redirs, int n, int *saved); // Put parked descriptors back.
 char **lsh_split_line(char *line);   // Split a line into tokens.
-char *lsh_read_line(void);           // Read a line from input.
+int lsh_glob_quoted(const char *s, size_t n, int quote); // Slice has pattern bytes to mark literal.
+int lsh_read_heredocs(char **tokens, struct lsh_input *in);         // Read the bodies of a line's here-documents.
+struct lsh_token *lsh_lex(const char *line, size_t len, int *ntokens); // Split a line into slices.
+const char *lsh_lex_dquote(const char *p, const char *end);         // End of a double-quoted string.
+const char *lsh_lex_unescaped(const char *p, const char *end, char c); // Next byte c without a backslash before it.
+const char *lsh_lex_subst(const char *p, const char *end);          // End of a $( command substitution.
+const char *lsh_lex_scan_scalar(const char *p, const char *end);    // Next special byte, one at a time.
+const char *lsh_lex_scan_sse2(const char *p, const char *end);      // Next special byte, 16 at a time.
+const char *lsh_lex_scan_avx2(const char *p, const char *end);      // Next special byte, 32 at a time.
+void lsh_lex_init(void);                                            // Choose the scanner for this CPU.
+char *lsh_read_line(const char *prompt); // Read a line from input.
+char *lsh_edit_line(const char *prompt);                            // Read a line with the raw-mode editor.
+int lsh_edit_raw(int on);                                           // Switch the terminal in and out of raw mode.
+int lsh_edit_key(void);                                             // Read one key, decoding escape sequences.
+int lsh_edit_seq_byte(unsigned char *c);                            // Next byte of an escape sequence, if it comes soon.
+void lsh_edit_out(struct lsh_editor *e, const char *s, size_t n);   // Queue terminal output.
+void lsh_edit_tail(struct lsh_editor *e, size_t from);              // Redraw from a position to the end.
+void lsh_edit_refresh(struct lsh_editor *e);                        // Redraw prompt and line.
+void lsh_edit_move(struct lsh_editor *e, size_t pos);               // Move the cursor.
+void lsh_edit_insert(struct lsh_editor *e, const char *s, size_t n); // Insert text at the cursor.
+void lsh_edit_delete(struct lsh_editor *e, size_t from, size_t to, int kill); // Delete a range of the line.
+void lsh_edit_set(struct lsh_editor *e, const char *s, size_t n);   // Replace the whole line.
+void lsh_edit_history(struct lsh_editor *e, int dir);               // Show an older or newer history entry.
+int lsh_edit_search(struct lsh_editor *e);                          // Ctrl-R incremental history search.
+void lsh_edit_complete(struct lsh_editor *e, int again);            // Tab completion.
+void lsh_cmd_index_refresh(void);                                   // Bring the command index up to date.
+void lsh_cmd_dir_scan(struct lsh_cmd_dir *d);                       // List the executables of one directory.
+int lsh_cmd_compare(const void *a, const void *b);                  // Order names for sorting.
+void lsh_complete_add(struct lsh_completion *c, const char *name, int is_dir); // Add a completion candidate.
+void lsh_complete_commands(struct lsh_completion *c, const char *prefix); // Command names with a prefix.
+void lsh_complete_files(struct lsh_completion *c, const char *word); // File names for a partial path.
+int lsh_input_fd(struct lsh_input *in, int fd);             // Read batch input from a descriptor.
+int lsh_input_file(struct lsh_input *in, const char *path); // Read batch input from a script file.
+int lsh_input_string(struct lsh_input *in, const char *s);  // Read batch input from a string.
+char *lsh_input_line(struct lsh_input *in);                 // Return the next batch line.
+void lsh_input_close(struct lsh_input *in);                 // Release a batch input source.
+void lsh_loop(struct lsh_input *in);                        // Main read/execute loop.
 int lsh_num_builtins();              // Return the number of built-in commands.
+int lsh_set(char **args);            // Set shell options.
+int lsh_hash(char **args);           // Show or reset remembered command locations.
+int lsh_memstat(char **args);        // Show arena and memory usage.
+int lsh_true(char **args);           // Succeed.
+int lsh_false(char **args);          // Fail.
+int lsh_test(char **args);           // Evaluate a test / [ expression.
+int lsh_printf(char **args);         // Formatted output.
+int lsh_cat(char **args);            // Concatenate files.
+int lsh_head(char **args);           // First lines of files.
+int lsh_wc(char **args);             // Count lines, words and bytes.
+int lsh_sleep(char **args);          // Pause for a while.
+int lsh_jobs_builtin(char **args);   // List jobs.
+int lsh_fg(char **args);             // Resume a job in the foreground.
+int lsh_bg(char **args);             // Resume a job in the background.
+int lsh_wait(char **args);           // Wait for background jobs.
+int lsh_history_builtin(char **args); // Show or search the command history.
+int lsh_export(char **args);         // Export variables to commands.
+int lsh_unset(char **args);          // Remove variables.
+void lsh_history_init(void);                                        // Load the history file.
+void lsh_history_add(const char *line);                             // Record a command line.
+void lsh_history_push(const char *line, size_t len);                // Append an entry in memory.
+void lsh_history_trim(void);                                        // Rewrite the history file with the newest entries.
+void lsh_history_index(void);                                       // Build trigram filters for full blocks.
+unsigned int lsh_history_trigram(const char *p);                    // Filter bit of a trigram.
+long lsh_history_find(const char *query, long before);              // Newest matching entry before an index.
+int lsh_parallel(char **args);       // Run a command for every input line, several at a time.
+char **lsh_par_command(char **tmpl, const char *item);              // Fill a parallel template with an item.
+int lsh_par_start(struct lsh_par_slot *slot, char **tmpl, const char *item, int null_fd); // Start one parallel item.
+int lsh_par_wait(struct lsh_par_slot *slots, int nslots);           // Wait for parallel items to end.
+void lsh_par_finish(struct lsh_par_slot *slot, int *failed);        // Write out a finished parallel item.
+int lsh_test_eval(char **args, int n);                              // Evaluate test operands.
+const char *lsh_print_escape(const char *p);                        // Print one printf escape.
+int lsh_printf_check(const char *arg, const char *end);             // Report a numeric printf argument that did not convert.
+int lsh_write_all(int fd, const char *buf, size_t len);             // Write a whole buffer.
+int lsh_fd_high(int fd);                                            // Move a descriptor above the ones scripts name.
+int lsh_open_input(const char *name, const char *cmd);              // Open a file operand or stdin.
+int lsh_copy_fd(int in_fd, int out_fd);                             // Copy descriptor data without user-space buffers.
+void lsh_init_builtins(void);                                       // Build the built-in dispatch table.
+unsigned int lsh_builtin_hash(const char *name, unsigned int seed); // Slot of a built-in name.
+int lsh_call_builtin(int b, char **args);                           // Call a built-in, interruptible by Ctrl-C.
+void lsh_sigint_handler(int sig);                                   // Note Ctrl-C during a built-in.
+int lsh_find_builtin(const char *name);                             // Index of a built-in, or -1.
+int lsh_exit_status(int status);                                    // Wait status to shell exit status.
+int lsh_parse_redirections(char **args, struct lsh_redir **redirs); // Strip redirections out of a command.
+int lsh_open_redirections(struct lsh_redir *redirs, int n);         // Open redirection targets.
+void lsh_close_redirections(struct lsh_redir *redirs, int n);       // Close opened redirection targets.
+int lsh_redir_data(const char *data);                                // Descriptor reading here-document text.
+int lsh_apply_redirections(struct lsh_redir *redirs, int n);        // dup2 opened targets into place.
+int lsh_fork_stage(struct lsh_stage *stage, int in_fd, int out_fd, int close_fd, pid_t pgid); // Start a stage with fork.
+int lsh_posix_spawn_stage(struct lsh_stage *stage, int in_fd, int out_fd, pid_t pgid);      // Start a stage with posix_spawn.
+char **lsh_sh_argv(const char *path, char **args);                  // argv running a script without #! through /bin/sh.
+int lsh_spawn(struct lsh_stage *stage, int in_fd, int out_fd, int close_fd, pid_t pgid);     // Start one pipeline stage.
+int lsh_zygote_stage(struct lsh_stage *stage, int in_fd, int out_fd, pid_t pgid);           // Start a stage through the helper.
+int lsh_zygote_request(const char *path, char **args, int *fds, pid_t pgid, struct lsh_zygote_reply *reply); // Send one launch request.
+int lsh_zygote_start(void);                                         // Start the spawn helper.
+void lsh_zygote_stop(void);                                         // Stop the spawn helper.
+void lsh_zygote_option(void);                                       // Apply set -o/+o zygote.
+int lsh_zygote_serve(int sock);                                     // Spawn helper main loop.
+int lsh_read_all(int fd, void *buf, size_t len);                    // Read exactly len bytes.
+int lsh_serve(const char *path, int max);                           // Server mode: accept sessions on a socket.
+int lsh_serve_session(int sock);                                    // Run the requests of one connection.
+int lsh_serve_run(const char *line, const char *cwd, char **env, int envc, struct lsh_arena *a); // Run one request.
+int lsh_serve_copy(int sock, int fd, int type);                     // Send collected output as frames.
+void lsh_serve_hangup(int sig);                                     // SIGIO: end a session whose client went away.
+int lsh_serve_connect(const char *path);                            // Connect to a server.
+int lsh_serve_request(int sock, const char *line, const char *cwd, char **env, int envc, const int *fds); // Run a request remotely.
+int lsh_client(int argc, char **argv);                              // minishell --client main.
+int lsh_run_stages(struct lsh_stage *stages, int nstages, int background); // Start a pipeline as a job.
+struct lsh_job *lsh_job_add(struct lsh_stage *stages, int n, pid_t pgid, const char *text); // Add a job.
+void lsh_job_remove(struct lsh_job *job);                           // Drop a job from the table.
+int lsh_job_state(struct lsh_job *job);                             // Running, stopped or done.
+int lsh_job_update(pid_t pid, int status, struct rusage *ru);       // Record a child's wait status.
+int lsh_job_status(struct lsh_job *job);                            // Exit status of a finished job.
+int lsh_job_wait(struct lsh_job *job);                              // Wait until a job finishes or stops.
+void lsh_job_continue(struct lsh_job *job);                         // Resume a stopped job.
+int lsh_job_foreground(struct lsh_job *job, int resume);            // Run a job in the foreground.
+struct lsh_job *lsh_job_find(const char *spec, const char *cmd);    // Look up a job argument.
+void lsh_reap_jobs(void);                                           // Collect children that changed state.
+void lsh_notify_jobs(void);                                         // Report and drop finished jobs.
+void lsh_sigchld_handler(int sig);                                  // Note that a child changed state.
+void lsh_init_signals(void);                                        // Install the SIGCHLD handler.
+int lsh_event_init(void);                                           // Create the epoll set and the signalfd.
+void lsh_event_reset(void);                                         // Drop the parent's event loop in a forked child.
+void lsh_event_watch(struct lsh_proc *p);                           // Add a job stage's pidfd to the event loop.
+void lsh_event_forget(struct lsh_proc *p);                          // Remove a job stage from the event loop.
+int lsh_event_poll(int timeout);                                    // Handle ready children and signals.
+void lsh_reap_scan(struct lsh_job *job, int all);                   // wait4 running stages of one job or all, or those without a pidfd.
+void lsh_proc_update(struct lsh_proc *p, int status, struct rusage *ru); // Record one stage's wait status.
+int lsh_jobs_changed(void);                                         // A background job has something to report.
+void lsh_time_row(const char *label, double real, struct rusage *ru, const char *cmd, int len); // Print one line of a time report.
+void lsh_time_report(struct lsh_job *job);                          // Print the time report of a timed job.
+int lsh_time_builtin(char **args);                                  // Time a command that runs in the shell.
+long lsh_elapsed_ns(struct timespec *from, struct timespec *to);    // Nanoseconds between two times.
+const char *lsh_stage_var(struct lsh_stage *stage, const char *name); // Variable as set for one stage.
+long lsh_parse_size(const char *s);                                 // Byte count with an optional K/M/G suffix.
+int lsh_cpu_list(const char *s, int *cpus, int max);                // Parse a list of CPUs such as 0-3,8.
+int lsh_pipe_cpus(const char *spec, struct lsh_pipe_cpus *pc);      // CPUs the stages of a pipeline take in turn.
+void lsh_sched_stage(struct lsh_stage *stage, int index, struct lsh_pipe_cpus *pc); // Apply PIPE_CPUS, PIPE_NICE and PIPE_IONICE.
+void lsh_pipe_sample(struct lsh_job *job);                          // Record how full the pipes of a job are.
+void lsh_pipe_release(struct lsh_job *job, int all);                // Close sampled pipes nobody reads any more.
+char **lsh_expand_words(char **args);                               // Expand $ parameters in every word.
+char *lsh_expand_word(const char *word, int *split);                // Expand $ parameters and substitutions in one word.
+void lsh_expand_reserve(struct lsh_expand_buf *b, size_t n);        // Make room in a word being expanded.
+void lsh_expand_read(struct lsh_expand_buf *b, int fd);             // Append what a descriptor delivers.
+int lsh_subst_inline(struct lsh_node *node);                        // Substitution can run in the shell.
+void lsh_expand_command(struct lsh_expand_buf *b, const char *text, size_t len, int split); // Command substitution.
+char **lsh_expand_push(char **out, int *n, int *cap, char *word);   // Add a word to an expanded command.
+void lsh_expand_append(struct lsh_expand_buf *b, const char *s, size_t n); // Append to a word being expanded.
+void lsh_expand_protect(struct lsh_expand_buf *b, size_t from);     // Keep pattern bytes of a value literal.
+char *lsh_expand_literal(const char *word);                          // Turn pattern markers back into bytes.
+char **lsh_expand_fields(char **out, int *n, int *cap, char *word, int glob, struct lsh_glob **g); // Glob one field.
+const char *lsh_brace_skip(const char *p, const char *end);         // Step over a command substitution.
+int lsh_brace_number(const char *p, const char *end, long *value);  // Parse a sequence end or step.
+int lsh_brace_sequence(const char *s, size_t len, struct lsh_brace_seq *seq); // Parse first..last[..step].
+const char *lsh_brace_group(const char *word, const char **close, struct lsh_brace_seq *seq); // First group that expands.
+char **lsh_brace_item(char **out, int *n, int *cap, const char *word, const char *open, const char *item, size_t len, const char *rest); // Word with one group replaced.
+char **lsh_brace_expand(char **out, int *n, int *cap, char *word);  // Brace expansion of a word.
+int lsh_glob_byte(unsigned char c);                                 // Byte a pattern byte stands for.
+const char *lsh_glob_bracket(const char *p);                        // End of a [...] expression.
+int lsh_glob_meta(const char *s);                                   // Word holds unquoted pattern bytes.
+int lsh_glob_match(const char *p, const char *s);                   // Match a name against a pattern component.
+void lsh_glob_sort(char **names, char **tmp, int count, size_t depth); // Byte-order sort of names.
+struct lsh_glob_dir *lsh_glob_read(struct lsh_glob *g, size_t plen); // Cached directory listing.
+int lsh_glob_isdir(struct lsh_glob *g, size_t len, const char *name, int follow); // Entry is a directory.
+void lsh_glob_add(struct lsh_glob *g, size_t len, const char *name); // Add a match to the command.
+void lsh_glob_walk(struct lsh_glob *g, size_t plen, int ci);        // Match components from ci on.
+int lsh_glob(struct lsh_glob *g, char *word);                       // Expand a pattern into the command.
+void lsh_vars_init(void);                                           // Load the startup environment.
+void lsh_pwd_update(int moved);                                     // Set $PWD (and $OLDPWD) to the current directory.
+unsigned int lsh_var_hash(const char *name, size_t len);            // Hash a variable name.
+struct lsh_var *lsh_var_find(const char *name, size_t len);         // Look up a variable.
+const char *lsh_var_get(const char *name);                          // Value of a variable, or NULL.
+void lsh_var_set(const char *name, size_t len, const char *value, int export); // Set a variable.
+void lsh_var_unset(const char *name);                               // Remove a variable.
+char **lsh_env(void);                                               // envp for commands, rebuilt after changes.
+size_t lsh_assignment_len(const char *word);                        // Name length of a NAME=value word.
+int lsh_assignments(char **args);                                   // Count leading NAME=value words.
+struct lsh_saved_var *lsh_var_push(char **args, int n, struct lsh_arena *a); // Apply NAME=value prefixes for one command.
+void lsh_var_pop(struct lsh_saved_var *saved, int n);               // Undo NAME=value prefixes.
+int lsh_run_builtin(int b, char **args);                            // Run a built-in in-process with redirections.
+void lsh_init(void);                                                // Set up interactive job control.
+unsigned int lsh_hash_string(const char *s);                        // Hash a string for table lookups.
+const char *lsh_path_lookup(const char *name);                      // Resolve a command through the path table.
+char *lsh_path_search(const char *name);                            // Search $PATH for an executable.
+int lsh_path_forget(const char *name);                              // Drop a command from the path table.
+void lsh_path_clear(void);                                          // Empty the path table.
+void *lsh_arena_alloc(struct lsh_arena *a, size_t size);            // Bump-allocate from an arena.
+void *lsh_arena_grow(struct lsh_arena *a, void *p, size_t old_size, size_t new_size); // Grow an arena allocation.
+void lsh_arena_reset(struct lsh_arena *a);                          // Release every allocation of an arena.
+char *lsh_arena_strdup(struct lsh_arena *a, const char *s);         // Copy a string into an arena.
+
+/**********************************************************************  Shell state **********************************************************************/
+int lsh_last_status = 0;        // Exit status of the last command ($?).
+int *lsh_pipe_status = NULL;    // Exit status of each stage of the last pipeline ($PIPESTATUS).
+int lsh_pipe_nstatus = 0;       // Number of entries in lsh_pipe_status.
+int lsh_interactive = 0;        // Reading commands from a terminal; pipelines get their own process group.
+pid_t lsh_shell_pgid = 0;       // Process group that owns the terminal between commands.
+struct termios lsh_shell_tmodes; // Terminal modes of the shell, restored after each job.
+struct lsh_job *lsh_jobs = NULL; // Job table, ordered by job number.
+int lsh_current_job = 0;        // Job number marked '+' (default for fg and bg).
+pid_t lsh_last_bg_pid = 0;      // Last process started in the background ($!).
+volatile sig_atomic_t lsh_sigchld = 0; // A child changed state since the last reap (without the event loop).
+int lsh_event_fd = -1;          // epoll instance holding the signalfd and a pidfd per running job stage.
+int lsh_signal_fd = -1;         // signalfd for SIGCHLD, and SIGINT while a script waits for a job.
+int lsh_event_blind = 0;        // Running job stages without a pidfd; SIGCHLD makes the shell look for them.
+int lsh_event_sigint = 0;       // SIGINT arrived while the shell waited for a job.
+int lsh_serve_sock = -1;        // Server session's connection, raising SIGIO while a request runs.
+struct lsh_job *lsh_wait_job = NULL; // Job the shell is blocked on, checked on every SIGCHLD.
+sigset_t lsh_child_sigmask;     // Signal mask the shell started with, given back to its children.
+int lsh_time_next = 0;          // The next job was prefixed with time.
+long lsh_parse_ns = 0;          // Time spent tokenizing the current line.
+struct lsh_arena lsh_cmd_arena; // Tokens, argv and per-command data; reset after every command.
+char *lsh_glob_dents = NULL;    // getdents64 buffer shared by every directory read.
+unsigned long lsh_cmd_count = 0; // Commands executed since startup.
+volatile sig_atomic_t lsh_interrupted = 0; // Ctrl-C arrived while a built-in ran in the shell.
+int lsh_pipe_size = LSH_PIPE_SIZE; // Capacity requested for pipeline pipes (0 keeps the kernel default).
+int *lsh_pipe_watch = NULL;     // Pipe read ends kept for sampling while a pipeline starts; forked stages close them.
+int lsh_pipe_nwatch = 0;        // Entries in lsh_pipe_watch.
+int lsh_opt_pipefail = 0;       // set -o pipefail: a pipeline fails if any stage fails.
+int lsh_opt_spawn = 1;          // set -o spawn: launch external commands with posix_spawn instead of fork.
+int lsh_opt_zygote = 0;         // set -o zygote: launch external commands through the spawn helper.
+int lsh_opt_notify = 0;         // set -o notify: report finished background jobs at once, not at the next prompt.
+int lsh_zygote_fd = -1;         // Shell's end of the socket to the spawn helper.
+pid_t lsh_zygote_pid = 0;       // Spawn helper process.
+struct lsh_history lsh_history = {.fd = -1}; // Command history (interactive shells only).
+int lsh_edit_enabled = 0;       // Interactive lines are read with the raw-mode editor.
+char *lsh_edit_yank = NULL;     // Kill buffer, kept from one line to the next.
+struct lsh_cmd_index lsh_cmd_index; // $PATH executables for command completion.
+const char *(*lsh_lex_scan)(const char *p, const char *end) = NULL; // Scanner chosen by lsh_lex_init.
+struct lsh_var *lsh_vars[LSH_VAR_BUCKETS]; // Shell variables, exported or not.
+int lsh_vars_ready = 0;         // lsh_vars holds the startup environment.
+char **lsh_envp = NULL;         // Environment of commands, built from the exported variables.
+int lsh_env_dirty = 1;          // lsh_envp must be rebuilt before its next use.
+unsigned long lsh_env_gen = 0;  // Incremented every time lsh_envp is rebuilt.
+unsigned long lsh_zygote_env_gen = 0; // lsh_envp generation the spawn helper holds (0: none).
+pid_t lsh_shell_pid = 0;        // Process ID of the shell ($$), kept by subshells.
+int lsh_subst_count = 0;        // Command substitutions run so far (a bare assignment takes their status).
+int lsh_parse_quiet = 0;        // Syntax errors are not reported (compiling a script ahead of running it).
+int lsh_stage_child = 0;        // A built-in runs alone in a forked pipeline stage; nothing reads its input after it.
+
+// Lexer class of every byte; 0 is plain word text
+const unsigned char lsh_lex_class[256] = {[' '] = LSH_LEX_SPACE, ['\t'] = LSH_LEX_SPACE, ['\n'] = LSH_LEX_SPACE,
+                                          ['\v'] = LSH_LEX_SPACE, ['\f'] = LSH_LEX_SPACE, ['\r'] = LSH_LEX_SPACE,
+                                          ['"'] = LSH_LEX_QUOTE, ['\''] = LSH_LEX_QUOTE, ['\\'] = LSH_LEX_ESCAPE,
+                                          ['<'] = LSH_LEX_OP, ['>'] = LSH_LEX_OP, ['|'] = LSH_LEX_OP,
+                                          ['&'] = LSH_LEX_OP, [';'] = LSH_LEX_OP, ['('] = LSH_LEX_OP,
+                                          [')'] = LSH_LEX_OP, ['#'] = LSH_LEX_HASH,
+                                          ['`'] = LSH_LEX_TICK};
+// Operator text lives in one object, so telling an operator from a word is a range check
+const struct
+{
+    char input[2], output[2], append[3], pipe[2], background[2], semi[2], and[3], or[3], lparen[2], rparen[2];
+    char heredoc[3], heredoc_strip[4], herestring[4], dupin[3], dupout[3], outerr[3], appenderr[4];
+    char fd[10][2];
+} lsh_tok_strings = {REDIRECT_INPUT, REDIRECT_OUTPUT, REDIRECT_OUTPUT_APPEND, PIPE_TOKEN, BACKGROUND_TOKEN, SEMI_TOKEN,
+                     AND_TOKEN, OR_TOKEN, LPAREN_TOKEN, RPAREN_TOKEN, HEREDOC_TOKEN, HEREDOC_STRIP_TOKEN, HERESTRING_TOKEN,
+                     DUPIN_TOKEN, DUPOUT_TOKEN, OUTERR_TOKEN, APPENDERR_TOKEN,
+                     {"0", "1", "2", "3", "4", "5", "6", "7", "8", "9"}};
+const char *lsh_tok_text[] = {NULL, lsh_tok_strings.input, lsh_tok_strings.output, lsh_tok_strings.append,
+                              lsh_tok_strings.pipe, lsh_tok_strings.background, lsh_tok_strings.semi, lsh_tok_strings.and,
+                              lsh_tok_strings.or, lsh_tok_strings.lparen, lsh_tok_strings.rparen, lsh_tok_strings.heredoc,
+                              lsh_tok_strings.heredoc_strip, lsh_tok_strings.herestring, lsh_tok_strings.dupin,
+                              lsh_tok_strings.dupout, lsh_tok_strings.outerr, lsh_tok_strings.appenderr,
+                              lsh_tok_strings.fd[0], lsh_tok_strings.fd[1], lsh_tok_strings.fd[2], lsh_tok_strings.fd[3],
+                              lsh_tok_strings.fd[4], lsh_tok_strings.fd[5], lsh_tok_strings.fd[6], lsh_tok_strings.fd[7],
+                              lsh_tok_strings.fd[8], lsh_tok_strings.fd[9]}; // Operator text by kind.
+
+struct lsh_path_entry *lsh_path_table[LSH_PATH_BUCKETS]; // Command name -> absolute path (hash builtin).
+int lsh_path_count = 0;                                  // Entries in lsh_path_table.
+char *lsh_path_env = NULL;                               // $PATH the table was filled for.
+
+/**********************************************************************  Shell options for the set built-in **********************************************************************/
+struct lsh_option
+{
+    const char *name;      // Option name as given to set -o.
+    int *value;            // Flag toggled by set -o / set +o.
+    void (*changed)(void); // Called after the flag changes, or NULL.
+};
+struct lsh_option lsh_options[] = {{"pipefail", &lsh_opt_pipefail, NULL},
+                                   {"spawn", &lsh_opt_spawn, NULL},
+                                   {"zygote", &lsh_opt_zygote, lsh_zygote_option},
+                                   {"notify", &lsh_opt_notify, NULL}};
 
 /**********************************************************************  Built-in command names and function pointers **********************************************************************/
-char *builtin_str[] = {"cd", "help", "exit", "pwd", "echo"};                           // Built-in command names
-int (*builtin_func[])(char **) = {&lsh_cd, &lsh_help, &lsh_exit, &lsh_pwd, &lsh_echo}; // Built-in command functions
+char *builtin_str[] = {"cd", "help", "exit", "pwd", "echo", "set", "hash", "memstat",
+                       "true", "false", "test", "[", "printf", "cat", "head", "wc", "sleep",
+                       "jobs", "fg", "bg", "wait", "parallel", "history", "export", "unset"}; // Built-in command names
+char *builtin_pure[] = {"echo", "pwd", "printf", "true", "false", "test", "[", "cat", "head", "wc", NULL}; // Only write output; $( ) runs them in the shell
+int (*builtin_func[])(char **) = {&lsh_cd, &lsh_help, &lsh_exit, &lsh_pwd, &lsh_echo, &lsh_set, &lsh_hash, &lsh_memstat,
+                                  &lsh_true, &lsh_false, &lsh_test, &lsh_test, &lsh_printf, &lsh_cat, &lsh_head, &lsh_wc, &lsh_sleep,
+                                  &lsh_jobs_builtin, &lsh_fg, &lsh_bg, &lsh_wait, &lsh_parallel, &lsh_history_builtin, &lsh_export, &lsh_unset}; // Built-in command functions
+signed char lsh_builtin_slot[LSH_BUILTIN_SLOTS]; // Perfect hash of builtin_str: slot -> index or -1.
+unsigned int lsh_builtin_seed = 0;               // Seed that makes the hash collision free (0 until built).
 
 /**********************************************************************  Return the number of built-in commands **********************************************************************/
 int lsh_num_builtins()
@@ -52,12 +883,18 @@ int lsh_cd(char **args)
     if (args[1] == NULL)
     {
         fprintf(stderr, "minishell: expected argument to \"cd\"\n");
+        lsh_last_status = 1;
     }
     else
     {
         if (chdir(args[1]) != 0)
         {
             perror("minishell");
+            lsh_last_status = 1;
+        }
+        else
+        {
+            lsh_pwd_update(1);
         }
     }
     return 1;
@@ -80,7 +917,25 @@ int lsh_help(char **args)
     printf("  < to redirect input\n");
     printf("  > to redirect output (overwrites file)\n");
     printf("  >> to append output to file\n");
-    printf("Use | to pipe commands together.\n");
+    printf("  2> 2>> to redirect errors, 2>&1 to send them where output goes, &> for both\n");
+    printf("  <<EOF for a here-document up to a line EOF, <<< word for a here-string\n");
+    printf("Use | to pipe commands together (set -o pipefail to fail on any stage).\n");
+    printf("PIPE_CPUS, PIPE_SIZE, PIPE_NICE and PIPE_IONICE tune pipeline stages (before one stage: that stage only).\n");
+    printf("Separate commands with ; (always), && (if the last succeeded) or || (if it failed).\n");
+    printf("( list ) runs a list in a subshell, { list; } groups it in the shell.\n");
+    printf("End a command with & to run it in the background; see jobs, fg, bg and wait.\n");
+    printf("set -o notify reports finished background jobs at once, not at the next prompt.\n");
+    printf("name=value sets a variable, $name or ${name} uses it; export passes it to commands, unset removes it.\n");
+    printf("name=value before a command sets it for that command only.\n");
+    printf("$(cmd) or `cmd` is replaced by the output of cmd.\n");
+    printf("*, ? and [...] match file names, ** any number of directories; {a,b} and {1..9} make several words.\n");
+    printf("Prefix a command with time to see real, user and sys time, memory and context switches per stage.\n");
+    printf("history [n] lists past commands, history -g text searches them (history -c clears).\n");
+    printf("At the prompt: arrows, Ctrl-A/E/B/F to move, Ctrl-K/U/W to cut, Ctrl-Y to paste,\n");
+    printf("  Up/Down for history, Ctrl-R to search it, Tab to complete commands and files.\n");
+    printf("parallel [-j N] [-k] [-a file] cmd {} runs cmd once per input line, N at a time.\n");
+    printf("minishell -C script runs a script from a compiled copy kept in ~/.cache/minishell.\n");
+    printf("minishell --serve sock runs commands sent with minishell --client sock command.\n");
     printf("Use the man command for information on other programs.\n");
     return 1;
 }
@@ -88,9 +943,126 @@ int lsh_help(char **args)
 /**********************************************************************  Exit built-in command **********************************************************************/
 int lsh_exit(char **args)
 {
+    // Optional exit status, otherwise keep the status of the last command
+    if (args[1] != NULL)
+    {
+        lsh_last_status = atoi(args[1]) & 0xff;
+    }
     return 0;
 }
 
+/**********************************************************************  Set built-in command **********************************************************************/
+int lsh_set(char **args)
+{
+    int i, j;
+    int n = sizeof(lsh_options) / sizeof(lsh_options[0]);
+
+    // Without arguments list every option and its state
+    if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL))
+    {
+        for (j = 0; j < n; j++)
+        {
+            printf("%-15s %s\n", lsh_options[j].name, *lsh_options[j].value ? "on" : "off");
+        }
+        return 1;
+    }
+
+    for (i = 1; args[i] != NULL; i += 2)
+    {
+        int enable = strcmp(args[i], "-o") == 0;
+        if ((!enable && strcmp(args[i], "+o") != 0) || args[i + 1] == NULL)
+        {
+            fprintf(stderr, "minishell: set: usage: set [-o|+o option]...\n");
+            lsh_last_status = 2;
+            return 1;
+        }
+        for (j = 0; j < n; j++)
+        {
+            if (strcmp(args[i + 1], lsh_options[j].name) == 0)
+            {
+                *lsh_options[j].value = enable;
+                if (lsh_options[j].changed != NULL)
+                {
+                    lsh_options[j].changed();
+                }
+                break;
+            }
+        }
+        if (j == n)
+        {
+            fprintf(stderr, "minishell: set: %s: invalid option name\n", args[i + 1]);
+            lsh_last_status = 1;
+        }
+    }
+    return 1;
+}
+
+/**********************************************************************  Export built-in command **********************************************************************/
+int lsh_export(char **args)
+{
+    int i;
+
+    // Without arguments list the environment, sorted, in a form that can be read back
+    if (args[1] == NULL)
+    {
+        char **envp = lsh_env();
+        int n = 0;
+        while (envp[n] != NULL)
+        {
+            n++;
+        }
+        char **sorted = memcpy(lsh_arena_alloc(&lsh_cmd_arena, (n + 1) * sizeof(char *)), envp, (n + 1) * sizeof(char *));
+        qsort(sorted, n, sizeof(char *), lsh_cmd_compare);
+        for (i = 0; i < n; i++)
+        {
+            const char *eq = strchr(sorted[i], '=');
+            printf("export %.*s=\"%s\"\n", (int)(eq - sorted[i]), sorted[i], eq + 1);
+        }
+        return 1;
+    }
+
+    for (i = 1; args[i] != NULL; i++)
+    {
+        size_t len = lsh_assignment_len(args[i]);
+        if (len > 0)
+        {
+            lsh_var_set(args[i], len, args[i] + len + 1, 1);
+            continue;
+        }
+        len = strlen(args[i]);
+        if (len == 0 || strspn(args[i], LSH_NAME_CHARS) != len || isdigit((unsigned char)args[i][0]))
+        {
+            fprintf(stderr, "minishell: export: `%s': not a valid identifier\n", args[i]);
+            lsh_last_status = 1;
+            continue;
+        }
+        // export NAME marks an existing variable (or an empty new one) for the environment
+        struct lsh_var *v = lsh_var_find(args[i], len);
+        if (v != NULL)
+        {
+            v->exported = 1;
+            lsh_env_dirty = 1;
+        }
+        else
+        {
+            lsh_var_set(args[i], len, "", 1);
+        }
+    }
+    return 1;
+}
+
+/**********************************************************************  Unset built-in command **********************************************************************/
+int lsh_unset(char **args)
+{
+    int i;
+
+    for (i = 1; args[i] != NULL; i++)
+    {
+        lsh_var_unset(args[i]);
+    }
+    return 1;
+}
+
 /**********************************************************************  Print working directory built-in command **********************************************************************/
 int lsh_pwd(char **args)
 {
@@ -102,6 +1074,7 @@ int lsh_pwd(char **args)
     else
     {
         perror("minishell");
+        lsh_last_status = 1;
     }
     return 1;
 }
@@ -124,511 +1097,8593 @@ int lsh_echo(char **args)
     return 1;
 }
 
-/**********************************************************************  Read a line from standard input **********************************************************************/
-char *lsh_read_line(void)
+/**********************************************************************  Hash built-in command **********************************************************************/
+int lsh_hash(char **args)
 {
-    int bufsize = LSH_RL_BUFSIZE;
-    int position = 0;
-    char *buffer = malloc(sizeof(char) * bufsize);
-    int c;
+    int i;
 
-    if (!buffer)
+    // No arguments: list the remembered locations
+    if (args[1] == NULL)
     {
-        fprintf(stderr, "minishell: allocation error\n");
-        exit(EXIT_FAILURE);
+        if (lsh_path_count == 0)
+        {
+            printf("hash: hash table empty\n");
+            return 1;
+        }
+        printf("hits\tcommand\n");
+        for (i = 0; i < LSH_PATH_BUCKETS; i++)
+        {
+            for (struct lsh_path_entry *e = lsh_path_table[i]; e != NULL; e = e->next)
+            {
+                printf("%4d\t%s\n", e->hits, e->path);
+            }
+        }
+        return 1;
     }
 
-    while (1)
+    if (strcmp(args[1], "-r") == 0)
     {
-        c = getchar();
+        lsh_path_clear();
+        return 1;
+    }
 
-        if (c == EOF || c == '\n')
+    // -d forgets names, -t prints their location, otherwise names are looked up and remembered
+    int forget = strcmp(args[1], "-d") == 0;
+    int print = strcmp(args[1], "-t") == 0;
+    for (i = forget || print ? 2 : 1; args[i] != NULL; i++)
+    {
+        if (forget)
         {
-            buffer[position] = '\0';
-            return buffer;
+            if (lsh_path_forget(args[i]) == -1)
+            {
+                fprintf(stderr, "minishell: hash: %s: not found\n", args[i]);
+                lsh_last_status = 1;
+            }
+            continue;
         }
-        else
+        if (lsh_find_builtin(args[i]) != -1 && !print)
         {
-            buffer[position] = c;
+            continue;
         }
-        position++;
-
-        if (position >= bufsize)
+        const char *path = lsh_path_lookup(args[i]);
+        if (path == NULL)
         {
-            bufsize += LSH_RL_BUFSIZE;
-            buffer = realloc(buffer, bufsize);
-            if (!buffer)
-            {
-                fprintf(stderr, "minishell: allocation error\n");
-                exit(EXIT_FAILURE);
-            }
+            fprintf(stderr, "minishell: hash: %s: not found\n", args[i]);
+            lsh_last_status = 1;
+        }
+        else if (print)
+        {
+            printf("%s\n", path);
         }
     }
+    return 1;
 }
 
-/**********************************************************************  Tokenisation (Split a line into tokens) **********************************************************************/
-char **lsh_split_line(char *line)
+/**********************************************************************  Memstat built-in command **********************************************************************/
+int lsh_memstat(char **args)
 {
-    int bufsize = LSH_TOK_BUFSIZE;
-    int position = 0;
-    char **tokens = malloc(bufsize * sizeof(char *));
+    struct rusage ru;
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
 
-    if (!tokens)
+    if (statm != NULL)
     {
-        fprintf(stderr, "minishell: allocation error\n");
-        exit(EXIT_FAILURE);
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        {
+            resident = 0;
+        }
+        fclose(statm);
     }
+    getrusage(RUSAGE_SELF, &ru);
 
-    // Make a copy of the line for tokenization
-    char *line_copy = strdup(line);
-    if (!line_copy)
-    {
-        fprintf(stderr, "minishell: allocation error\n");
-        exit(EXIT_FAILURE);
-    }
+    printf("commands        %lu\n", lsh_cmd_count);
+    printf("arena_allocs    %lu\n", lsh_cmd_arena.allocs);
+    printf("arena_in_use    %zu\n", lsh_cmd_arena.in_use);
+    printf("arena_peak      %zu\n", lsh_cmd_arena.peak);
+    printf("arena_reserved  %zu\n", lsh_cmd_arena.reserved);
+    printf("arena_blocks    %zu\n", lsh_cmd_arena.blocks);
+    printf("rss_kb          %ld\n", resident * (sysconf(_SC_PAGESIZE) / 1024));
+    printf("max_rss_kb      %ld\n", ru.ru_maxrss);
+    return 1;
+}
 
-    // Now proceed with regular tokenization
-    int i = 0;
-    int start = 0;
-    int in_quote = 0;
-    char quote_char = 0;
-    int len = strlen(line_copy);
+/**********************************************************************  Jobs built-in command **********************************************************************/
+int lsh_jobs_builtin(char **args)
+{
+    int show_pids = args[1] != NULL && strcmp(args[1], "-p") == 0;
+    int long_form = args[1] != NULL && strcmp(args[1], "-l") == 0;
 
-    while (i <= len)
+    lsh_reap_jobs();
+    for (struct lsh_job *job = lsh_jobs; job != NULL; job = job->next)
     {
-        // Handle quotes
-        if ((line_copy[i] == '"' || line_copy[i] == '\'') && (i == 0 || line_copy[i - 1] != '\\'))
+        if (!job->background)
         {
-            if (!in_quote)
-            {
-                in_quote = 1;
-                quote_char = line_copy[i];
-                start = i + 1; // Skip the opening quote
-            }
-            else if (line_copy[i] == quote_char)
-            {
-                // End of quoted string
-                line_copy[i] = '\0'; // Replace closing quote with null terminator
-                tokens[position++] = strdup(&line_copy[start]);
-                start = i + 1;
-                in_quote = 0;
-            }
+            continue;
         }
-        // Check for >> sequence first
-        else if (!in_quote && i < len - 1 && line_copy[i] == '>' && line_copy[i + 1] == '>')
+        if (show_pids)
         {
-            // If there's text before the >> operator, add it as a token
-            if (i > start)
-            {
-                line_copy[i] = '\0';
-                tokens[position++] = strdup(&line_copy[start]);
-            }
-
-            // Add the >> as a token
-            tokens[position++] = strdup(REDIRECT_OUTPUT_APPEND);
-            i += 2; // Skip both > characters
-            start = i;
-            continue; // Skip the increment at the end of the loop
+            printf("%d\n", (int)job->pgid);
+            continue;
         }
-        // Handle other special characters when not in quotes
-        else if (!in_quote && (line_copy[i] == '<' || line_copy[i] == '>' || line_copy[i] == '|'))
-        {
-            // If there's text before the special character, add it as a token
-            if (i > start)
-            {
-                char temp = line_copy[i];
-                line_copy[i] = '\0';
-                tokens[position++] = strdup(&line_copy[start]);
-                line_copy[i] = temp;
-            }
 
-            // Add the special character as its own token
-            char special[2] = {line_copy[i], '\0'};
-            tokens[position++] = strdup(special);
-            start = i + 1;
+        int state = lsh_job_state(job);
+        char mark = job->id == lsh_current_job ? '+' : ' ';
+        const char *name = state == LSH_JOB_RUNNING ? "Running" : state == LSH_JOB_STOPPED ? "Stopped" : "Done";
+        if (long_form)
+        {
+            printf("[%d]%c %d %-22s %s\n", job->id, mark, (int)job->pgid, name, job->text);
         }
-        // Handle whitespace outside quotes
-        else if (!in_quote && (isspace(line_copy[i]) || line_copy[i] == '\0'))
+        else
         {
-            // If there's text before the whitespace, add it as a token
-            if (i > start)
-            {
-                line_copy[i] = '\0';
-                tokens[position++] = strdup(&line_copy[start]);
-            }
-            start = i + 1;
+            printf("[%d]%c  %-22s  %s%s\n", job->id, mark, name, job->text, state == LSH_JOB_RUNNING ? " &" : "");
         }
-
-        // Check if we need to resize tokens array
-        if (position >= bufsize)
+        if (state == LSH_JOB_STOPPED)
         {
-            bufsize += LSH_TOK_BUFSIZE;
-            tokens = realloc(tokens, bufsize * sizeof(char *));
-            if (!tokens)
-            {
-                fprintf(stderr, "minishell: allocation error\n");
-                exit(EXIT_FAILURE);
-            }
+            job->notified = 1;
         }
+    }
+    return 1;
+}
 
-        i++;
+/**********************************************************************  Fg built-in command **********************************************************************/
+int lsh_fg(char **args)
+{
+    lsh_reap_jobs();
+    struct lsh_job *job = lsh_job_find(args[1], "fg");
+    if (job == NULL)
+    {
+        lsh_last_status = 1;
+        return 1;
     }
 
-    tokens[position] = NULL;
-    free(line_copy);
-    return tokens;
+    printf("%s\n", job->text);
+    fflush(stdout);
+    job->background = 0;
+    lsh_job_foreground(job, 1);
+    return 1;
 }
 
-/**********************************************************************  Handle redirection **********************************************************************/
-int handle_redirection(char **args)
+/**********************************************************************  Bg built-in command **********************************************************************/
+int lsh_bg(char **args)
 {
-    int i;
+    lsh_reap_jobs();
+    struct lsh_job *job = lsh_job_find(args[1], "bg");
+    if (job == NULL)
+    {
+        lsh_last_status = 1;
+        return 1;
+    }
 
-    // Look for redirection symbols
-    for (i = 0; args[i] != NULL; i++)
+    // Resume the stopped stages without giving them the terminal
+    for (int i = 0; i < job->nprocs; i++)
     {
-        // Output redirection
-        if (strcmp(args[i], REDIRECT_OUTPUT) == 0)
+        if (job->procs[i].state == LSH_JOB_STOPPED)
         {
-            if (args[i + 1] == NULL)
-            {
-                fprintf(stderr, "minishell: expected file after %s\n", REDIRECT_OUTPUT);
-                return -1;
-            }
-
-            char *filename = args[i + 1];
+            job->procs[i].state = LSH_JOB_RUNNING;
+        }
+    }
+    job->notified = 0;
+    lsh_current_job = job->id;
+    lsh_job_continue(job);
+    printf("[%d]+ %s &\n", job->id, job->text);
+    return 1;
+}
 
-            // Create file with proper mode
-            FILE *fp = fopen(filename, "w");
-            if (fp == NULL)
-            {
-                fprintf(stderr, "minishell: cannot open %s for writing: %s\n",
-                        filename, strerror(errno));
-                return -1;
-            }
+/**********************************************************************  Wait built-in command **********************************************************************/
+int lsh_wait(char **args)
+{
+    struct lsh_job *job;
+    int i;
 
-            // Get file descriptor and redirect stdout
-            int fd = fileno(fp);
-            if (dup2(fd, STDOUT_FILENO) == -1)
+    lsh_reap_jobs();
+    if (args[1] == NULL)
+    {
+        // Wait for every running background job; the status is 0 like other shells
+        for (job = lsh_jobs; job != NULL; job = job->next)
+        {
+            if (job->background && lsh_job_state(job) == LSH_JOB_RUNNING)
             {
-                fprintf(stderr, "minishell: failed to redirect output: %s\n", strerror(errno));
-                fclose(fp);
-                return -1;
+                lsh_job_wait(job);
             }
-
-            // Remove redirection tokens from args
-            args[i] = NULL;
-            i++; // Skip the filename
         }
+        lsh_sigchld = 1;
+        lsh_notify_jobs();
+        lsh_last_status = 0;
+        return 1;
+    }
 
-        // Output append redirection
-        else if (strcmp(args[i], REDIRECT_OUTPUT_APPEND) == 0)
+    // The status of the last named job is the status of wait
+    for (i = 1; args[i] != NULL; i++)
+    {
+        job = lsh_job_find(args[i], "wait");
+        if (job == NULL)
         {
-            if (args[i + 1] == NULL)
-            {
-                fprintf(stderr, "minishell: expected file after %s\n", REDIRECT_OUTPUT_APPEND);
-                return -1;
-            }
-
-            char *filename = args[i + 1];
+            lsh_last_status = 127;
+            continue;
+        }
+        if (lsh_job_wait(job) == LSH_JOB_DONE)
+        {
+            lsh_last_status = lsh_job_status(job);
+            lsh_time_report(job);
+            lsh_job_remove(job);
+        }
+        else
+        {
+            lsh_last_status = 128 + SIGTSTP;
+        }
+    }
+    return 1;
+}
+
+/**********************************************************************  Parallel: build the command for one item **********************************************************************/
+char **lsh_par_command(char **tmpl, const char *item)
+{
+    size_t ilen = strlen(item), size = 0;
+    int i, n = 0, placed = 0;
+
+    // Every {} in a word is replaced by the item; without any {} the item is appended
+    for (n = 0; tmpl[n] != NULL; n++)
+    {
+        const char *p = tmpl[n];
+        size += strlen(p) + 1;
+        while ((p = strstr(p, "{}")) != NULL)
+        {
+            size += ilen;
+            placed = 1;
+            p += 2;
+        }
+    }
+    if (!placed)
+    {
+        size += ilen + 1;
+    }
+
+    // argv and its strings share one allocation so the item is released with a single free
+    char **argv = malloc((n + 2) * sizeof(char *) + size);
+    if (!argv)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    char *out = (char *)(argv + n + 2);
+    for (i = 0; i < n; i++)
+    {
+        const char *p = tmpl[i], *hole;
+        argv[i] = out;
+        while ((hole = strstr(p, "{}")) != NULL)
+        {
+            memcpy(out, p, hole - p);
+            out += hole - p;
+            memcpy(out, item, ilen);
+            out += ilen;
+            p = hole + 2;
+        }
+        out = stpcpy(out, p) + 1;
+    }
+    if (!placed)
+    {
+        argv[n++] = out;
+        strcpy(out, item);
+    }
+    argv[n] = NULL;
+    return argv;
+}
+
+/**********************************************************************  Parallel: start one item **********************************************************************/
+int lsh_par_start(struct lsh_par_slot *slot, char **tmpl, const char *item, int null_fd)
+{
+    struct lsh_stage stage;
+
+    slot->argv = lsh_par_command(tmpl, item);
+    slot->pidfd = -1;
+    slot->status = 0;
+
+    // Output is collected in an anonymous file and written out in one piece when the item ends
+    slot->out = lsh_fd_high(memfd_create("parallel", MFD_CLOEXEC));
+    if (slot->out == -1)
+    {
+        fprintf(stderr, "minishell: parallel: %s\n", strerror(errno));
+        free(slot->argv);
+        return -1;
+    }
+
+    // Items join the caller's process group so Ctrl-C at the terminal reaches them as well
+    memset(&stage, 0, sizeof(stage));
+    stage.args = slot->argv;
+    if (lsh_spawn(&stage, null_fd, slot->out, -1, getpgrp()) == -1)
+    {
+        close(slot->out);
+        free(slot->argv);
+        return -1;
+    }
+    slot->pid = stage.pid;
+    if (stage.pid <= 0)
+    {
+        // Could not be executed; the item fails without a child to wait for
+        slot->status = stage.status;
+        slot->state = LSH_JOB_DONE;
+        return 0;
+    }
+
+#ifdef SYS_pidfd_open
+    slot->pidfd = lsh_fd_high(syscall(SYS_pidfd_open, stage.pid, 0));
+#endif
+    slot->state = LSH_JOB_RUNNING;
+    return 0;
+}
+
+/**********************************************************************  Parallel: wait until at least one item ends **********************************************************************/
+int lsh_par_wait(struct lsh_par_slot *slots, int nslots)
+{
+    struct pollfd fds[nslots];
+    int i, n = 0, polled = 1, done = 0;
+
+    // pidfds become readable when their child exits, so any number of items is waited for at once
+    for (i = 0; i < nslots; i++)
+    {
+        if (slots[i].state == LSH_JOB_RUNNING)
+        {
+            fds[n].fd = slots[i].pidfd;
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            polled &= slots[i].pidfd != -1;
+            n++;
+        }
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    // Without pidfds (older kernels) fall back to checking every few milliseconds
+    if (poll(fds, n, polled ? -1 : 10) == -1 && errno != EINTR)
+    {
+        perror("minishell");
+        return -1;
+    }
+
+    for (i = 0, n = 0; i < nslots; i++)
+    {
+        int status;
+        if (slots[i].state != LSH_JOB_RUNNING)
+        {
+            continue;
+        }
+        pid_t r = slots[i].pidfd == -1 || fds[n].revents ? waitpid(slots[i].pid, &status, WNOHANG) : 0;
+        if (r != 0)
+        {
+            slots[i].status = r > 0 ? lsh_exit_status(status) : 1;
+            slots[i].state = LSH_JOB_DONE;
+            done++;
+        }
+        n++;
+    }
+    return done;
+}
+
+/**********************************************************************  Parallel: write out a finished item **********************************************************************/
+void lsh_par_finish(struct lsh_par_slot *slot, int *failed)
+{
+    lseek(slot->out, 0, SEEK_SET);
+    lsh_copy_fd(slot->out, STDOUT_FILENO);
+    close(slot->out);
+    if (slot->pidfd != -1)
+    {
+        close(slot->pidfd);
+    }
+    free(slot->argv);
+    if (slot->status != 0)
+    {
+        (*failed)++;
+    }
+    slot->state = -1;
+}
+
+/**********************************************************************  Parallel built-in command **********************************************************************/
+int lsh_parallel(char **args)
+{
+    struct lsh_input in;
+    const char *file = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep = 0, i = 1;
+
+    // Options: -j N workers, -a FILE items, -k keep input order
+    while (args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0')
+    {
+        if (strcmp(args[i], "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (strcmp(args[i], "-k") == 0)
+        {
+            keep = 1;
+        }
+        else if (args[i][1] == 'j' || args[i][1] == 'a')
+        {
+            char opt = args[i][1], *end = "";
+            const char *value = args[i][2] != '\0' ? &args[i][2] : args[++i];
+            if (value != NULL && opt == 'j')
+            {
+                jobs = strtol(value, &end, 10);
+            }
+            if (value == NULL || *end != '\0' || jobs < 1)
+            {
+                fprintf(stderr, "minishell: parallel: invalid or missing value for -%c\n", opt);
+                lsh_last_status = 2;
+                return 1;
+            }
+            if (opt == 'a')
+            {
+                file = value;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "minishell: parallel: unknown option %s\n", args[i]);
+            lsh_last_status = 2;
+            return 1;
+        }
+        i++;
+    }
+    if (args[i] == NULL)
+    {
+        fprintf(stderr, "usage: parallel [-j jobs] [-k] [-a file] command [args...]\n");
+        lsh_last_status = 2;
+        return 1;
+    }
+    if (jobs < 1)
+    {
+        jobs = 1; // sysconf could not tell
+    }
+
+    if (file != NULL ? lsh_input_file(&in, file) == -1 : lsh_input_fd(&in, STDIN_FILENO) == -1)
+    {
+        lsh_last_status = 1;
+        return 1;
+    }
+    char **tmpl = &args[i];
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // With -k finished items wait for earlier ones, so allow a few more slots than workers
+    int nslots = keep ? jobs * 4 : jobs;
+    struct lsh_par_slot *slots = malloc(nslots * sizeof(struct lsh_par_slot));
+    if (!slots)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nslots; i++)
+    {
+        slots[i].state = -1;
+    }
+
+    long started = 0, flushed = 0;
+    int running = 0, failed = 0, eof = 0, stopped = 0;
+    fflush(stdout);
+
+    while (1)
+    {
+        // Fill free slots while workers are available
+        while (!eof && !lsh_interrupted && running < jobs)
+        {
+            for (i = 0; i < nslots && slots[i].state != -1; i++)
+            {
+            }
+            if (i == nslots)
+            {
+                break;
+            }
+            char *item = lsh_input_line(&in);
+            if (item == NULL)
+            {
+                eof = 1;
+                break;
+            }
+            if (*item == '\0')
+            {
+                continue;
+            }
+            slots[i].seq = started;
+            if (lsh_par_start(&slots[i], tmpl, item, null_fd) == -1)
+            {
+                eof = 1;
+                failed++;
+                break;
+            }
+            started++;
+            running += slots[i].state == LSH_JOB_RUNNING;
+        }
+
+        // Ctrl-C stops feeding items and passes the interrupt on to the running ones
+        if (lsh_interrupted && !stopped)
+        {
+            stopped = 1;
+            for (i = 0; i < nslots; i++)
+            {
+                if (slots[i].state == LSH_JOB_RUNNING)
+                {
+                    kill(slots[i].pid, SIGINT);
+                }
+            }
+        }
+
+        // Output is written per item: in completion order, or in input order with -k
+        for (i = 0; i < nslots; i++)
+        {
+            if (slots[i].state == LSH_JOB_DONE && (!keep || slots[i].seq == flushed))
+            {
+                lsh_par_finish(&slots[i], &failed);
+                flushed++;
+                i = -1; // With -k the next item may be done already
+            }
+        }
+
+        if (running == 0 && (eof || lsh_interrupted))
+        {
+            break;
+        }
+        int done = lsh_par_wait(slots, nslots);
+        if (done == -1)
+        {
+            break;
+        }
+        running -= done;
+    }
+
+    free(slots);
+    if (null_fd != -1)
+    {
+        close(null_fd);
+    }
+    lsh_input_close(&in);
+
+    // Like GNU parallel: the number of failed items, capped at 101
+    lsh_last_status = lsh_interrupted ? 130 : failed > 101 ? 101 : failed;
+    return 1;
+}
+
+/**********************************************************************  History: remember one entry **********************************************************************/
+void lsh_history_push(const char *line, size_t len)
+{
+    struct lsh_history *h = &lsh_history;
+
+    if (h->count == h->cap)
+    {
+        h->cap = h->cap ? h->cap * 2 : 1024;
+        h->entries = realloc(h->entries, h->cap * sizeof(struct lsh_hist_entry));
+        if (!h->entries)
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    h->entries[h->count].line = line;
+    h->entries[h->count].len = len;
+    h->count++;
+
+    // Past the limit the oldest whole blocks go, so block filters stay aligned
+    if (h->count >= h->max + LSH_HIST_BLOCK)
+    {
+        long drop = (h->count - h->max) / LSH_HIST_BLOCK * LSH_HIST_BLOCK;
+        memmove(h->entries, h->entries + drop, (h->count - drop) * sizeof(struct lsh_hist_entry));
+        h->count -= drop;
+        if (h->nblooms > drop / LSH_HIST_BLOCK)
+        {
+            h->nblooms -= drop / LSH_HIST_BLOCK;
+            memmove(h->blooms, h->blooms + drop / LSH_HIST_BLOCK, h->nblooms * sizeof(*h->blooms));
+        }
+        else
+        {
+            h->nblooms = 0;
+        }
+    }
+}
+
+/**********************************************************************  History: load the history file **********************************************************************/
+void lsh_history_init(void)
+{
+    struct lsh_history *h = &lsh_history;
+    const char *home = lsh_var_get("HOME");
+    const char *env;
+    struct stat st;
+
+    // Bash-style settings from the environment
+    h->max = (env = lsh_var_get("HISTSIZE")) != NULL && atol(env) > 0 ? atol(env) : LSH_HIST_SIZE;
+    h->file_max = (env = lsh_var_get("HISTFILESIZE")) != NULL && atol(env) > 0 ? atol(env) : h->max;
+    env = lsh_var_get("HISTCONTROL");
+    h->ignoredups = env != NULL && (strstr(env, "ignoredups") || strstr(env, "ignoreboth"));
+    h->ignorespace = env != NULL && (strstr(env, "ignorespace") || strstr(env, "ignoreboth"));
+
+    if ((env = lsh_var_get("HISTFILE")) != NULL)
+    {
+        h->path = strdup(env);
+    }
+    else if (home != NULL && (h->path = malloc(strlen(home) + sizeof("/" LSH_HIST_FILE))) != NULL)
+    {
+        sprintf(h->path, "%s/%s", home, LSH_HIST_FILE);
+    }
+    if (h->path == NULL || *h->path == '\0')
+    {
+        return;
+    }
+
+    h->fd = lsh_fd_high(open(h->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600));
+    if (h->fd == -1 || fstat(h->fd, &st) == -1 || st.st_size == 0)
+    {
+        return;
+    }
+
+    // The file is mapped, not read: entries point straight into the page cache
+    h->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, h->fd, 0);
+    if (h->map == MAP_FAILED)
+    {
+        h->map = NULL;
+        return;
+    }
+    h->map_len = st.st_size;
+
+    const char *p = h->map, *end = h->map + h->map_len;
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL)
+        {
+            nl = end;
+        }
+        if (nl > p)
+        {
+            lsh_history_push(p, nl - p);
+            h->file_lines++;
+        }
+        p = nl + 1;
+    }
+
+    // Keep the file bounded: once it is well past the limit, rewrite it with the newest lines
+    if (h->file_lines > h->file_max + h->file_max / 4)
+    {
+        lsh_history_trim();
+    }
+}
+
+/**********************************************************************  History: rewrite the file with the newest lines **********************************************************************/
+void lsh_history_trim(void)
+{
+    struct lsh_history *h = &lsh_history;
+    char *tmp = malloc(strlen(h->path) + 5);
+    struct stat st;
+    long kept = 0;
+    int fd;
+
+    // The newest lines come from the file itself, which may hold more than the entries in memory
+    if (!tmp || fstat(h->fd, &st) == -1 || st.st_size == 0)
+    {
+        free(tmp);
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, h->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        free(tmp);
+        return;
+    }
+    const char *start = map + st.st_size, *end = start;
+    while (start > map && kept < h->file_max)
+    {
+        while (start > map && start[-1] == '\n')
+        {
+            start--;
+        }
+        const char *line_end = start;
+        while (start > map && start[-1] != '\n')
+        {
+            start--;
+        }
+        kept += start < line_end;
+    }
+    while (start < end && *start == '\n')
+    {
+        start++;
+    }
+
+    // Same permissions as the file the shell creates; an old leftover is never written through
+    sprintf(tmp, "%s.new", h->path);
+    unlink(tmp);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd != -1 && lsh_write_all(fd, start, end - start) == 0 && close(fd) == 0 && rename(tmp, h->path) == 0)
+    {
+        // Atomic replace; the startup mapping stays valid for this session
+        close(h->fd);
+        h->fd = lsh_fd_high(open(h->path, O_RDWR | O_APPEND | O_CLOEXEC));
+        h->file_lines = kept;
+    }
+    else if (fd != -1)
+    {
+        close(fd);
+        unlink(tmp);
+    }
+    munmap(map, st.st_size);
+    free(tmp);
+}
+
+/**********************************************************************  History: record a command line **********************************************************************/
+void lsh_history_add(const char *line)
+{
+    struct lsh_history *h = &lsh_history;
+    size_t len = strlen(line);
+    struct iovec iov[2];
+
+    if (len == 0 || strspn(line, " \t") == len || (h->ignorespace && line[0] == ' '))
+    {
+        return;
+    }
+    if (h->ignoredups && h->count > 0 && h->entries[h->count - 1].len == len &&
+        memcmp(h->entries[h->count - 1].line, line, len) == 0)
+    {
+        return;
+    }
+
+    // New lines are packed into large chunks that never move, so entries can point into them
+    if (h->chunk == NULL || h->chunk_used + len > LSH_HIST_CHUNK)
+    {
+        h->chunk = malloc(len > LSH_HIST_CHUNK ? len : LSH_HIST_CHUNK);
+        h->chunk_used = 0;
+        if (!h->chunk)
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    char *copy = memcpy(h->chunk + h->chunk_used, line, len);
+    h->chunk_used += len;
+    lsh_history_push(copy, len);
+
+    // One O_APPEND write per command, so shells sharing the file do not interleave lines
+    if (h->fd != -1)
+    {
+        iov[0].iov_base = (void *)line;
+        iov[0].iov_len = len;
+        iov[1].iov_base = "\n";
+        iov[1].iov_len = 1;
+        if (writev(h->fd, iov, 2) == (ssize_t)len + 1 && ++h->file_lines > h->file_max + h->file_max / 4)
+        {
+            lsh_history_trim();
+        }
+    }
+}
+
+/**********************************************************************  History: trigram hash **********************************************************************/
+unsigned int lsh_history_trigram(const char *p)
+{
+    unsigned int x = (unsigned char)p[0] | (unsigned char)p[1] << 8 | (unsigned char)p[2] << 16;
+    return (x * 2654435761u) >> (32 - LSH_HIST_BLOOM_SHIFT);
+}
+
+/**********************************************************************  History: build filters for full blocks **********************************************************************/
+void lsh_history_index(void)
+{
+    struct lsh_history *h = &lsh_history;
+    long full = h->count / LSH_HIST_BLOCK;
+    long b, i;
+    size_t j;
+
+    if (h->nblooms == full)
+    {
+        return;
+    }
+    h->blooms = realloc(h->blooms, full * sizeof(*h->blooms));
+    if (!h->blooms)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // One bit per trigram present in any entry of the block; built on first search, then kept up to date
+    for (b = h->nblooms; b < full; b++)
+    {
+        unsigned char *bits = h->blooms[b];
+        memset(bits, 0, sizeof(*h->blooms));
+        for (i = b * LSH_HIST_BLOCK; i < (b + 1) * LSH_HIST_BLOCK; i++)
+        {
+            for (j = 0; j + 3 <= h->entries[i].len; j++)
+            {
+                unsigned int t = lsh_history_trigram(h->entries[i].line + j);
+                bits[t >> 3] |= 1 << (t & 7);
+            }
+        }
+    }
+    h->nblooms = full;
+}
+
+/**********************************************************************  History: newest entry before an index that contains a string **********************************************************************/
+long lsh_history_find(const char *query, long before)
+{
+    struct lsh_history *h = &lsh_history;
+    size_t qlen = strlen(query), j;
+    unsigned int trigrams[LSH_HIST_QUERY_TRIGRAMS];
+    int ntri = 0, k;
+    long i;
+
+    if (before > h->count)
+    {
+        before = h->count;
+    }
+    lsh_history_index();
+    for (j = 0; j + 3 <= qlen && ntri < LSH_HIST_QUERY_TRIGRAMS; j++)
+    {
+        trigrams[ntri++] = lsh_history_trigram(query + j);
+    }
+
+    for (i = before - 1; i >= 0; i--)
+    {
+        long b = i / LSH_HIST_BLOCK;
+
+        // A block missing any trigram of the query cannot hold a match; skip all of it
+        if (ntri > 0 && b < h->nblooms)
+        {
+            for (k = 0; k < ntri && (h->blooms[b][trigrams[k] >> 3] & (1 << (trigrams[k] & 7))); k++)
+            {
+            }
+            if (k < ntri)
+            {
+                i = b * LSH_HIST_BLOCK;
+                continue;
+            }
+        }
+        if (memmem(h->entries[i].line, h->entries[i].len, query, qlen) != NULL)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**********************************************************************  History built-in command **********************************************************************/
+int lsh_history_builtin(char **args)
+{
+    struct lsh_history *h = &lsh_history;
+    long i, first = 0;
+
+    if (args[1] != NULL && strcmp(args[1], "-c") == 0)
+    {
+        // Forget everything, in memory and on disk
+        h->count = 0;
+        h->nblooms = 0;
+        h->file_lines = 0;
+        if (h->fd != -1 && ftruncate(h->fd, 0) == -1)
+        {
+            fprintf(stderr, "minishell: history: %s\n", strerror(errno));
+            lsh_last_status = 1;
+        }
+        return 1;
+    }
+
+    if (args[1] != NULL && strcmp(args[1], "-g") == 0)
+    {
+        // Indexed search, oldest match first like history | grep
+        if (args[2] == NULL)
+        {
+            fprintf(stderr, "minishell: history: -g: string expected\n");
+            lsh_last_status = 2;
+            return 1;
+        }
+        long *hits = NULL, n = 0, cap = 0;
+        for (i = lsh_history_find(args[2], h->count); i >= 0; i = lsh_history_find(args[2], i))
+        {
+            if (n == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                hits = realloc(hits, cap * sizeof(long));
+                if (!hits)
+                {
+                    fprintf(stderr, "minishell: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            hits[n++] = i;
+        }
+        while (n-- > 0)
+        {
+            printf("%5ld  %.*s\n", hits[n] + 1, (int)h->entries[hits[n]].len, h->entries[hits[n]].line);
+        }
+        free(hits);
+        lsh_last_status = cap == 0;
+        return 1;
+    }
+
+    if (args[1] != NULL)
+    {
+        char *end;
+        long n = strtol(args[1], &end, 10);
+        if (*end != '\0' || n < 0)
+        {
+            fprintf(stderr, "minishell: history: usage: history [n] | -c | -g string\n");
+            lsh_last_status = 2;
+            return 1;
+        }
+        first = n < h->count ? h->count - n : 0;
+    }
+    for (i = first; i < h->count; i++)
+    {
+        printf("%5ld  %.*s\n", i + 1, (int)h->entries[i].len, h->entries[i].line);
+    }
+    return 1;
+}
+
+/**********************************************************************  Write a whole buffer to a descriptor **********************************************************************/
+int lsh_write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR && !lsh_interrupted)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**********************************************************************  Move a descriptor the shell keeps out of reach of redirections **********************************************************************/
+int lsh_fd_high(int fd)
+{
+    // Scripts name descriptors 0-9, so the shell's own live at 10 and up; a failed move keeps the original
+    if (fd >= 0 && fd < 10)
+    {
+        int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        if (high != -1)
+        {
+            close(fd);
+            return high;
+        }
+    }
+    return fd;
+}
+
+/**********************************************************************  Open an input operand of cat, head or wc **********************************************************************/
+int lsh_open_input(const char *name, const char *cmd)
+{
+    if (name == NULL || strcmp(name, "-") == 0)
+    {
+        return STDIN_FILENO;
+    }
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "minishell: %s: %s: %s\n", cmd, name, strerror(errno));
+        lsh_last_status = 1;
+    }
+    return fd;
+}
+
+/**********************************************************************  True and false built-in commands **********************************************************************/
+int lsh_true(char **args)
+{
+    return 1;
+}
+
+int lsh_false(char **args)
+{
+    lsh_last_status = 1;
+    return 1;
+}
+
+/**********************************************************************  Evaluate a test expression **********************************************************************/
+int lsh_test_eval(char **args, int n)
+{
+    struct stat st;
+
+    if (n == 0)
+    {
+        return 1;
+    }
+    if (strcmp(args[0], "!") == 0)
+    {
+        int r = lsh_test_eval(args + 1, n - 1);
+        return r > 1 ? r : !r;
+    }
+    if (n == 1)
+    {
+        return args[0][0] == '\0';
+    }
+
+    if (n == 2 && args[0][0] == '-' && args[0][1] != '\0' && args[0][2] == '\0')
+    {
+        const char *a = args[1];
+        switch (args[0][1])
+        {
+        case 'n': return a[0] == '\0';
+        case 'z': return a[0] != '\0';
+        case 'e': return stat(a, &st) != 0;
+        case 'f': return stat(a, &st) != 0 || !S_ISREG(st.st_mode);
+        case 'd': return stat(a, &st) != 0 || !S_ISDIR(st.st_mode);
+        case 's': return stat(a, &st) != 0 || st.st_size == 0;
+        case 'L':
+        case 'h': return lstat(a, &st) != 0 || !S_ISLNK(st.st_mode);
+        case 'p': return stat(a, &st) != 0 || !S_ISFIFO(st.st_mode);
+        case 'r': return access(a, R_OK) != 0;
+        case 'w': return access(a, W_OK) != 0;
+        case 'x': return access(a, X_OK) != 0;
+        }
+    }
+
+    if (n == 3)
+    {
+        const char *op = args[1];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        {
+            return strcmp(args[0], args[2]) != 0;
+        }
+        if (strcmp(op, "!=") == 0)
+        {
+            return strcmp(args[0], args[2]) == 0;
+        }
+
+        static const char *int_ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+        for (int i = 0; i < 6; i++)
+        {
+            if (strcmp(op, int_ops[i]) == 0)
+            {
+                char *end1, *end2;
+                long long a = strtoll(args[0], &end1, 10);
+                long long b = strtoll(args[2], &end2, 10);
+                if (*args[0] == '\0' || *end1 != '\0' || *args[2] == '\0' || *end2 != '\0')
+                {
+                    fprintf(stderr, "minishell: test: integer expression expected\n");
+                    return 2;
+                }
+                int r[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+                return !r[i];
+            }
+        }
+    }
+
+    // Anything else (-a, -o, parentheses, -nt ...) is left to the external test
+    return LSH_FALLBACK;
+}
+
+/**********************************************************************  Test and [ built-in commands **********************************************************************/
+int lsh_test(char **args)
+{
+    int n = 0;
+
+    while (args[n + 1] != NULL)
+    {
+        n++;
+    }
+    if (strcmp(args[0], "[") == 0)
+    {
+        if (n == 0 || strcmp(args[n], "]") != 0)
+        {
+            fprintf(stderr, "minishell: [: missing `]'\n");
+            lsh_last_status = 2;
+            return 1;
+        }
+        n--;
+    }
+
+    int r = lsh_test_eval(args + 1, n);
+    if (r == LSH_FALLBACK)
+    {
+        return LSH_FALLBACK;
+    }
+    lsh_last_status = r;
+    return 1;
+}
+
+/**********************************************************************  Print one backslash escape for printf **********************************************************************/
+const char *lsh_print_escape(const char *p)
+{
+    // p points at the backslash; returns the last character consumed, or NULL for \c (no further output)
+    static const char from[] = "abfnrtv\\\"'";
+    static const char to[] = "\a\b\f\n\r\t\v\\\"'";
+    const char *e = strchr(from, p[1]);
+
+    if (p[1] != '\0' && e != NULL)
+    {
+        putchar(to[e - from]);
+        return p + 1;
+    }
+    if (p[1] >= '0' && p[1] <= '7')
+    {
+        int v = 0, k;
+        for (k = 1; k <= 3 && p[k] >= '0' && p[k] <= '7'; k++)
+        {
+            v = v * 8 + (p[k] - '0');
+        }
+        putchar(v);
+        return p + k - 1;
+    }
+    if (p[1] == 'x' && isxdigit((unsigned char)p[2]))
+    {
+        int v = 0, k;
+        for (k = 2; k <= 3 && isxdigit((unsigned char)p[k]); k++)
+        {
+            v = v * 16 + (isdigit((unsigned char)p[k]) ? p[k] - '0' : tolower((unsigned char)p[k]) - 'a' + 10);
+        }
+        putchar(v);
+        return p + k - 1;
+    }
+    if (p[1] == 'c')
+    {
+        return NULL;
+    }
+    putchar('\\');
+    return p;
+}
+
+/**********************************************************************  Check a numeric printf argument **********************************************************************/
+int lsh_printf_check(const char *arg, const char *end)
+{
+    // end is NULL when nothing was parsed (a missing argument or a character constant); messages follow coreutils
+    if (end == NULL)
+    {
+        return 0;
+    }
+    if (errno == ERANGE)
+    {
+        fflush(stdout);
+        fprintf(stderr, "minishell: printf: '%s': %s\n", arg, strerror(ERANGE));
+        return 1;
+    }
+    if (*end != '\0')
+    {
+        fflush(stdout);
+        fprintf(stderr, "minishell: printf: '%s': %s\n", arg,
+                end == arg ? "expected a numeric value" : "value not completely converted");
+        return 1;
+    }
+    return 0;
+}
+
+/**********************************************************************  Printf built-in command **********************************************************************/
+int lsh_printf(char **args)
+{
+    const char *p;
+    char **argp;
+
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "minishell: printf: usage: printf format [arguments]\n");
+        lsh_last_status = 2;
+        return 1;
+    }
+
+    // Conversions and escapes the native version does not know go to the external printf before any output
+    for (p = args[1]; *p; p++)
+    {
+        if (*p == '%')
+        {
+            p += strspn(p + 1, "-+ #0123456789.") + 1;
+            if (*p == '\0' || strchr("%sdiuxXocfeEgG", *p) == NULL)
+            {
+                return LSH_FALLBACK;
+            }
+        }
+        else if (*p == '\\' && p[1] != '\0')
+        {
+            if (p[1] == 'x' && !isxdigit((unsigned char)p[2]))
+            {
+                return LSH_FALLBACK;
+            }
+            p++;
+        }
+    }
+
+    // So do character constants the external printf warns about: 'AB, or a multibyte character
+    for (argp = &args[2]; *argp != NULL; argp++)
+    {
+        const char *a = *argp;
+        if ((a[0] == '\'' || a[0] == '"') && a[1] != '\0' && (a[2] != '\0' || (unsigned char)a[1] >= 0x80))
+        {
+            return LSH_FALLBACK;
+        }
+    }
+
+    int failed = 0;
+    argp = &args[2];
+    do
+    {
+        int consumed = 0;
+        for (p = args[1]; *p; p++)
+        {
+            if (*p == '\\')
+            {
+                if ((p = lsh_print_escape(p)) == NULL)
+                {
+                    lsh_last_status = failed;
+                    return 1;
+                }
+                continue;
+            }
+            if (*p != '%')
+            {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%')
+            {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            // Rebuild the conversion with a long long / double argument type
+            char spec[40];
+            size_t k = strspn(p + 1, "-+ #0123456789.");
+            if (k > sizeof(spec) - 5)
+            {
+                k = sizeof(spec) - 5;
+            }
+            memcpy(spec, p, k + 1);
+            p += k + 1;
+            const char *arg = *argp != NULL ? *argp++ : NULL;
+            consumed |= arg != NULL;
+
+            // Numbers may also be given as 'c or "c, the code of the character c
+            int quoted = arg != NULL && (arg[0] == '\'' || arg[0] == '"') && arg[1] != '\0';
+            char *end = NULL;
+            errno = 0;
+
+            switch (*p)
+            {
+            case 'd':
+            case 'i':
+            {
+                long long v = quoted ? (unsigned char)arg[1] : arg != NULL ? strtoll(arg, &end, 0) : 0;
+                failed |= lsh_printf_check(arg, end);
+                strcpy(spec + k + 1, "lld");
+                printf(spec, v);
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            {
+                unsigned long long v = quoted ? (unsigned char)arg[1] : arg != NULL ? strtoull(arg, &end, 0) : 0;
+                failed |= lsh_printf_check(arg, end);
+                spec[k + 1] = 'l';
+                spec[k + 2] = 'l';
+                spec[k + 3] = *p;
+                spec[k + 4] = '\0';
+                printf(spec, v);
+                break;
+            }
+            case 'f':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            {
+                double v = quoted ? (unsigned char)arg[1] : arg != NULL ? strtod(arg, &end) : 0.0;
+                failed |= lsh_printf_check(arg, end);
+                spec[k + 1] = *p;
+                spec[k + 2] = '\0';
+                printf(spec, v);
+                break;
+            }
+            case 'c':
+                if (arg != NULL && arg[0] != '\0')
+                {
+                    strcpy(spec + k + 1, "c");
+                    printf(spec, arg[0]);
+                }
+                break;
+            default:
+                strcpy(spec + k + 1, "s");
+                printf(spec, arg ? arg : "");
+                break;
+            }
+        }
+        // The format is reused while arguments remain
+        if (!consumed)
+        {
+            break;
+        }
+    } while (*argp != NULL);
+    lsh_last_status = failed;
+    return 1;
+}
+
+/**********************************************************************  Copy one descriptor to another inside the kernel **********************************************************************/
+int lsh_copy_fd(int in_fd, int out_fd)
+{
+    struct stat in_st, out_st;
+    char buf[LSH_IO_BUFSIZE];
+    int method = 0; // 0 copy_file_range, 1 splice, 2 sendfile, 3 read/write
+
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1)
+    {
+        return -1;
+    }
+
+    // Pick the cheapest transfer these descriptor types allow
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+    {
+        method = 0;
+    }
+    else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+    {
+        method = 1;
+    }
+    else if (S_ISREG(in_st.st_mode) || S_ISBLK(in_st.st_mode))
+    {
+        method = 2;
+    }
+    else
+    {
+        method = 3;
+    }
+
+    int moved = 0;
+    while (!lsh_interrupted)
+    {
+        ssize_t n;
+        switch (method)
+        {
+        case 0:
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, LSH_COPY_CHUNK, 0);
+            break;
+        case 1:
+            n = splice(in_fd, NULL, out_fd, NULL, LSH_COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+            break;
+        case 2:
+            n = sendfile(out_fd, in_fd, NULL, LSH_COPY_CHUNK);
+            break;
+        default:
+            n = read(in_fd, buf, sizeof(buf));
+            if (n > 0 && lsh_write_all(out_fd, buf, n) == -1)
+            {
+                return -1;
+            }
+            break;
+        }
+
+        if (n == 0)
+        {
+            return 0;
+        }
+        if (n > 0)
+        {
+            moved = 1;
+            continue;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+
+        // Unsupported pairings (O_APPEND outputs, terminals, cross-device ...) drop to the next method
+        if (!moved && method < 3 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                                     errno == EBADF || errno == EOPNOTSUPP))
+        {
+            method = method < 2 && S_ISREG(in_st.st_mode) ? 2 : 3;
+            continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**********************************************************************  Cat built-in command **********************************************************************/
+int lsh_cat(char **args)
+{
+    int i = 1;
+
+    // Only plain concatenation is native; options go to the external cat
+    if (args[1] != NULL && args[1][0] == '-' && args[1][1] != '\0')
+    {
+        return LSH_FALLBACK;
+    }
+
+    fflush(stdout);
+    do
+    {
+        int fd = lsh_open_input(args[i], "cat");
+        if (fd == -1)
+        {
+            continue;
+        }
+        if (lsh_copy_fd(fd, STDOUT_FILENO) == -1 && errno != EPIPE && !lsh_interrupted)
+        {
+            fprintf(stderr, "minishell: cat: %s\n", strerror(errno));
+            lsh_last_status = 1;
+        }
+        if (fd != STDIN_FILENO)
+        {
+            close(fd);
+        }
+    } while (args[i] != NULL && args[++i] != NULL && !lsh_interrupted);
+    return 1;
+}
+
+/**********************************************************************  Head built-in command **********************************************************************/
+int lsh_head(char **args)
+{
+    char buf[LSH_IO_BUFSIZE];
+    long lines = 10;
+    int i = 1;
+
+    // Accept -n N, -nN and -N; anything else goes to the external head
+    if (args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0')
+    {
+        const char *count = NULL;
+        if (args[i][1] == 'n')
+        {
+            count = args[i][2] != '\0' ? &args[i][2] : args[++i];
+        }
+        else if (isdigit((unsigned char)args[i][1]))
+        {
+            count = &args[i][1];
+        }
+        char *end;
+        if (count == NULL || (lines = strtol(count, &end, 10)) < 0 || *end != '\0')
+        {
+            return LSH_FALLBACK;
+        }
+        i++;
+    }
+
+    fflush(stdout);
+    int nfiles = 0, shown = 0;
+    while (args[i + nfiles] != NULL)
+    {
+        nfiles++;
+    }
+    do
+    {
+        long left = lines;
+        int fd = lsh_open_input(args[i], "head");
+        if (fd == -1)
+        {
+            continue;
+        }
+
+        // Input read past the last line goes back to stdin for the next command: seek back over it, or
+        // read a byte at a time where stdin cannot seek
+        size_t chunk = sizeof(buf);
+        int give_back = fd == STDIN_FILENO && !lsh_stage_child;
+        if (give_back && lseek(fd, 0, SEEK_CUR) == -1)
+        {
+            chunk = 1;
+        }
+        if (nfiles > 1)
+        {
+            char title[PATH_MAX + 16];
+            int len = snprintf(title, sizeof(title), "%s==> %s <==\n", shown++ ? "\n" : "", args[i]);
+            lsh_write_all(STDOUT_FILENO, title, len);
+        }
+        while (left > 0)
+        {
+            ssize_t n = read(fd, buf, chunk);
+            if (n < 0 && errno == EINTR && !lsh_interrupted)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+
+            // Stop after the newline that completes the last wanted line
+            char *p = buf, *end = buf + n;
+            while (left > 0 && (p = memchr(p, '\n', end - p)) != NULL)
+            {
+                p++;
+                left--;
+            }
+            size_t len = left > 0 ? (size_t)n : (size_t)(p - buf);
+            if (give_back && len < (size_t)n)
+            {
+                lseek(fd, (off_t)len - n, SEEK_CUR);
+            }
+            if (lsh_write_all(STDOUT_FILENO, buf, len) == -1)
+            {
+                break;
+            }
+        }
+        if (fd != STDIN_FILENO)
+        {
+            close(fd);
+        }
+    } while (args[i] != NULL && args[++i] != NULL && !lsh_interrupted);
+    return 1;
+}
+
+/**********************************************************************  Wc built-in command **********************************************************************/
+int lsh_wc(char **args)
+{
+    char buf[LSH_IO_BUFSIZE];
+    int want_l = 0, want_w = 0, want_c = 0;
+    long total[3] = {0, 0, 0};
+    int i, nfiles = 0;
+
+    // Native -l, -w and -c; other options go to the external wc
+    for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++)
+    {
+        for (const char *o = &args[i][1]; *o; o++)
+        {
+            if (*o == 'l')
+                want_l = 1;
+            else if (*o == 'w')
+                want_w = 1;
+            else if (*o == 'c')
+                want_c = 1;
+            else
+                return LSH_FALLBACK;
+        }
+    }
+    if (!want_l && !want_w && !want_c)
+    {
+        want_l = want_w = want_c = 1;
+    }
+    int first = i;
+    while (args[first + nfiles] != NULL)
+    {
+        nfiles++;
+    }
+    int want[3] = {want_l, want_w, want_c};
+    int single = want_l + want_w + want_c == 1 && nfiles <= 1;
+
+    // Columns as wide as coreutils makes them: digits for the bytes of all regular files, at least 7 when
+    // an input's size is not known up front, and no padding for a single count of one input
+    int width = 1;
+    if (!single)
+    {
+        unsigned long bytes = 0;
+        int min_width = 1;
+        struct stat st;
+        for (int k = 0; k < (nfiles > 0 ? nfiles : 1); k++)
+        {
+            const char *name = args[first + k];
+            if ((name == NULL || strcmp(name, "-") == 0 ? fstat(STDIN_FILENO, &st) : stat(name, &st)) == -1)
+            {
+                continue;
+            }
+            if (S_ISREG(st.st_mode))
+            {
+                bytes += st.st_size;
+            }
+            else
+            {
+                min_width = 7;
+            }
+        }
+        for (; bytes >= 10; bytes /= 10)
+        {
+            width++;
+        }
+        width = width < min_width ? min_width : width;
+    }
+
+    do
+    {
+        long counts[3] = {0, 0, 0}; // lines, words, bytes
+        int in_word = 0;
+        int fd = lsh_open_input(args[i], "wc");
+        if (fd == -1)
+        {
+            continue;
+        }
+        while (1)
+        {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR && !lsh_interrupted)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            counts[2] += n;
+            if (want_w)
+            {
+                for (ssize_t k = 0; k < n; k++)
+                {
+                    int space = isspace((unsigned char)buf[k]);
+                    counts[0] += buf[k] == '\n';
+                    counts[1] += !space && !in_word;
+                    in_word = !space;
+                }
+            }
+            else
+            {
+                // Line counting only needs memchr over the block
+                for (char *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++)
+                {
+                    counts[0]++;
+                }
+            }
+        }
+        if (fd != STDIN_FILENO)
+        {
+            close(fd);
+        }
+
+        const char *sep = "";
+        for (int k = 0; k < 3; k++)
+        {
+            if (want[k])
+            {
+                printf("%s%*ld", sep, width, counts[k]);
+                sep = " ";
+            }
+            total[k] += counts[k];
+        }
+        printf(args[i] != NULL ? " %s\n" : "\n", args[i]);
+    } while (args[i] != NULL && args[++i] != NULL && !lsh_interrupted);
+
+    if (nfiles > 1)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            if (want[k])
+            {
+                printf("%*ld ", width, total[k]);
+            }
+        }
+        printf("total\n");
+    }
+    return 1;
+}
+
+/**********************************************************************  Sleep built-in command **********************************************************************/
+int lsh_sleep(char **args)
+{
+    double seconds = 0;
+    int i;
+
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "minishell: sleep: missing operand\n");
+        lsh_last_status = 1;
+        return 1;
+    }
+
+    // Operands are added up; each may carry an s, m, h or d suffix
+    for (i = 1; args[i] != NULL; i++)
+    {
+        char *end;
+        double v = strtod(args[i], &end);
+        const char *units = "smhd";
+        static const double scale[] = {1, 60, 3600, 86400};
+        const char *u = *end ? strchr(units, *end) : units;
+        if (end == args[i] || v < 0 || u == NULL || (*end && end[1] != '\0'))
+        {
+            fprintf(stderr, "minishell: sleep: invalid time interval '%s'\n", args[i]);
+            lsh_last_status = 1;
+            return 1;
+        }
+        seconds += v * scale[u - units];
+    }
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    {
+        if (lsh_interrupted)
+        {
+            lsh_last_status = 130;
+            break;
+        }
+    }
+    return 1;
+}
+
+/**********************************************************************  Command index: scan one $PATH directory **********************************************************************/
+void lsh_cmd_dir_scan(struct lsh_cmd_dir *d)
+{
+    DIR *dir = opendir(d->path);
+    struct dirent *de;
+    int i;
+
+    for (i = 0; i < d->count; i++)
+    {
+        free(d->names[i]);
+    }
+    d->count = 0;
+    if (dir == NULL)
+    {
+        return;
+    }
+
+    // Executables only; d_type saves a stat for everything that is plainly not a file
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (de->d_name[0] == '.' || de->d_type == DT_DIR ||
+            faccessat(dirfd(dir), de->d_name, X_OK, 0) == -1)
+        {
+            continue;
+        }
+        if (d->count == d->cap)
+        {
+            d->cap = d->cap ? d->cap * 2 : 64;
+            d->names = realloc(d->names, d->cap * sizeof(char *));
+        }
+        if (!d->names || !(d->names[d->count++] = strdup(de->d_name)))
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    closedir(dir);
+}
+
+/**********************************************************************  Sort helper for command names **********************************************************************/
+int lsh_cmd_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**********************************************************************  Command index: bring up to date with $PATH **********************************************************************/
+void lsh_cmd_index_refresh(void)
+{
+    struct lsh_cmd_index *x = &lsh_cmd_index;
+    const char *path = lsh_var_get("PATH");
+    int i, j, changed = 0;
+
+    if (path == NULL)
+    {
+        path = "";
+    }
+
+    // A different $PATH starts over; otherwise a directory is rescanned only when its mtime moved
+    if (x->path_env == NULL || strcmp(x->path_env, path) != 0)
+    {
+        for (i = 0; i < x->ndirs; i++)
+        {
+            for (j = 0; j < x->dirs[i].count; j++)
+            {
+                free(x->dirs[i].names[j]);
+            }
+            free(x->dirs[i].names);
+            free(x->dirs[i].path);
+        }
+        free(x->dirs);
+        free(x->path_env);
+        x->path_env = strdup(path);
+        x->ndirs = 1;
+        for (i = 0; path[i] != '\0'; i++)
+        {
+            x->ndirs += path[i] == ':';
+        }
+        x->dirs = calloc(x->ndirs, sizeof(struct lsh_cmd_dir));
+        if (!x->path_env || !x->dirs)
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        const char *p = path;
+        for (i = 0; i < x->ndirs; i++)
+        {
+            size_t len = strcspn(p, ":");
+            x->dirs[i].path = len ? strndup(p, len) : strdup(".");
+            x->dirs[i].mtime.tv_sec = -1;
+            p += len + (p[len] == ':');
+        }
+        changed = 1;
+    }
+    for (i = 0; i < x->ndirs; i++)
+    {
+        struct stat st;
+        struct lsh_cmd_dir *d = &x->dirs[i];
+        if (stat(d->path, &st) == -1)
+        {
+            st.st_mtim.tv_sec = 0;
+            st.st_mtim.tv_nsec = 0;
+        }
+        if (st.st_mtim.tv_sec != d->mtime.tv_sec || st.st_mtim.tv_nsec != d->mtime.tv_nsec)
+        {
+            d->mtime = st.st_mtim;
+            lsh_cmd_dir_scan(d);
+            changed = 1;
+        }
+    }
+    if (!changed)
+    {
+        return;
+    }
+
+    // Merge every directory and the built-ins into one sorted, duplicate-free array
+    int total = lsh_num_builtins();
+    for (i = 0; i < x->ndirs; i++)
+    {
+        total += x->dirs[i].count;
+    }
+    x->names = realloc(x->names, (total ? total : 1) * sizeof(char *));
+    if (!x->names)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    x->count = 0;
+    for (i = 0; i < lsh_num_builtins(); i++)
+    {
+        x->names[x->count++] = builtin_str[i];
+    }
+    for (i = 0; i < x->ndirs; i++)
+    {
+        for (j = 0; j < x->dirs[i].count; j++)
+        {
+            x->names[x->count++] = x->dirs[i].names[j];
+        }
+    }
+    qsort(x->names, x->count, sizeof(char *), lsh_cmd_compare);
+    for (i = j = 0; i < x->count; i++)
+    {
+        if (j == 0 || strcmp(x->names[j - 1], x->names[i]) != 0)
+        {
+            x->names[j++] = x->names[i];
+        }
+    }
+    x->count = j;
+}
+
+/**********************************************************************  Completion: add a candidate **********************************************************************/
+void lsh_complete_add(struct lsh_completion *c, const char *name, int is_dir)
+{
+    size_t len = strlen(name);
+    char *copy = lsh_arena_alloc(&lsh_cmd_arena, len + 2);
+
+    memcpy(copy, name, len);
+    copy[len] = is_dir ? '/' : '\0';
+    copy[len + 1] = '\0';
+    if (c->count == c->cap)
+    {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->items = lsh_arena_grow(&lsh_cmd_arena, c->items, c->count * sizeof(char *), c->cap * sizeof(char *));
+    }
+    c->items[c->count++] = copy;
+}
+
+/**********************************************************************  Completion: command names starting with a prefix **********************************************************************/
+void lsh_complete_commands(struct lsh_completion *c, const char *prefix)
+{
+    struct lsh_cmd_index *x = &lsh_cmd_index;
+    size_t len = strlen(prefix);
+    int lo = 0, hi;
+
+    lsh_cmd_index_refresh();
+
+    // Binary search for the first name not below the prefix; matches follow it in order
+    hi = x->count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (strcmp(x->names[mid], prefix) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    for (; lo < x->count && strncmp(x->names[lo], prefix, len) == 0; lo++)
+    {
+        lsh_complete_add(c, x->names[lo], 0);
+    }
+}
+
+/**********************************************************************  Completion: file names for a partial path **********************************************************************/
+void lsh_complete_files(struct lsh_completion *c, const char *word)
+{
+    const char *slash = strrchr(word, '/');
+    const char *base = slash ? slash + 1 : word;
+    char *dir_name = slash ? lsh_arena_alloc(&lsh_cmd_arena, slash - word + 2) : ".";
+    size_t len = strlen(base);
+    struct dirent *de;
+
+    if (slash)
+    {
+        memcpy(dir_name, word, slash - word + 1);
+        dir_name[slash - word + 1] = '\0';
+    }
+    DIR *dir = opendir(dir_name);
+    if (dir == NULL)
+    {
+        return;
+    }
+    while ((de = readdir(dir)) != NULL)
+    {
+        // Hidden files only when asked for, never . and ..
+        if (strncmp(de->d_name, base, len) != 0 || (de->d_name[0] == '.' && base[0] != '.') ||
+            strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+        {
+            continue;
+        }
+        struct stat st;
+        int is_dir = de->d_type == DT_DIR ||
+                     ((de->d_type == DT_LNK || de->d_type == DT_UNKNOWN) && fstatat(dirfd(dir), de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+        lsh_complete_add(c, de->d_name, is_dir);
+    }
+    closedir(dir);
+    qsort(c->items, c->count, sizeof(char *), lsh_cmd_compare);
+}
+
+/**********************************************************************  Line editor: terminal raw mode **********************************************************************/
+int lsh_edit_raw(int on)
+{
+    struct termios raw;
+
+    if (!on)
+    {
+        return tcsetattr(STDIN_FILENO, TCSADRAIN, &lsh_shell_tmodes);
+    }
+    // Byte at a time, no echo, and Ctrl-C / Ctrl-Z arrive as keys instead of signals
+    raw = lsh_shell_tmodes;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+}
+
+/**********************************************************************  Line editor: queue output for the terminal **********************************************************************/
+void lsh_edit_out(struct lsh_editor *e, const char *s, size_t n)
+{
+    // Everything of one key press goes out in a single write
+    if (e->out_len + n > sizeof(e->out))
+    {
+        lsh_write_all(STDOUT_FILENO, e->out, e->out_len);
+        e->out_len = 0;
+        if (n > sizeof(e->out))
+        {
+            lsh_write_all(STDOUT_FILENO, s, n);
+            return;
+        }
+    }
+    memcpy(e->out + e->out_len, s, n);
+    e->out_len += n;
+}
+
+/**********************************************************************  Line editor: redraw from the cursor to the end **********************************************************************/
+void lsh_edit_tail(struct lsh_editor *e, size_t from)
+{
+    char seq[32];
+
+    // Move back to the first changed column, rewrite the rest, clear what is left of the old line
+    if (from < e->pos_shown)
+    {
+        lsh_edit_out(e, seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", e->pos_shown - from));
+    }
+    lsh_edit_out(e, e->buf + from, e->len - from);
+    lsh_edit_out(e, "\x1b[K", 3);
+    if (e->len > e->pos)
+    {
+        lsh_edit_out(e, seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", e->len - e->pos));
+    }
+    e->pos_shown = e->pos;
+}
+
+/**********************************************************************  Line editor: redraw the whole line **********************************************************************/
+void lsh_edit_refresh(struct lsh_editor *e)
+{
+    lsh_edit_out(e, "\r", 1);
+    lsh_edit_out(e, e->prompt, strlen(e->prompt));
+    e->pos_shown = 0;
+    lsh_edit_tail(e, 0);
+}
+
+/**********************************************************************  Line editor: move the cursor **********************************************************************/
+void lsh_edit_move(struct lsh_editor *e, size_t pos)
+{
+    char seq[32];
+
+    if (pos < e->pos_shown)
+    {
+        lsh_edit_out(e, seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", e->pos_shown - pos));
+    }
+    else if (pos > e->pos_shown)
+    {
+        lsh_edit_out(e, seq, snprintf(seq, sizeof(seq), "\x1b[%zuC", pos - e->pos_shown));
+    }
+    e->pos = e->pos_shown = pos;
+}
+
+/**********************************************************************  Line editor: insert text at the cursor **********************************************************************/
+void lsh_edit_insert(struct lsh_editor *e, const char *s, size_t n)
+{
+    size_t from = e->pos;
+
+    if (e->len + n + 1 > e->cap)
+    {
+        while (e->len + n + 1 > e->cap)
+        {
+            e->cap *= 2;
+        }
+        e->buf = realloc(e->buf, e->cap);
+        if (!e->buf)
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memmove(e->buf + e->pos + n, e->buf + e->pos, e->len - e->pos);
+    memcpy(e->buf + e->pos, s, n);
+    e->len += n;
+    e->pos += n;
+
+    // Typing at the end of the line only echoes the new text
+    if (from == e->len - n)
+    {
+        lsh_edit_out(e, s, n);
+        e->pos_shown = e->pos;
+    }
+    else
+    {
+        lsh_edit_tail(e, from);
+    }
+}
+
+/**********************************************************************  Line editor: delete a range, optionally into the kill buffer **********************************************************************/
+void lsh_edit_delete(struct lsh_editor *e, size_t from, size_t to, int kill)
+{
+    if (from >= to)
+    {
+        return;
+    }
+    if (kill)
+    {
+        free(e->yank);
+        e->yank = strndup(e->buf + from, to - from);
+    }
+    memmove(e->buf + from, e->buf + to, e->len - to);
+    e->len -= to - from;
+    e->pos = from;
+    lsh_edit_tail(e, from);
+}
+
+/**********************************************************************  Line editor: replace the whole line **********************************************************************/
+void lsh_edit_set(struct lsh_editor *e, const char *s, size_t n)
+{
+    if (n + 1 > e->cap)
+    {
+        e->cap = n + 1;
+        e->buf = realloc(e->buf, e->cap);
+        if (!e->buf)
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(e->buf, s, n);
+    e->len = e->pos = n;
+    lsh_edit_refresh(e);
+}
+
+/**********************************************************************  Line editor: step through history **********************************************************************/
+void lsh_edit_history(struct lsh_editor *e, int dir)
+{
+    long to = e->hist_pos + dir;
+
+    if (to < 0 || to > lsh_history.count)
+    {
+        return;
+    }
+    // The line being typed is kept aside while older entries are shown
+    if (e->hist_pos == lsh_history.count)
+    {
+        free(e->saved);
+        e->saved = strndup(e->buf, e->len);
+    }
+    e->hist_pos = to;
+    if (to == lsh_history.count)
+    {
+        lsh_edit_set(e, e->saved ? e->saved : "", e->saved ? strlen(e->saved) : 0);
+    }
+    else
+    {
+        lsh_edit_set(e, lsh_history.entries[to].line, lsh_history.entries[to].len);
+    }
+}
+
+/**********************************************************************  Line editor: next byte of an escape sequence **********************************************************************/
+int lsh_edit_seq_byte(unsigned char *c)
+{
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    int n;
+
+    // A terminal sends a sequence in one go; a lone Esc is followed by nothing, or by a key typed later
+    while ((n = poll(&fd, 1, LSH_KEY_ESC_MS)) == -1 && errno == EINTR)
+    {
+    }
+    return n == 1 && read(STDIN_FILENO, c, 1) == 1;
+}
+
+/**********************************************************************  Line editor: read a key, decoding escape sequences **********************************************************************/
+int lsh_edit_key(void)
+{
+    unsigned char c, seq[4];
+    ssize_t n;
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {lsh_event_fd, POLLIN, 0}};
+
+    // While waiting for a key, children that change state are collected at once; set -o notify reports them too
+    while (lsh_event_fd != -1)
+    {
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, 2, -1) == -1 && errno != EINTR)
+        {
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            lsh_reap_jobs();
+            if (lsh_opt_notify && lsh_jobs_changed())
+            {
+                return LSH_KEY_JOBS;
+            }
+        }
+        if (fds[0].revents)
+        {
+            break;
+        }
+    }
+    while ((n = read(STDIN_FILENO, &c, 1)) == -1 && errno == EINTR)
+    {
+    }
+    if (n <= 0)
+    {
+        return -1;
+    }
+    if (c != 27)
+    {
+        return c;
+    }
+
+    // ESC [ x, ESC [ n ~, ESC O x and Alt-key (ESC x); ESC with nothing after it is the Esc key itself
+    if (!lsh_edit_seq_byte(&seq[0]))
+    {
+        return 27;
+    }
+    if (seq[0] != '[' && seq[0] != 'O')
+    {
+        return LSH_KEY_ALT | seq[0];
+    }
+    if (!lsh_edit_seq_byte(&seq[1]))
+    {
+        return 27;
+    }
+    if (seq[1] >= '0' && seq[1] <= '9')
+    {
+        // The whole first number picks the key (ESC [ 15 ~ is F5); modifiers such as ESC [ 1 ; 5 C are skipped
+        int num = seq[1] - '0', digits = 1;
+        while (1)
+        {
+            if (!lsh_edit_seq_byte(&seq[2]))
+            {
+                return 27;
+            }
+            if (seq[2] == ';')
+            {
+                digits = 0;
+            }
+            else if (seq[2] < '0' || seq[2] > '9')
+            {
+                break;
+            }
+            else if (digits && num < 1000)
+            {
+                num = num * 10 + (seq[2] - '0');
+            }
+        }
+        if (seq[2] != '~')
+        {
+            seq[1] = seq[2];
+        }
+        else
+        {
+            return num == 3 ? LSH_KEY_DELETE : num == 1 || num == 7 ? LSH_KEY_HOME : num == 4 || num == 8 ? LSH_KEY_END : 0;
+        }
+    }
+    switch (seq[1])
+    {
+    case 'A':
+        return LSH_KEY_UP;
+    case 'B':
+        return LSH_KEY_DOWN;
+    case 'C':
+        return LSH_KEY_RIGHT;
+    case 'D':
+        return LSH_KEY_LEFT;
+    case 'H':
+        return LSH_KEY_HOME;
+    case 'F':
+        return LSH_KEY_END;
+    }
+    return 0;
+}
+
+/**********************************************************************  Line editor: Ctrl-R incremental search **********************************************************************/
+int lsh_edit_search(struct lsh_editor *e)
+{
+    char query[256];
+    size_t qlen = 0;
+    long match = lsh_history.count;
+    char line[512];
+    int key;
+
+    query[0] = '\0';
+    while (1)
+    {
+        // Show the query and the newest entry containing it
+        int found = match >= 0 && match < lsh_history.count;
+        const char *text = found ? lsh_history.entries[match].line : "";
+        size_t text_len = found ? lsh_history.entries[match].len : 0;
+        int n = snprintf(line, sizeof(line), "\r(%sreverse-i-search)`%s': ", match < 0 ? "failed " : "", query);
+        lsh_edit_out(e, line, n);
+        lsh_edit_out(e, text, text_len);
+        lsh_edit_out(e, "\x1b[K", 3);
+        lsh_write_all(STDOUT_FILENO, e->out, e->out_len);
+        e->out_len = 0;
+
+        key = lsh_edit_key();
+        if (key == LSH_KEY_JOBS)
+        {
+            continue; // Reported when the line is done
+        }
+        if (key == LSH_CTRL('r'))
+        {
+            // Next older match
+            long older = match > 0 ? lsh_history_find(query, match) : -1;
+            match = older >= 0 ? older : match;
+            continue;
+        }
+        if (key == 127 || key == LSH_CTRL('h'))
+        {
+            if (qlen > 0)
+            {
+                query[--qlen] = '\0';
+            }
+        }
+        else if (key >= 32 && key < 127 && qlen + 1 < sizeof(query))
+        {
+            query[qlen++] = key;
+            query[qlen] = '\0';
+        }
+        else
+        {
+            break;
+        }
+        match = qlen ? lsh_history_find(query, lsh_history.count) : lsh_history.count;
+    }
+
+    // Ctrl-G gives the old line back; anything else takes the match
+    if (key != LSH_CTRL('g') && match >= 0 && match < lsh_history.count)
+    {
+        e->hist_pos = match;
+        lsh_edit_set(e, lsh_history.entries[match].line, lsh_history.entries[match].len);
+    }
+    else
+    {
+        lsh_edit_refresh(e);
+    }
+    return key == LSH_CTRL('g') ? 0 : key;
+}
+
+/**********************************************************************  Line editor: Tab completion **********************************************************************/
+void lsh_edit_complete(struct lsh_editor *e, int again)
+{
+    struct lsh_completion c = {NULL, 0, 0};
+    size_t start = e->pos, i, common;
+
+    // The word under the cursor, and whether it is in command position
+    while (start > 0 && !strchr(" \t|<>&;", e->buf[start - 1]))
+    {
+        start--;
+    }
+    i = start;
+    while (i > 0 && (e->buf[i - 1] == ' ' || e->buf[i - 1] == '\t'))
+    {
+        i--;
+    }
+    char *word = lsh_arena_alloc(&lsh_cmd_arena, e->pos - start + 1);
+    memcpy(word, e->buf + start, e->pos - start);
+    word[e->pos - start] = '\0';
+
+    if ((i == 0 || strchr("|&;", e->buf[i - 1])) && strchr(word, '/') == NULL)
+    {
+        lsh_complete_commands(&c, word);
+    }
+    else
+    {
+        lsh_complete_files(&c, word);
+    }
+    if (c.count == 0)
+    {
+        lsh_edit_out(e, "\a", 1);
+        return;
+    }
+
+    // Insert what all candidates share; a single candidate also gets its separator
+    const char *base = strrchr(word, '/') ? strrchr(word, '/') + 1 : word;
+    size_t have = strlen(base);
+    common = strlen(c.items[0]);
+    for (i = 1; i < (size_t)c.count; i++)
+    {
+        size_t j = 0;
+        while (j < common && c.items[i][j] == c.items[0][j])
+        {
+            j++;
+        }
+        common = j;
+    }
+    if (common > have)
+    {
+        lsh_edit_insert(e, c.items[0] + have, common - have);
+        if (c.count == 1 && c.items[0][common - 1] != '/')
+        {
+            lsh_edit_insert(e, " ", 1);
+        }
+        return;
+    }
+    if (c.count == 1)
+    {
+        if (c.items[0][common - 1] != '/')
+        {
+            lsh_edit_insert(e, " ", 1);
+        }
+        return;
+    }
+    if (!again)
+    {
+        lsh_edit_out(e, "\a", 1);
+        return;
+    }
+
+    // Second Tab with nothing to add: list the candidates under the line
+    lsh_edit_out(e, "\r\n", 2);
+    for (i = 0; i < (size_t)c.count && i < LSH_COMPLETE_SHOW; i++)
+    {
+        lsh_edit_out(e, c.items[i], strlen(c.items[i]));
+        lsh_edit_out(e, "  ", 2);
+    }
+    if (c.count > LSH_COMPLETE_SHOW)
+    {
+        char more[64];
+        lsh_edit_out(e, more, snprintf(more, sizeof(more), "... (%d more)", c.count - LSH_COMPLETE_SHOW));
+    }
+    lsh_edit_out(e, "\r\n", 2);
+    lsh_edit_refresh(e);
+}
+
+/**********************************************************************  Line editor: read one line **********************************************************************/
+char *lsh_edit_line(const char *prompt)
+{
+    struct lsh_editor e;
+    int key, last = 0;
+
+    memset(&e, 0, sizeof(e));
+    e.prompt = prompt;
+    e.cap = LSH_RL_BUFSIZE;
+    e.buf = malloc(e.cap);
+    e.hist_pos = lsh_history.count;
+    e.yank = lsh_edit_yank;
+    if (!e.buf)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // lsh_read_line has put the terminal in raw mode; the prompt is still in stdio's buffer
+    fflush(stdout);
+    while ((key = lsh_edit_key()) != -1)
+    {
+        if (key == LSH_CTRL('r'))
+        {
+            key = lsh_edit_search(&e);
+        }
+        if (key == '\r' || key == '\n')
+        {
+            break;
+        }
+        switch (key)
+        {
+        case LSH_CTRL('a'):
+        case LSH_KEY_HOME:
+            lsh_edit_move(&e, 0);
+            break;
+        case LSH_CTRL('e'):
+        case LSH_KEY_END:
+            lsh_edit_move(&e, e.len);
+            break;
+        case LSH_CTRL('b'):
+        case LSH_KEY_LEFT:
+            lsh_edit_move(&e, e.pos - (e.pos > 0));
+            break;
+        case LSH_CTRL('f'):
+        case LSH_KEY_RIGHT:
+            lsh_edit_move(&e, e.pos + (e.pos < e.len));
+            break;
+        case LSH_KEY_ALT | 'b':
+        {
+            size_t p = e.pos;
+            while (p > 0 && e.buf[p - 1] == ' ')
+            {
+                p--;
+            }
+            while (p > 0 && e.buf[p - 1] != ' ')
+            {
+                p--;
+            }
+            lsh_edit_move(&e, p);
+            break;
+        }
+        case LSH_KEY_ALT | 'f':
+        {
+            size_t p = e.pos;
+            while (p < e.len && e.buf[p] == ' ')
+            {
+                p++;
+            }
+            while (p < e.len && e.buf[p] != ' ')
+            {
+                p++;
+            }
+            lsh_edit_move(&e, p);
+            break;
+        }
+        case 127:
+        case LSH_CTRL('h'):
+            lsh_edit_delete(&e, e.pos - (e.pos > 0), e.pos, 0);
+            break;
+        case LSH_CTRL('d'):
+            if (e.len == 0)
+            {
+                // End of input on an empty line ends the session
+                lsh_edit_raw(0);
+                lsh_write_all(STDOUT_FILENO, e.out, e.out_len);
+                lsh_edit_yank = e.yank;
+                free(e.saved);
+                free(e.buf);
+                return NULL;
+            }
+            lsh_edit_delete(&e, e.pos, e.pos + (e.pos < e.len), 0);
+            break;
+        case LSH_KEY_DELETE:
+            lsh_edit_delete(&e, e.pos, e.pos + (e.pos < e.len), 0);
+            break;
+        case LSH_CTRL('k'):
+            lsh_edit_delete(&e, e.pos, e.len, 1);
+            break;
+        case LSH_CTRL('u'):
+            lsh_edit_delete(&e, 0, e.pos, 1);
+            break;
+        case LSH_CTRL('w'):
+        {
+            size_t p = e.pos;
+            while (p > 0 && e.buf[p - 1] == ' ')
+            {
+                p--;
+            }
+            while (p > 0 && e.buf[p - 1] != ' ')
+            {
+                p--;
+            }
+            lsh_edit_delete(&e, p, e.pos, 1);
+            break;
+        }
+        case LSH_CTRL('y'):
+            if (e.yank != NULL)
+            {
+                lsh_edit_insert(&e, e.yank, strlen(e.yank));
+            }
+            break;
+        case LSH_CTRL('p'):
+        case LSH_KEY_UP:
+            lsh_edit_history(&e, -1);
+            break;
+        case LSH_CTRL('n'):
+        case LSH_KEY_DOWN:
+            lsh_edit_history(&e, 1);
+            break;
+        case LSH_CTRL('l'):
+            lsh_edit_out(&e, "\x1b[H\x1b[2J", 7);
+            lsh_edit_refresh(&e);
+            break;
+        case LSH_CTRL('c'):
+            // Drop the line, like an interrupted command
+            lsh_edit_move(&e, e.len);
+            lsh_edit_out(&e, "^C\r\n", 4);
+            lsh_edit_out(&e, e.prompt, strlen(e.prompt));
+            e.len = e.pos = e.pos_shown = 0;
+            e.hist_pos = lsh_history.count;
+            lsh_last_status = 130;
+            break;
+        case '\t':
+            lsh_edit_complete(&e, last == '\t');
+            break;
+        case LSH_KEY_JOBS:
+            // A background job finished: report it and draw the line again below
+            lsh_edit_out(&e, "\r\x1b[K", 4);
+            lsh_write_all(STDOUT_FILENO, e.out, e.out_len);
+            e.out_len = 0;
+            lsh_notify_jobs();
+            lsh_edit_refresh(&e);
+            key = last;
+            break;
+        default:
+            if (key >= 32 && key < 256 && key != 127)
+            {
+                char ch = key;
+                lsh_edit_insert(&e, &ch, 1);
+            }
+            break;
+        }
+        last = key;
+        lsh_write_all(STDOUT_FILENO, e.out, e.out_len);
+        e.out_len = 0;
+    }
+
+    // The line is done: cursor to its end, newline, cooked mode for the command
+    lsh_edit_move(&e, e.len);
+    lsh_edit_out(&e, "\r\n", 2);
+    lsh_write_all(STDOUT_FILENO, e.out, e.out_len);
+    lsh_edit_raw(0);
+
+    lsh_edit_yank = e.yank;
+    free(e.saved);
+    if (key == -1 && e.len == 0)
+    {
+        free(e.buf);
+        return NULL;
+    }
+    e.buf[e.len] = '\0';
+    return e.buf;
+}
+
+/**********************************************************************  Read a line from standard input **********************************************************************/
+char *lsh_read_line(const char *prompt)
+{
+    int bufsize = LSH_RL_BUFSIZE;
+    int position = 0;
+    char *buffer = malloc(sizeof(char) * bufsize);
+    int c;
+
+    // A terminal that takes raw mode gets the line editor; anything else is read as typed
+    if (lsh_edit_enabled && lsh_edit_raw(1) == 0)
+    {
+        free(buffer);
+        return lsh_edit_line(prompt);
+    }
+    if (!buffer)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1)
+    {
+        c = getchar();
+
+        if (c == EOF && position == 0)
+        {
+            // End of input on an empty line ends the session
+            free(buffer);
+            return NULL;
+        }
+        if (c == EOF || c == '\n')
+        {
+            buffer[position] = '\0';
+            return buffer;
+        }
+        else
+        {
+            buffer[position] = c;
+        }
+        position++;
+
+        if (position >= bufsize)
+        {
+            bufsize += LSH_RL_BUFSIZE;
+            buffer = realloc(buffer, bufsize);
+            if (!buffer)
+            {
+                fprintf(stderr, "minishell: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+/**********************************************************************  Batch input: read from a descriptor in large blocks **********************************************************************/
+int lsh_input_fd(struct lsh_input *in, int fd)
+{
+    memset(in, 0, sizeof(*in));
+    in->fd = fd;
+    in->cap = LSH_IN_BUFSIZE;
+    in->buf = malloc(in->cap);
+    if (!in->buf)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/**********************************************************************  Batch input: map a whole script file **********************************************************************/
+int lsh_input_file(struct lsh_input *in, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "minishell: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        // Pipes, devices and empty files are read like stdin
+        return lsh_input_fd(in, fd);
+    }
+
+    // Private writable mapping so lines can be terminated in place
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return lsh_input_fd(in, fd);
+    }
+    close(fd);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+    in->buf = map;
+    in->len = st.st_size;
+    in->eof = 1;
+    return 0;
+}
+
+/**********************************************************************  Batch input: lines of a -c string **********************************************************************/
+int lsh_input_string(struct lsh_input *in, const char *s)
+{
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+    in->len = strlen(s);
+    in->cap = in->len + 1;
+    in->buf = strdup(s);
+    in->eof = 1;
+    if (!in->buf)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/**********************************************************************  Batch input: return the next line **********************************************************************/
+char *lsh_input_line(struct lsh_input *in)
+{
+    while (1)
+    {
+        char *start = in->buf + in->pos;
+        size_t avail = in->len - in->pos;
+        char *nl = memchr(start, '\n', avail);
+
+        if (nl != NULL)
+        {
+            *nl = '\0';
+            in->pos += nl - start + 1;
+            if (in->cap == 0 && (size_t)(start - in->buf) >= in->dropped + LSH_IN_DROP)
+            {
+                // Consumed pages of a mapping were dirtied by the terminators; give them back
+                size_t upto = (start - in->buf) & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+                madvise(in->buf + in->dropped, upto - in->dropped, MADV_DONTNEED);
+                in->dropped = upto;
+            }
+            return start;
+        }
+
+        if (in->eof)
+        {
+            if (avail == 0)
+            {
+                return NULL;
+            }
+            in->pos = in->len;
+
+            if (in->cap == 0)
+            {
+                // A mapping has no room for the terminator; copy the last line out
+                free(in->tail);
+                in->tail = strndup(start, avail);
+                if (!in->tail)
+                {
+                    fprintf(stderr, "minishell: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+                return in->tail;
+            }
+            start[avail] = '\0';
+            return start;
+        }
+
+        // Move the partial line to the front and grow when a single line fills the buffer
+        if (in->pos > 0)
+        {
+            memmove(in->buf, start, avail);
+            in->len = avail;
+            in->pos = 0;
+        }
+        if (in->len + 1 >= in->cap)
+        {
+            in->cap *= 2;
+            in->buf = realloc(in->buf, in->cap);
+            if (!in->buf)
+            {
+                fprintf(stderr, "minishell: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        ssize_t n = read(in->fd, in->buf + in->len, in->cap - in->len - 1);
+        if (n < 0 && errno == EINTR && !lsh_interrupted)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (n < 0 && errno != EINTR)
+            {
+                perror("minishell");
+            }
+            in->eof = 1;
+        }
+        else
+        {
+            in->len += n;
+        }
+    }
+}
+
+/**********************************************************************  Batch input: release buffers **********************************************************************/
+void lsh_input_close(struct lsh_input *in)
+{
+    if (in->cap == 0)
+    {
+        munmap(in->buf, in->len);
+    }
+    else
+    {
+        free(in->buf);
+    }
+    if (in->fd > STDERR_FILENO)
+    {
+        close(in->fd);
+    }
+    free(in->tail);
+    memset(in, 0, sizeof(*in));
+}
+
+/**********************************************************************  Per-command arena: allocate **********************************************************************/
+void *lsh_arena_alloc(struct lsh_arena *a, size_t size)
+{
+    struct lsh_arena_block *b = a->head;
+
+    size = (size + 15) & ~(size_t)15; // Keep every allocation 16-byte aligned
+    if (b == NULL || b->size - b->used < size)
+    {
+        // Start a new block, large enough for oversized requests such as very long lines
+        size_t block_size = size > LSH_ARENA_BLOCK / 2 ? size + LSH_ARENA_BLOCK : LSH_ARENA_BLOCK;
+        b = malloc(sizeof(struct lsh_arena_block) + block_size);
+        if (!b)
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        b->size = block_size;
+        b->used = 0;
+        b->next = a->head;
+        a->head = b;
+        a->reserved += block_size;
+        a->blocks++;
+    }
+
+    void *p = b->data + b->used;
+    b->used += size;
+    a->last = p;
+    a->in_use += size;
+    a->allocs++;
+    if (a->in_use > a->peak)
+    {
+        a->peak = a->in_use;
+    }
+    return p;
+}
+
+/**********************************************************************  Per-command arena: grow the newest allocation **********************************************************************/
+void *lsh_arena_grow(struct lsh_arena *a, void *p, size_t old_size, size_t new_size)
+{
+    struct lsh_arena_block *b = a->head;
+    size_t old_aligned = (old_size + 15) & ~(size_t)15;
+    size_t new_aligned = (new_size + 15) & ~(size_t)15;
+
+    // The newest allocation can usually be extended where it is
+    if (p != NULL && p == a->last && b->size - b->used + old_aligned >= new_aligned)
+    {
+        b->used += new_aligned - old_aligned;
+        a->in_use += new_aligned - old_aligned;
+        if (a->in_use > a->peak)
+        {
+            a->peak = a->in_use;
+        }
+        return p;
+    }
+
+    void *q = lsh_arena_alloc(a, new_size);
+    if (p != NULL)
+    {
+        memcpy(q, p, old_size);
+    }
+    return q;
+}
+
+/**********************************************************************  Per-command arena: release everything **********************************************************************/
+void lsh_arena_reset(struct lsh_arena *a)
+{
+    struct lsh_arena_block *b = a->head;
+
+    if (b == NULL)
+    {
+        return;
+    }
+
+    // Keep only the newest block; older ones exist only after a command outgrew it
+    while (b->next != NULL)
+    {
+        struct lsh_arena_block *old = b->next;
+        b->next = old->next;
+        a->reserved -= old->size;
+        a->blocks--;
+        free(old);
+    }
+    b->used = 0;
+    a->in_use = 0;
+    a->last = NULL;
+}
+
+/**********************************************************************  Per-command arena: copy a string **********************************************************************/
+char *lsh_arena_strdup(struct lsh_arena *a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return memcpy(lsh_arena_alloc(a, len), s, len);
+}
+
+/**********************************************************************  Lexer: find the next byte that is not plain word text (scalar) **********************************************************************/
+const char *lsh_lex_scan_scalar(const char *p, const char *end)
+{
+    while (p < end && lsh_lex_class[(unsigned char)*p] == 0)
+    {
+        p++;
+    }
+    return p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**********************************************************************  Lexer: find the next byte that is not plain word text (SSE2) **********************************************************************/
+__attribute__((target("sse2"))) const char *lsh_lex_scan_sse2(const char *p, const char *end)
+{
+    // Candidates are every byte up to ' ' (whitespace, other controls) and the twelve specials;
+    // a control byte that turns out to be ordinary costs one trip through the scalar check
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i dquote = _mm_set1_epi8('"'), squote = _mm_set1_epi8('\''), bslash = _mm_set1_epi8('\\');
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'), bar = _mm_set1_epi8('|');
+    const __m128i amp = _mm_set1_epi8('&'), hash = _mm_set1_epi8('#'), semi = _mm_set1_epi8(';');
+    const __m128i lparen = _mm_set1_epi8('('), rparen = _mm_set1_epi8(')'), tick = _mm_set1_epi8('`');
+
+    while (end - p >= 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(x, space), space);
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, dquote), _mm_cmpeq_epi8(x, squote)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, bslash), _mm_cmpeq_epi8(x, lt)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, gt), _mm_cmpeq_epi8(x, bar)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, amp), _mm_cmpeq_epi8(x, hash)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, semi), _mm_or_si128(_mm_cmpeq_epi8(x, lparen), _mm_cmpeq_epi8(x, rparen))));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, tick));
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return lsh_lex_scan_scalar(p, end);
+}
+
+/**********************************************************************  Lexer: find the next byte that is not plain word text (AVX2) **********************************************************************/
+__attribute__((target("avx2"))) const char *lsh_lex_scan_avx2(const char *p, const char *end)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i dquote = _mm256_set1_epi8('"'), squote = _mm256_set1_epi8('\''), bslash = _mm256_set1_epi8('\\');
+    const __m256i lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>'), bar = _mm256_set1_epi8('|');
+    const __m256i amp = _mm256_set1_epi8('&'), hash = _mm256_set1_epi8('#'), semi = _mm256_set1_epi8(';');
+    const __m256i lparen = _mm256_set1_epi8('('), rparen = _mm256_set1_epi8(')'), tick = _mm256_set1_epi8('`');
+
+    while (end - p >= 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_cmpeq_epi8(_mm256_max_epu8(x, space), space);
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(x, dquote), _mm256_cmpeq_epi8(x, squote)));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(x, bslash), _mm256_cmpeq_epi8(x, lt)));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(x, gt), _mm256_cmpeq_epi8(x, bar)));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(x, amp), _mm256_cmpeq_epi8(x, hash)));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(x, semi), _mm256_or_si256(_mm256_cmpeq_epi8(x, lparen), _mm256_cmpeq_epi8(x, rparen))));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, tick));
+        unsigned int mask = _mm256_movemask_epi8(m);
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return lsh_lex_scan_sse2(p, end);
+}
+#endif
+
+/**********************************************************************  Lexer: pick the widest scanner the CPU has **********************************************************************/
+void lsh_lex_init(void)
+{
+    lsh_lex_scan = lsh_lex_scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        lsh_lex_scan = lsh_lex_scan_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        lsh_lex_scan = lsh_lex_scan_sse2;
+    }
+#endif
+}
+
+/**********************************************************************  Lexer: next byte c not escaped by a backslash **********************************************************************/
+const char *lsh_lex_unescaped(const char *p, const char *end, char c)
+{
+    const char *q = p;
+
+    // c counts unless an odd run of backslashes escapes it
+    while ((q = memchr(q, c, end - q)) != NULL)
+    {
+        const char *b = q;
+        while (b > p && b[-1] == '\\')
+        {
+            b--;
+        }
+        if ((q - b) % 2 == 0)
+        {
+            return q;
+        }
+        q++;
+    }
+    return NULL;
+}
+
+/**********************************************************************  Lexer: end of a double-quoted string **********************************************************************/
+const char *lsh_lex_dquote(const char *p, const char *end)
+{
+    const char *q = lsh_lex_unescaped(p, end, '"');
+
+    // Only a $( or ` before the quote can hide quotes of its own; then the string is walked byte by byte
+    if (q == NULL || (memchr(p, '`', q - p) == NULL && memmem(p, q - p, "$(", 2) == NULL))
+    {
+        return q;
+    }
+    for (q = p; q < end; q++)
+    {
+        if (*q == '\\')
+        {
+            q++;
+        }
+        else if (*q == '"')
+        {
+            return q;
+        }
+        else if (*q == '`' || (*q == '$' && q + 1 < end && q[1] == '('))
+        {
+            q = *q == '`' ? lsh_lex_unescaped(q + 1, end, '`') : lsh_lex_subst(q + 2, end);
+            if (q == NULL)
+            {
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**********************************************************************  Lexer: closing parenthesis of a $( command substitution **********************************************************************/
+const char *lsh_lex_subst(const char *p, const char *end)
+{
+    int depth = 1;
+
+    // Parentheses nest; quoted ones and escaped ones do not count
+    for (; p < end; p++)
+    {
+        switch (*p)
+        {
+        case '\\':
+            p++;
+            break;
+        case '\'':
+        case '"':
+        case '`':
+            p = *p == '\'' ? memchr(p + 1, '\'', end - p - 1) : *p == '"' ? lsh_lex_dquote(p + 1, end)
+                                                                      : lsh_lex_unescaped(p + 1, end, '`');
+            if (p == NULL)
+            {
+                return NULL;
+            }
+            break;
+        case '(':
+            depth++;
+            break;
+        case ')':
+            if (--depth == 0)
+            {
+                return p;
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**********************************************************************  Lexer: split a line into word and operator slices **********************************************************************/
+struct lsh_token *lsh_lex(const char *line, size_t len, int *ntokens)
+{
+    const char *p = line, *end = line + len;
+    int n = 0, join = 0;
+    int cap = LSH_TOK_BUFSIZE + len / 8; // About one token per eight bytes saves most regrowing on long lines
+    struct lsh_token *toks = lsh_arena_alloc(&lsh_cmd_arena, cap * sizeof(struct lsh_token));
+
+    if (lsh_lex_scan == NULL)
+    {
+        lsh_lex_init();
+    }
+    while (p < end)
+    {
+        unsigned char c = *p;
+        int cls = lsh_lex_class[c];
+
+        if (n == cap)
+        {
+            toks = lsh_arena_grow(&lsh_cmd_arena, toks, cap * sizeof(struct lsh_token), 2 * cap * sizeof(struct lsh_token));
+            cap *= 2;
+        }
+        if (cls == LSH_LEX_SPACE)
+        {
+            p++;
+            join = 0;
+        }
+        else if (cls == LSH_LEX_OP)
+        {
+            // Longest match: << <<- <<< <& >> >& && &> &>> || are the multi-byte operators
+            unsigned char c1 = p + 1 < end ? p[1] : 0, c2 = p + 2 < end ? p[2] : 0;
+            size_t op_len = 1;
+            int kind;
+            switch (c)
+            {
+            case '<':
+                kind = c1 == '&' ? LSH_TOK_DUPIN : c1 != '<' ? LSH_TOK_INPUT : c2 == '<' ? LSH_TOK_HERESTRING
+                     : c2 == '-' ? LSH_TOK_HEREDOC_STRIP : LSH_TOK_HEREDOC;
+                op_len = kind == LSH_TOK_INPUT ? 1 : kind == LSH_TOK_DUPIN || kind == LSH_TOK_HEREDOC ? 2 : 3;
+                break;
+            case '>':
+                kind = c1 == '>' ? LSH_TOK_APPEND : c1 == '&' ? LSH_TOK_DUPOUT : LSH_TOK_OUTPUT;
+                op_len = kind == LSH_TOK_OUTPUT ? 1 : 2;
+                break;
+            case '&':
+                kind = c1 == '&' ? LSH_TOK_AND : c1 != '>' ? LSH_TOK_BACKGROUND : c2 == '>' ? LSH_TOK_APPENDERR : LSH_TOK_OUTERR;
+                op_len = kind == LSH_TOK_BACKGROUND ? 1 : kind == LSH_TOK_APPENDERR ? 3 : 2;
+                break;
+            case '|':
+                kind = c1 == '|' ? LSH_TOK_OR : LSH_TOK_PIPE;
+                op_len = kind == LSH_TOK_OR ? 2 : 1;
+                break;
+            default:
+                kind = c == ';' ? LSH_TOK_SEMI : c == '(' ? LSH_TOK_LPAREN : LSH_TOK_RPAREN;
+                break;
+            }
+
+            // A lone digit right against < or > names the descriptor to redirect (2>err, 3<&0); join says it touches
+            if (join && n > 0 && (c == '<' || c == '>'))
+            {
+                struct lsh_token *prev = &toks[n - 1];
+                if (prev->len == 1 && !prev->quote && !prev->join && line[prev->off] >= '0' && line[prev->off] <= '9')
+                {
+                    prev->kind = LSH_TOK_FD0 + (line[prev->off] - '0');
+                }
+            }
+            toks[n++] = (struct lsh_token){p - line, op_len, kind, 0, 0, 0};
+            p += op_len;
+            join = 0;
+        }
+        else if (cls == LSH_LEX_HASH && !join)
+        {
+            // A '#' starting a word comments out the rest of the line (also covers "#!" in scripts)
+            break;
+        }
+        else if (cls == LSH_LEX_QUOTE)
+        {
+            // Quoted text is one slice without the quotes; an unterminated quote runs to the end
+            const char *q = p + 1;
+            const char *close = c == '\'' ? memchr(q, '\'', end - q) : lsh_lex_dquote(q, end);
+            if (close == NULL)
+            {
+                close = end;
+            }
+            toks[n++] = (struct lsh_token){q - line, close - q, LSH_TOK_WORD, join, c, memchr(q, '`', close - q) != NULL};
+            p = close + (close < end);
+            join = 1;
+        }
+        else
+        {
+            // Plain word text up to whitespace, a quote or an operator; backslash keeps the next byte in the word
+            const char *w = p, *lit = NULL;
+            int tick = 0;
+            while ((p = lsh_lex_scan(p, end)) < end)
+            {
+                cls = lsh_lex_class[(unsigned char)*p];
+                if (cls == LSH_LEX_ESCAPE)
+                {
+                    lit = p + 1;
+                    tick |= p + 1 < end && p[1] == '`';
+                    p += 1 + (p + 1 < end);
+                }
+                else if (cls == 0 || cls == LSH_LEX_HASH)
+                {
+                    p++;
+                }
+                else if (cls == LSH_LEX_TICK || (*p == '(' && p > w && p[-1] == '$' && p - 1 != lit))
+                {
+                    // `command` and $(command) are part of the word, whatever they contain; unclosed, they run to the end
+                    const char *q = cls == LSH_LEX_TICK ? lsh_lex_unescaped(p + 1, end, '`') : lsh_lex_subst(p + 1, end);
+                    tick |= cls == LSH_LEX_TICK;
+                    p = q != NULL ? q + 1 : end;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            toks[n++] = (struct lsh_token){w - line, p - w, LSH_TOK_WORD, join, 0, tick};
+            join = 1;
+        }
+    }
+    *ntokens = n;
+    return toks;
+}
+
+/**********************************************************************  Tokenisation: does a slice hold quoted pattern bytes **********************************************************************/
+int lsh_glob_quoted(const char *s, size_t n, int quote)
+{
+    const char *end = s + n, *p;
+
+    // Quoted: any pattern or brace byte. Unquoted: one after a backslash.
+    if (quote != 0)
+    {
+        for (p = s; p < end; p++)
+        {
+            if (*p == '*' || *p == '?' || *p == '[' || *p == '{' || *p == ',' || *p == '}')
+            {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    for (p = s; (p = memchr(p, '\\', end - p)) != NULL && p + 1 < end; p += 2)
+    {
+        if (p[1] != '\0' && strchr(LSH_GLOB_QUOTE, p[1]) != NULL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************  Tokenisation (Split a line into tokens) **********************************************************************/
+char **lsh_split_line(char *line)
+{
+    size_t len = strlen(line);
+    int ntokens, i, position = 0;
+    unsigned int j;
+
+    // Slice offsets are 32-bit
+    if (len > UINT_MAX)
+    {
+        fprintf(stderr, "minishell: line too long\n");
+        len = 0;
+        line = "";
+    }
+    struct lsh_token *toks = lsh_lex(line, len, &ntokens);
+
+    // Token bytes and the token array both live in the command arena; words point into the copy
+    char *line_copy = memcpy(lsh_arena_alloc(&lsh_cmd_arena, len + 1), line, len + 1);
+    char **tokens = lsh_arena_alloc(&lsh_cmd_arena, (ntokens + 1) * sizeof(char *));
+    char *w = NULL;
+    int delim = 0; // The next word ends a here-document
+
+    for (i = 0; i < ntokens; i++)
+    {
+        struct lsh_token *t = &toks[i];
+
+        if (t->kind != LSH_TOK_WORD)
+        {
+            tokens[position++] = (char *)lsh_tok_text[t->kind];
+            delim = t->kind == LSH_TOK_HEREDOC || t->kind == LSH_TOK_HEREDOC_STRIP;
+            continue;
+        }
+        if (delim)
+        {
+            // A here-document delimiter stays as written, quotes included; they decide whether the body expands
+            unsigned int start = t->off - (t->quote != 0), stop;
+            while (i + 1 < ntokens && toks[i + 1].join)
+            {
+                t = &toks[++i];
+            }
+            stop = t->off + t->len + (t->quote != 0 && t->off + t->len < len);
+            line_copy[stop] = '\0';
+            tokens[position++] = line_copy + start;
+            w = NULL;
+            delim = 0;
+            continue;
+        }
+        // Slices glued to the previous one (a"b c"d) are moved down onto its end; the copy only shrinks
+        const char *src = line_copy + t->off;
+        if (!t->join || w == NULL)
+        {
+            w = line_copy + t->off;
+            tokens[position++] = w;
+        }
+        if (memchr(src, '$', t->len) == NULL && !t->tick && !lsh_glob_quoted(src, t->len, t->quote) &&
+            (t->quote == '\'' || memchr(src, '\\', t->len) == NULL))
+        {
+            memmove(w, src, t->len);
+            w += t->len;
+        }
+        else
+        {
+            // A $ or ` in single quotes or after a backslash is literal, and so are quoted pattern and brace
+            // bytes; mark them so expansion leaves them alone. Every marker replaces at least one byte.
+            for (j = 0; j < t->len; j++)
+            {
+                const char *glob = src[j] != '\0' ? strchr(LSH_GLOB_QUOTE, src[j]) : NULL;
+                if ((src[j] == '$' || src[j] == '`') && t->quote == '\'')
+                {
+                    *w++ = src[j] == '$' ? LSH_CTL_DOLLAR : LSH_CTL_TICK;
+                }
+                else if (src[j] == '$' && j + 1 < t->len && (src[j + 1] == '?' || src[j + 1] == '{'))
+                {
+                    // $? and ${NAME} are parameters in double quotes too; their bytes are not patterns
+                    const char *close = src[j + 1] == '{' ? memchr(src + j, '}', t->len - j) : src + j + 1;
+                    size_t n = close != NULL ? (size_t)(close - src) + 1 - j : 1;
+                    memmove(w, src + j, n);
+                    w += n;
+                    j += n - 1;
+                }
+                else if (glob != NULL && t->quote != 0)
+                {
+                    *w++ = LSH_CTL_GLOB + (glob - LSH_GLOB_QUOTE);
+                }
+                else if (src[j] == '\\' && t->quote != '\'' && j + 1 < t->len)
+                {
+                    // As in sh, the backslash goes: outside quotes before any byte, in double quotes before
+                    // $ ` " and \ only. Escaped $, ` and pattern bytes are marked so expansion leaves them alone.
+                    glob = src[++j] != '\0' ? strchr(LSH_GLOB_QUOTE, src[j]) : NULL;
+                    if (src[j] == '$' || src[j] == '`')
+                    {
+                        *w++ = src[j] == '$' ? LSH_CTL_DOLLAR : LSH_CTL_TICK;
+                    }
+                    else if (glob != NULL)
+                    {
+                        if (t->quote != 0)
+                        {
+                            *w++ = '\\';
+                        }
+                        *w++ = LSH_CTL_GLOB + (glob - LSH_GLOB_QUOTE);
+                    }
+                    else
+                    {
+                        if (t->quote != 0 && src[j] != '"' && src[j] != '\\')
+                        {
+                            *w++ = '\\';
+                        }
+                        *w++ = src[j];
+                    }
+                }
+                else if (src[j] == '`' || (src[j] == '$' && j + 1 < t->len && src[j + 1] == '('))
+                {
+                    // A command substitution is kept as written, to be parsed when it runs; in quotes it is marked
+                    const char *q = src[j] == '`' ? lsh_lex_unescaped(src + j + 1, src + t->len, '`')
+                                                  : lsh_lex_subst(src + j + 2, src + t->len);
+                    size_t n = q != NULL ? (size_t)(q - src) + 1 - j : t->len - j;
+                    memmove(w, src + j, n);
+                    if (t->quote == '"')
+                    {
+                        *w = *w == '`' ? LSH_CTL_QTICK : LSH_CTL_QSUBST;
+                    }
+                    w += n;
+                    j += n - 1;
+                }
+                else
+                {
+                    *w++ = src[j];
+                }
+            }
+        }
+        *w = '\0';
+    }
+
+    tokens[position] = NULL;
+    return tokens;
+}
+
+/**********************************************************************  Here-documents: read the bodies a line asks for **********************************************************************/
+int lsh_read_heredocs(char **tokens, struct lsh_input *in)
+{
+    const char ctl[] = {LSH_CTL_DOLLAR, LSH_CTL_TICK};
+    int i, n = 0;
+
+    for (i = 0; tokens[i] != NULL; i++)
+    {
+        int kind = lsh_tok_kind(tokens[i]);
+        if ((kind != LSH_TOK_HEREDOC && kind != LSH_TOK_HEREDOC_STRIP) || tokens[i + 1] == NULL ||
+            lsh_tok_kind(tokens[i + 1]) != LSH_TOK_WORD)
+        {
+            continue;
+        }
+
+        // Any quoting in the delimiter keeps the body literal; the delimiter itself is matched without it
+        struct lsh_expand_buf body = {NULL, 0, 0};
+        char *delim = lsh_arena_alloc(&lsh_cmd_arena, strlen(tokens[i + 1]) + 1), *d = delim;
+        const char *s;
+        int quoted = 0;
+        for (s = tokens[i + 1]; *s; s++)
+        {
+            if (*s == '\'' || *s == '"' || *s == '\\')
+            {
+                quoted = 1;
+                if (*s != '\\' || s[1] == '\0')
+                {
+                    continue;
+                }
+                s++;
+            }
+            *d++ = *s;
+        }
+        *d = '\0';
+
+        // Body lines come from wherever the command line came from
+        lsh_expand_append(&body, "", 0);
+        while (1)
+        {
+            char *line, *l;
+            if (in == NULL)
+            {
+                printf("> ");
+                line = lsh_read_line("> ");
+            }
+            else
+            {
+                line = lsh_input_line(in);
+            }
+            if (line == NULL)
+            {
+                fprintf(stderr, "minishell: warning: here-document delimited by end of file (wanted `%s')\n", delim);
+                break;
+            }
+            for (l = line; kind == LSH_TOK_HEREDOC_STRIP && *l == '\t'; l++)
+            {
+            }
+            if (strcmp(l, delim) == 0)
+            {
+                if (in == NULL)
+                {
+                    free(line);
+                }
+                break;
+            }
+
+            // The body goes through expansion like a word, so a $ or ` that must stay literal is marked
+            for (s = l; *s; s++)
+            {
+                if ((*s == '$' || *s == '`') && quoted)
+                {
+                    lsh_expand_append(&body, &ctl[*s == '`'], 1);
+                }
+                else if (*s == '\\' && !quoted && (s[1] == '$' || s[1] == '`' || s[1] == '\\'))
+                {
+                    s++;
+                    lsh_expand_append(&body, *s == '\\' ? s : &ctl[*s == '`'], 1);
+                }
+                else
+                {
+                    size_t run = strcspn(s, quoted ? "$`" : "$`\\");
+                    lsh_expand_append(&body, s, run ? run : 1);
+                    s += (run ? run : 1) - 1;
+                }
+            }
+            lsh_expand_append(&body, "\n", 1);
+            if (in == NULL)
+            {
+                free(line);
+            }
+        }
+        tokens[i + 1] = body.buf;
+        n++;
+    }
+    return n;
+}
+
+/**********************************************************************  Parser: operator kind of a token **********************************************************************/
+int lsh_tok_kind(const char *tok)
+{
+    int k;
+
+    // Operators are the shared lsh_tok_text strings, so a quoted ";" or "|" stays a word
+    if ((uintptr_t)tok - (uintptr_t)&lsh_tok_strings >= sizeof(lsh_tok_strings))
+    {
+        return LSH_TOK_WORD;
+    }
+    for (k = 1; k < LSH_TOK_KINDS; k++)
+    {
+        if (tok == lsh_tok_text[k])
+        {
+            return k;
+        }
+    }
+    return LSH_TOK_WORD;
+}
+
+/**********************************************************************  Parser: does a token kind redirect **********************************************************************/
+int lsh_tok_redirect(int kind)
+{
+    // Every one of these takes the word after it
+    return (kind >= LSH_TOK_INPUT && kind <= LSH_TOK_APPEND) || (kind >= LSH_TOK_HEREDOC && kind <= LSH_TOK_APPENDERR);
+}
+
+/**********************************************************************  Parser: does a token close the current list **********************************************************************/
+int lsh_parse_closes(const char *tok, int closer)
+{
+    // ) is an operator; } is only a word that closes a group where a command could start
+    if (tok == NULL || closer == 0)
+    {
+        return 0;
+    }
+    return closer == LSH_TOK_RPAREN ? lsh_tok_kind(tok) == LSH_TOK_RPAREN : lsh_tok_kind(tok) == LSH_TOK_WORD && strcmp(tok, "}") == 0;
+}
+
+/**********************************************************************  Parser: allocate a node **********************************************************************/
+struct lsh_node *lsh_node_new(int type, struct lsh_node *left, struct lsh_node *right)
+{
+    struct lsh_node *node = lsh_arena_alloc(&lsh_cmd_arena, sizeof(struct lsh_node));
+
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+/**********************************************************************  Parser: report a syntax error at the current token **********************************************************************/
+struct lsh_node *lsh_parse_error(struct lsh_parser *p)
+{
+    if (!p->error)
+    {
+        const char *tok = p->tokens[p->pos];
+        if (!lsh_parse_quiet)
+        {
+            fprintf(stderr, "minishell: syntax error near unexpected token `%s'\n", tok ? tok : "newline");
+        }
+        p->error = 1;
+    }
+    return NULL;
+}
+
+/**********************************************************************  Parser: words and redirections up to the next operator **********************************************************************/
+char **lsh_parse_words(struct lsh_parser *p, int redirs_only)
+{
+    int start = p->pos, n;
+    int kind;
+
+    // Redirection operators take the following word as their target
+    while (p->tokens[p->pos] != NULL)
+    {
+        kind = lsh_tok_kind(p->tokens[p->pos]);
+        if (kind >= LSH_TOK_FD0)
+        {
+            // The lexer only makes a descriptor number in front of < or >; the redirection itself follows
+            p->pos++;
+            kind = lsh_tok_kind(p->tokens[p->pos]);
+        }
+        if (lsh_tok_redirect(kind))
+        {
+            if (p->tokens[p->pos + 1] == NULL || lsh_tok_kind(p->tokens[p->pos + 1]) != LSH_TOK_WORD)
+            {
+                p->pos++;
+                lsh_parse_error(p);
+                return NULL;
+            }
+            p->pos += 2;
+        }
+        else if (kind == LSH_TOK_WORD && !redirs_only)
+        {
+            p->pos++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // A copy, so the token array stays whole for job texts
+    n = p->pos - start;
+    char **args = lsh_arena_alloc(&lsh_cmd_arena, (n + 1) * sizeof(char *));
+    memcpy(args, &p->tokens[start], n * sizeof(char *));
+    args[n] = NULL;
+    return args;
+}
+
+/**********************************************************************  Parser: simple command, ( subshell ) or { group } **********************************************************************/
+struct lsh_node *lsh_parse_command(struct lsh_parser *p)
+{
+    struct lsh_node *node;
+    int start = p->pos;
+    const char *tok = p->tokens[p->pos];
+
+    if (tok != NULL && (lsh_tok_kind(tok) == LSH_TOK_LPAREN || strcmp(tok, "{") == 0))
+    {
+        // The body runs in a child for ( ) and in the shell itself for { }
+        int paren = lsh_tok_kind(tok) == LSH_TOK_LPAREN;
+        p->pos++;
+        struct lsh_node *body = lsh_parse_list(p, paren ? LSH_TOK_RPAREN : LSH_TOK_RBRACE);
+        if (body == NULL || !lsh_parse_closes(p->tokens[p->pos], paren ? LSH_TOK_RPAREN : LSH_TOK_RBRACE))
+        {
+            return lsh_parse_error(p);
+        }
+        p->pos++;
+        node = lsh_node_new(paren ? LSH_NODE_SUBSHELL : LSH_NODE_GROUP, body, NULL);
+        node->args = lsh_parse_words(p, 1);
+    }
+    else
+    {
+        node = lsh_node_new(LSH_NODE_COMMAND, NULL, NULL);
+        node->args = lsh_parse_words(p, 0);
+        if (node->args != NULL && p->pos == start)
+        {
+            return lsh_parse_error(p);
+        }
+    }
+    if (node->args == NULL)
+    {
+        return NULL;
+    }
+    node->words = &p->tokens[start];
+    node->nwords = p->pos - start;
+    return node;
+}
+
+/**********************************************************************  Parser: [time] command | command ... **********************************************************************/
+struct lsh_node *lsh_parse_pipeline(struct lsh_parser *p)
+{
+    struct lsh_node *node, *stage;
+    int start = p->pos, timed = 0, n = 0;
+    const char *tok = p->tokens[p->pos];
+
+    if (tok != NULL && strcmp(tok, "time") == 0)
+    {
+        timed = 1;
+        p->pos++;
+        tok = p->tokens[p->pos];
+        if (tok == NULL || lsh_tok_kind(tok) == LSH_TOK_SEMI || lsh_tok_kind(tok) == LSH_TOK_BACKGROUND ||
+            lsh_tok_kind(tok) == LSH_TOK_AND || lsh_tok_kind(tok) == LSH_TOK_OR || lsh_tok_kind(tok) == LSH_TOK_RPAREN)
+        {
+            // time on its own reports on the shell
+            node = lsh_node_new(LSH_NODE_PIPELINE, NULL, NULL);
+            node->timed = 1;
+            return node;
+        }
+    }
+    if ((stage = lsh_parse_command(p)) == NULL)
+    {
+        return NULL;
+    }
+    if (!timed && (p->tokens[p->pos] == NULL || lsh_tok_kind(p->tokens[p->pos]) != LSH_TOK_PIPE))
+    {
+        return stage;
+    }
+
+    // Stages go into an array, the way lsh_run_stages wants them
+    node = lsh_node_new(LSH_NODE_PIPELINE, NULL, NULL);
+    node->timed = timed;
+    int cap = 4;
+    node->stages = lsh_arena_alloc(&lsh_cmd_arena, cap * sizeof(struct lsh_node *));
+    node->stages[n++] = stage;
+    while (p->tokens[p->pos] != NULL && lsh_tok_kind(p->tokens[p->pos]) == LSH_TOK_PIPE)
+    {
+        p->pos++;
+        if ((stage = lsh_parse_command(p)) == NULL)
+        {
+            return NULL;
+        }
+        if (n == cap)
+        {
+            node->stages = lsh_arena_grow(&lsh_cmd_arena, node->stages, cap * sizeof(struct lsh_node *), 2 * cap * sizeof(struct lsh_node *));
+            cap *= 2;
+        }
+        node->stages[n++] = stage;
+    }
+    node->nstages = n;
+    node->words = &p->tokens[start];
+    node->nwords = p->pos - start;
+    return node;
+}
+
+/**********************************************************************  Parser: pipeline && pipeline || ... **********************************************************************/
+struct lsh_node *lsh_parse_and_or(struct lsh_parser *p)
+{
+    int start = p->pos;
+    struct lsh_node *node = lsh_parse_pipeline(p);
+
+    while (node != NULL && p->tokens[p->pos] != NULL)
+    {
+        int kind = lsh_tok_kind(p->tokens[p->pos]);
+        if (kind != LSH_TOK_AND && kind != LSH_TOK_OR)
+        {
+            break;
+        }
+        p->pos++;
+        struct lsh_node *right = lsh_parse_pipeline(p);
+        if (right == NULL)
+        {
+            return NULL;
+        }
+        node = lsh_node_new(kind == LSH_TOK_AND ? LSH_NODE_AND : LSH_NODE_OR, node, right);
+        node->words = &p->tokens[start];
+        node->nwords = p->pos - start;
+    }
+    return node;
+}
+
+/**********************************************************************  Parser: and-or lists separated by ; and & **********************************************************************/
+struct lsh_node *lsh_parse_list(struct lsh_parser *p, int closer)
+{
+    struct lsh_node *list = NULL, *item;
+    const char *tok;
+
+    // Up to the end of the line, or the ) or } that closes a subshell or group
+    while ((tok = p->tokens[p->pos]) != NULL && !lsh_parse_closes(tok, closer))
+    {
+        if ((item = lsh_parse_and_or(p)) == NULL)
+        {
+            return lsh_parse_error(p);
+        }
+        tok = p->tokens[p->pos];
+        if (tok != NULL && (lsh_tok_kind(tok) == LSH_TOK_SEMI || lsh_tok_kind(tok) == LSH_TOK_BACKGROUND))
+        {
+            item->background = lsh_tok_kind(tok) == LSH_TOK_BACKGROUND;
+            p->pos++;
+        }
+        else if (tok != NULL && !lsh_parse_closes(tok, closer))
+        {
+            return lsh_parse_error(p);
+        }
+        list = list ? lsh_node_new(LSH_NODE_LIST, list, item) : item;
+    }
+    return list;
+}
+
+/**********************************************************************  Parser: build the tree of a whole line **********************************************************************/
+struct lsh_node *lsh_parse(char **tokens, int *error)
+{
+    struct lsh_parser p = {tokens, 0, 0};
+    struct lsh_node *node = lsh_parse_list(&p, 0);
+
+    // Anything left over is a stray ) or }
+    if (!p.error && p.tokens[p.pos] != NULL)
+    {
+        lsh_parse_error(&p);
+    }
+    *error = p.error;
+    return p.error ? NULL : node;
+}
+
+/**********************************************************************  Script cache: append to a table being built **********************************************************************/
+size_t lsh_cache_put(struct lsh_cache_buf *b, const void *data, size_t n)
+{
+    size_t off = b->len;
+
+    if (n == 0)
+    {
+        return off;
+    }
+    if (b->len + n > b->cap)
+    {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (b->len + n > cap)
+        {
+            cap *= 2;
+        }
+        b->data = realloc(b->data, cap);
+        if (!b->data)
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        b->cap = cap;
+    }
+    memcpy(b->data + off, data, n);
+    b->len += n;
+    return off;
+}
+
+/**********************************************************************  Script cache: offset of a string, storing it on first use **********************************************************************/
+uint32_t lsh_cache_string(struct lsh_cache_build *b, const char *s)
+{
+    size_t i, mask;
+
+    // Keep the set at most half full
+    if (2 * (b->str_count + 1) > b->str_cap)
+    {
+        size_t cap = b->str_cap ? 2 * b->str_cap : 1024;
+        uint32_t *slots = calloc(cap, sizeof(uint32_t));
+        if (!slots)
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < b->str_cap; i++)
+        {
+            if (b->str_slots[i] != 0)
+            {
+                size_t j = lsh_hash_string(b->strings.data + b->str_slots[i] - 1) & (cap - 1);
+                while (slots[j] != 0)
+                {
+                    j = (j + 1) & (cap - 1);
+                }
+                slots[j] = b->str_slots[i];
+            }
+        }
+        free(b->str_slots);
+        b->str_slots = slots;
+        b->str_cap = cap;
+    }
+
+    mask = b->str_cap - 1;
+    for (i = lsh_hash_string(s) & mask; b->str_slots[i] != 0; i = (i + 1) & mask)
+    {
+        if (strcmp(b->strings.data + b->str_slots[i] - 1, s) == 0)
+        {
+            return b->str_slots[i] - 1;
+        }
+    }
+    uint32_t off = lsh_cache_put(&b->strings, s, strlen(s) + 1);
+    b->str_slots[i] = off + 1;
+    b->str_count++;
+    return off;
+}
+
+/**********************************************************************  Script cache: flatten a node and its children **********************************************************************/
+uint16_t lsh_cache_put_node(struct lsh_cache_build *b, struct lsh_node *node, char **tokens, struct lsh_cache_line *l)
+{
+    struct lsh_cache_node c;
+    size_t index = b->nodes.len / sizeof(c) - l->nodes;
+    int i, n;
+
+    // The slot is taken first so children always get higher indices than their parent
+    memset(&c, 0, sizeof(c));
+    lsh_cache_put(&b->nodes, &c, sizeof(c));
+    if (index >= LSH_CACHE_NIL)
+    {
+        b->failed = 1;
+        return 0;
+    }
+    c.type = node->type;
+    c.background = node->background;
+    c.timed = node->timed;
+    c.left = node->left != NULL ? lsh_cache_put_node(b, node->left, tokens, l) : LSH_CACHE_NIL;
+    c.right = node->right != NULL ? lsh_cache_put_node(b, node->right, tokens, l) : LSH_CACHE_NIL;
+
+    // Stage indices are only known once the stages are flattened, so they are collected first
+    uint16_t *stages = lsh_arena_alloc(&lsh_cmd_arena, (node->nstages + 1) * sizeof(uint16_t));
+    for (i = 0; i < node->nstages; i++)
+    {
+        stages[i] = lsh_cache_put_node(b, node->stages[i], tokens, l);
+    }
+    size_t first = b->stages.len / sizeof(uint16_t) - l->stages;
+    b->failed |= first + node->nstages >= LSH_CACHE_NIL;
+    c.stages = first;
+    c.nstages = node->nstages;
+    lsh_cache_put(&b->stages, stages, node->nstages * sizeof(uint16_t));
+
+    // Job text and argv are both runs of the line's tokens; argv is found inside the job text
+    c.words = node->words != NULL ? node->words - tokens : LSH_CACHE_NIL;
+    c.nwords = node->nwords;
+    c.args = LSH_CACHE_NIL;
+    if (node->args != NULL)
+    {
+        for (n = 0; node->args[n] != NULL; n++)
+        {
+        }
+        for (i = 0; node->words != NULL && i + n <= node->nwords; i++)
+        {
+            if (memcmp(&node->words[i], node->args, n * sizeof(char *)) == 0)
+            {
+                c.args = c.words + i;
+                break;
+            }
+        }
+        c.nargs = n;
+        b->failed |= c.args == LSH_CACHE_NIL;
+    }
+    memcpy(b->nodes.data + (l->nodes + index) * sizeof(c), &c, sizeof(c));
+    return index;
+}
+
+/**********************************************************************  Script cache: compile every line of a script **********************************************************************/
+char *lsh_cache_compile(struct lsh_input *in, const char *path, struct stat *st, size_t *size)
+{
+    struct lsh_cache_build b;
+    struct lsh_cache_header hdr;
+    char *line;
+    int i, error;
+
+    memset(&b, 0, sizeof(b));
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LSH_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = LSH_CACHE_VERSION;
+    hdr.src_size = st->st_size;
+    hdr.src_mtime = st->st_mtim.tv_sec;
+    hdr.src_mtime_ns = st->st_mtim.tv_nsec;
+    hdr.path = lsh_cache_string(&b, path);
+
+    // Syntax errors are reported when their line runs, as without the cache
+    lsh_parse_quiet = 1;
+    while ((line = lsh_input_line(in)) != NULL)
+    {
+        struct lsh_cache_line l = {0, 0, 0, LSH_CACHE_NONE, 0, 0, 0, LSH_CACHE_NIL};
+        char **tokens = lsh_split_line(line);
+        int heredocs = lsh_read_heredocs(tokens, in);
+        struct lsh_node *node = lsh_parse(tokens, &error);
+
+        l.nodes = b.nodes.len / sizeof(struct lsh_cache_node);
+        l.tokens = b.tokens.len / sizeof(uint32_t);
+        l.stages = b.stages.len / sizeof(uint16_t);
+        for (i = 0; !error && tokens[i] != NULL; i++)
+        {
+            int kind = lsh_tok_kind(tokens[i]);
+            uint32_t t = kind != LSH_TOK_WORD ? LSH_CACHE_OP | kind : lsh_cache_string(&b, tokens[i]);
+            lsh_cache_put(&b.tokens, &t, sizeof(t));
+        }
+        if (!error && i < LSH_CACHE_NIL)
+        {
+            b.failed = 0;
+            l.ntokens = i;
+            l.root = node != NULL ? lsh_cache_put_node(&b, node, tokens, &l) : LSH_CACHE_NIL;
+            l.nnodes = b.nodes.len / sizeof(struct lsh_cache_node) - l.nodes;
+            l.nstages = b.stages.len / sizeof(uint16_t) - l.stages;
+            error = b.failed;
+        }
+        else
+        {
+            error = 1;
+        }
+        if (error && heredocs)
+        {
+            // Its body lines are gone from the input, so the text alone could not run it; run the script as is
+            break;
+        }
+        if (error)
+        {
+            // Kept as text and parsed when it runs, so a syntax error shows up in its place
+            b.nodes.len = l.nodes * sizeof(struct lsh_cache_node);
+            b.tokens.len = l.tokens * sizeof(uint32_t);
+            b.stages.len = l.stages * sizeof(uint16_t);
+            l.root = LSH_CACHE_NIL;
+            l.nnodes = l.ntokens = l.nstages = 0;
+            l.text = lsh_cache_string(&b, line);
+        }
+        lsh_cache_put(&b.lines, &l, sizeof(l));
+        lsh_arena_reset(&lsh_cmd_arena);
+    }
+    lsh_parse_quiet = 0;
+
+    // One image: the header and the tables back to back; none when a line stopped the compile
+    struct lsh_cache_buf image = {NULL, 0, 0};
+    if (line == NULL)
+    {
+        hdr.nlines = b.lines.len / sizeof(struct lsh_cache_line);
+        hdr.nnodes = b.nodes.len / sizeof(struct lsh_cache_node);
+        hdr.ntokens = b.tokens.len / sizeof(uint32_t);
+        hdr.nstages = b.stages.len / sizeof(uint16_t);
+        hdr.strings_len = b.strings.len;
+        lsh_cache_put(&image, &hdr, sizeof(hdr));
+        lsh_cache_put(&image, b.lines.data, b.lines.len);
+        lsh_cache_put(&image, b.tokens.data, b.tokens.len);
+        lsh_cache_put(&image, b.nodes.data, b.nodes.len);
+        lsh_cache_put(&image, b.stages.data, b.stages.len);
+        lsh_cache_put(&image, b.strings.data, b.strings.len);
+    }
+
+    free(b.lines.data);
+    free(b.nodes.data);
+    free(b.tokens.data);
+    free(b.stages.data);
+    free(b.strings.data);
+    free(b.str_slots);
+    *size = image.len;
+    return image.data;
+}
+
+/**********************************************************************  Script cache: check an image before trusting it **********************************************************************/
+int lsh_cache_load(struct lsh_cache *c, char *image, size_t size, const char *path, struct stat *st)
+{
+    struct lsh_cache_header *hdr = (struct lsh_cache_header *)image;
+    uint32_t i, j;
+
+    // Stale or foreign files are just compiled again
+    if (size < sizeof(*hdr) || memcmp(hdr->magic, LSH_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != LSH_CACHE_VERSION || hdr->src_size != (uint64_t)st->st_size ||
+        hdr->src_mtime != st->st_mtim.tv_sec || hdr->src_mtime_ns != st->st_mtim.tv_nsec)
+    {
+        return -1;
+    }
+    if (size != sizeof(*hdr) + (size_t)hdr->nlines * sizeof(struct lsh_cache_line) + (size_t)hdr->ntokens * sizeof(uint32_t) +
+                    (size_t)hdr->nnodes * sizeof(struct lsh_cache_node) + (size_t)hdr->nstages * sizeof(uint16_t) + hdr->strings_len)
+    {
+        return -1;
+    }
+    c->image = image;
+    c->size = size;
+    c->hdr = hdr;
+    c->lines = (struct lsh_cache_line *)(hdr + 1);
+    c->tokens = (uint32_t *)(c->lines + hdr->nlines);
+    c->nodes = (struct lsh_cache_node *)(c->tokens + hdr->ntokens);
+    c->stages = (uint16_t *)(c->nodes + hdr->nnodes);
+    c->strings = (char *)(c->stages + hdr->nstages);
+    if (hdr->strings_len == 0 || c->strings[hdr->strings_len - 1] != '\0' || hdr->path >= hdr->strings_len ||
+        strcmp(c->strings + hdr->path, path) != 0)
+    {
+        return -1;
+    }
+
+    // Every index is checked once here, so running a line needs no checks at all
+    for (i = 0; i < hdr->ntokens; i++)
+    {
+        uint32_t t = c->tokens[i];
+        if ((t & LSH_CACHE_OP) ? (t & ~LSH_CACHE_OP) == LSH_TOK_WORD || (t & ~LSH_CACHE_OP) >= LSH_TOK_KINDS : t >= hdr->strings_len)
+        {
+            return -1;
+        }
+    }
+    for (i = 0; i < hdr->nlines; i++)
+    {
+        struct lsh_cache_line *l = &c->lines[i];
+
+        if ((uint64_t)l->nodes + l->nnodes > hdr->nnodes || (uint64_t)l->tokens + l->ntokens > hdr->ntokens ||
+            (uint64_t)l->stages + l->nstages > hdr->nstages || (l->text != LSH_CACHE_NONE && l->text >= hdr->strings_len) ||
+            (l->root != LSH_CACHE_NIL && l->root >= l->nnodes))
+        {
+            return -1;
+        }
+        for (j = 0; j < l->nnodes; j++)
+        {
+            struct lsh_cache_node *n = &c->nodes[l->nodes + j];
+            uint32_t k;
+
+            // Children come after their parent and stay inside the line, so the tree has no cycles
+            if ((n->left != LSH_CACHE_NIL && (n->left <= j || n->left >= l->nnodes)) ||
+                (n->right != LSH_CACHE_NIL && (n->right <= j || n->right >= l->nnodes)) ||
+                (n->args != LSH_CACHE_NIL && n->args + n->nargs > l->ntokens) ||
+                (n->words != LSH_CACHE_NIL && n->words + n->nwords > l->ntokens) ||
+                (n->words == LSH_CACHE_NIL && n->nwords != 0) || n->stages + n->nstages > l->nstages)
+            {
+                return -1;
+            }
+
+            // Each type has the parts the evaluator relies on
+            if (n->type > LSH_NODE_GROUP || (n->type == LSH_NODE_COMMAND && n->args == LSH_CACHE_NIL) ||
+                (n->type == LSH_NODE_PIPELINE && n->nstages == 0 && !n->timed) ||
+                ((n->type == LSH_NODE_AND || n->type == LSH_NODE_OR || n->type == LSH_NODE_LIST) &&
+                 (n->left == LSH_CACHE_NIL || n->right == LSH_CACHE_NIL)) ||
+                ((n->type == LSH_NODE_SUBSHELL || n->type == LSH_NODE_GROUP) && (n->left == LSH_CACHE_NIL || n->args == LSH_CACHE_NIL)))
+            {
+                return -1;
+            }
+            for (k = 0; k < n->nstages; k++)
+            {
+                uint16_t stage = c->stages[l->stages + n->stages + k];
+                if (stage <= j || stage >= l->nnodes)
+                {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************  Script cache: file a script compiles to **********************************************************************/
+char *lsh_cache_file(const char *path)
+{
+    const char *dir = lsh_var_get("MINISHELL_CACHE_DIR"), *base;
+    char buf[PATH_MAX], *name;
+
+    // $MINISHELL_CACHE_DIR, else $XDG_CACHE_HOME/minishell, else ~/.cache/minishell
+    if (dir == NULL || dir[0] == '\0')
+    {
+        if ((base = lsh_var_get("XDG_CACHE_HOME")) != NULL && base[0] != '\0')
+        {
+            snprintf(buf, sizeof(buf), "%s/minishell", base);
+        }
+        else if ((base = lsh_var_get("HOME")) != NULL && base[0] != '\0')
+        {
+            snprintf(buf, sizeof(buf), "%s/.cache", base);
+            mkdir(buf, 0700);
+            snprintf(buf, sizeof(buf), "%s/.cache/minishell", base);
+        }
+        else
+        {
+            return NULL;
+        }
+        mkdir(buf, 0700);
+        dir = buf;
+    }
+
+    // Named after a hash of the path; the path itself is in the header, so a collision only means a recompile
+    name = malloc(strlen(dir) + 32);
+    if (!name)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(name, "%s/%08x.lshc", dir, lsh_hash_string(path));
+    return name;
+}
+
+/**********************************************************************  Script cache: write a compiled image **********************************************************************/
+void lsh_cache_write(const char *file, const char *image, size_t size)
+{
+    char tmp[PATH_MAX + 32];
+    int fd;
+
+    // A temporary name and rename, so a concurrent run never maps a half-written file
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        return;
+    }
+    if (lsh_write_all(fd, image, size) == -1 || close(fd) == -1 || rename(tmp, file) == -1)
+    {
+        unlink(tmp);
+    }
+}
+
+/**********************************************************************  Script cache: open the compiled form of a script **********************************************************************/
+int lsh_cache_open(struct lsh_cache *c, const char *script)
+{
+    struct lsh_input in;
+    struct stat st, cst;
+    char *path = realpath(script, NULL);
+    int fd, ret = -1;
+
+    memset(c, 0, sizeof(*c));
+    if (path == NULL || stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        free(path);
+        return -1;
+    }
+    char *file = lsh_cache_file(path);
+
+    // Up to date: map it and run
+    if (file != NULL && (fd = open(file, O_RDONLY | O_CLOEXEC)) != -1)
+    {
+        if (fstat(fd, &cst) == 0 && cst.st_size > 0)
+        {
+            // Private and writable like a mapped script, so argument strings can be used in place
+            void *map = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                c->mapped = 1;
+                if ((ret = lsh_cache_load(c, map, cst.st_size, path, &st)) == -1)
+                {
+                    munmap(map, cst.st_size);
+                    c->mapped = 0;
+                }
+            }
+        }
+        close(fd);
+    }
+
+    // Missing or stale: compile from the script, save it for next time and run from memory
+    if (ret == -1 && lsh_input_file(&in, path) == 0)
+    {
+        size_t size;
+        char *image = lsh_cache_compile(&in, path, &st, &size);
+        lsh_input_close(&in);
+        if (image != NULL && file != NULL)
+        {
+            lsh_cache_write(file, image, size);
+        }
+        if (image != NULL && (ret = lsh_cache_load(c, image, size, path, &st)) == -1)
+        {
+            free(image);
+        }
+    }
+    lsh_arena_reset(&lsh_cmd_arena);
+    free(file);
+    free(path);
+    return ret;
+}
+
+/**********************************************************************  Script cache: release a compiled script **********************************************************************/
+void lsh_cache_close(struct lsh_cache *c)
+{
+    if (c->mapped)
+    {
+        munmap(c->image, c->size);
+    }
+    else
+    {
+        free(c->image);
+    }
+    memset(c, 0, sizeof(*c));
+}
+
+/**********************************************************************  Script cache: rebuild the tree of one line in the command arena **********************************************************************/
+struct lsh_node *lsh_cache_thaw(struct lsh_cache *c, struct lsh_cache_line *l)
+{
+    uint32_t i, j;
+
+    if (l->root == LSH_CACHE_NIL)
+    {
+        return NULL;
+    }
+
+    // Strings are used from the image as they are; operators become the shared token strings again
+    char **tokens = lsh_arena_alloc(&lsh_cmd_arena, (l->ntokens + 1) * sizeof(char *));
+    for (i = 0; i < l->ntokens; i++)
+    {
+        uint32_t t = c->tokens[l->tokens + i];
+        tokens[i] = t & LSH_CACHE_OP ? (char *)lsh_tok_text[t & ~LSH_CACHE_OP] : c->strings + t;
+    }
+    tokens[l->ntokens] = NULL;
+
+    // argv arrays get their own copy: redirections are stripped out of them in place
+    struct lsh_node *nodes = lsh_arena_alloc(&lsh_cmd_arena, l->nnodes * sizeof(struct lsh_node));
+    uint16_t *stages = c->stages + l->stages;
+    for (i = 0; i < l->nnodes; i++)
+    {
+        struct lsh_cache_node *cn = &c->nodes[l->nodes + i];
+        struct lsh_node *n = &nodes[i];
+
+        n->type = cn->type;
+        n->background = cn->background;
+        n->timed = cn->timed;
+        n->left = cn->left != LSH_CACHE_NIL ? &nodes[cn->left] : NULL;
+        n->right = cn->right != LSH_CACHE_NIL ? &nodes[cn->right] : NULL;
+        n->args = NULL;
+        if (cn->args != LSH_CACHE_NIL)
+        {
+            n->args = lsh_arena_alloc(&lsh_cmd_arena, (cn->nargs + 1) * sizeof(char *));
+            memcpy(n->args, &tokens[cn->args], cn->nargs * sizeof(char *));
+            n->args[cn->nargs] = NULL;
+        }
+        n->words = cn->words != LSH_CACHE_NIL ? &tokens[cn->words] : NULL;
+        n->nwords = cn->nwords;
+        n->nstages = cn->nstages;
+        n->stages = NULL;
+        if (cn->nstages > 0)
+        {
+            n->stages = lsh_arena_alloc(&lsh_cmd_arena, cn->nstages * sizeof(struct lsh_node *));
+            for (j = 0; j < cn->nstages; j++)
+            {
+                n->stages[j] = &nodes[stages[cn->stages + j]];
+            }
+        }
+    }
+    return &nodes[l->root];
+}
+
+/**********************************************************************  Script cache: run a compiled script **********************************************************************/
+void lsh_cache_loop(struct lsh_cache *c)
+{
+    uint32_t i;
+    int status = 1;
+
+    for (i = 0; i < c->hdr->nlines && status; i++)
+    {
+        struct lsh_cache_line *l = &c->lines[i];
+        struct timespec t0, t1;
+
+        // Collect finished background jobs before the next command
+        lsh_notify_jobs();
+
+        // Lines that did not parse go the long way, which reports their error
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (l->text != LSH_CACHE_NONE)
+        {
+            char **args = lsh_split_line(c->strings + l->text);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            lsh_parse_ns = lsh_elapsed_ns(&t0, &t1);
+            status = lsh_execute(args);
+        }
+        else
+        {
+            struct lsh_node *node = lsh_cache_thaw(c, l);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            lsh_parse_ns = lsh_elapsed_ns(&t0, &t1);
+            status = node != NULL ? lsh_exec_node(node) : 1;
+        }
+        lsh_cmd_count++;
+        lsh_arena_reset(&lsh_cmd_arena);
+    }
+}
+
+/**********************************************************************  Parse redirections **********************************************************************/
+int lsh_parse_redirections(char **args, struct lsh_redir **redirs)
+{
+    int i, j = 0, n = 0;
+
+    *redirs = NULL;
+    for (i = 0; args[i] != NULL; i++)
+    {
+        int kind = lsh_tok_kind(args[i]), fd = -1, type = LSH_REDIR_FILE, flags = 0, dup = -1;
+        const char *path;
+
+        // 2>file: the descriptor number comes first
+        if (kind >= LSH_TOK_FD0 && args[i + 1] != NULL && lsh_tok_redirect(lsh_tok_kind(args[i + 1])))
+        {
+            fd = kind - LSH_TOK_FD0;
+            kind = lsh_tok_kind(args[++i]);
+        }
+        if (!lsh_tok_redirect(kind))
+        {
+            // Ordinary argument, keep it
+            args[j++] = args[i];
+            continue;
+        }
+
+        if (args[i + 1] == NULL)
+        {
+            fprintf(stderr, "minishell: expected file after %s\n", args[i]);
+            *redirs = NULL;
+            return -1;
+        }
+        path = args[++i];
+
+        switch (kind)
+        {
+        case LSH_TOK_INPUT:
+            flags = O_RDONLY;
+            break;
+        case LSH_TOK_OUTPUT:
+        case LSH_TOK_OUTERR:
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+            break;
+        case LSH_TOK_APPEND:
+        case LSH_TOK_APPENDERR:
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+            break;
+        case LSH_TOK_HEREDOC:
+        case LSH_TOK_HEREDOC_STRIP:
+            type = LSH_REDIR_DATA;
+            break;
+        case LSH_TOK_HERESTRING:
+        {
+            // A here-string is its word and a newline
+            size_t len = strlen(path);
+            char *data = lsh_arena_alloc(&lsh_cmd_arena, len + 2);
+            memcpy(data, path, len);
+            memcpy(data + len, "\n", 2);
+            path = data;
+            type = LSH_REDIR_DATA;
+            break;
+        }
+        default:
+        {
+            // <&N and >&N copy a descriptor, <&- and >&- close one; >&file on its own is &>file
+            char *end;
+            long src = strtol(path, &end, 10);
+            if (strcmp(path, "-") == 0)
+            {
+                type = LSH_REDIR_CLOSE;
+            }
+            else if (*path >= '0' && *path <= '9' && *end == '\0' && src <= INT_MAX)
+            {
+                type = LSH_REDIR_DUP;
+                dup = src;
+            }
+            else if (kind == LSH_TOK_DUPOUT && fd == -1)
+            {
+                kind = LSH_TOK_OUTERR;
+                flags = O_WRONLY | O_CREAT | O_TRUNC;
+            }
+            else
+            {
+                fprintf(stderr, "minishell: %s: ambiguous redirect\n", path);
+                *redirs = NULL;
+                return -1;
+            }
+        }
+        }
+        if (fd == -1)
+        {
+            fd = kind == LSH_TOK_INPUT || kind == LSH_TOK_DUPIN || kind == LSH_TOK_HEREDOC || kind == LSH_TOK_HEREDOC_STRIP ||
+                         kind == LSH_TOK_HERESTRING
+                     ? STDIN_FILENO
+                     : STDOUT_FILENO;
+        }
+
+        // &>file is >file 2>&1
+        int count = kind == LSH_TOK_OUTERR || kind == LSH_TOK_APPENDERR ? 2 : 1;
+        *redirs = lsh_arena_grow(&lsh_cmd_arena, *redirs, n * sizeof(struct lsh_redir), (n + count) * sizeof(struct lsh_redir));
+        (*redirs)[n++] = (struct lsh_redir){fd, type, flags, path, -1, dup};
+        if (count == 2)
+        {
+            (*redirs)[n++] = (struct lsh_redir){STDERR_FILENO, LSH_REDIR_DUP, 0, NULL, -1, STDOUT_FILENO};
+        }
+    }
+
+    // Redirection tokens are removed, the remaining arguments stay in order
+    args[j] = NULL;
+    return n;
+}
+
+/**********************************************************************  Put here-document text behind a descriptor **********************************************************************/
+int lsh_redir_data(const char *data)
+{
+    size_t len = strlen(data);
+    int fds[2];
+
+    // Small bodies fit in an empty pipe, so the write cannot block; bigger ones go to an in-memory file
+    if (len <= LSH_HEREDOC_PIPE)
+    {
+        if (pipe2(fds, O_CLOEXEC) == -1)
+        {
+            return -1;
+        }
+        if (lsh_write_all(fds[1], data, len) == -1)
+        {
+            close(fds[0]);
+            fds[0] = -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+    fds[0] = memfd_create("heredoc", MFD_CLOEXEC);
+    if (fds[0] != -1 && (lsh_write_all(fds[0], data, len) == -1 || lseek(fds[0], 0, SEEK_SET) == -1))
+    {
+        close(fds[0]);
+        fds[0] = -1;
+    }
+    return fds[0];
+}
+
+/**********************************************************************  Open redirection targets **********************************************************************/
+int lsh_open_redirections(struct lsh_redir *redirs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (redirs[i].type == LSH_REDIR_DATA)
+        {
+            if ((redirs[i].src = lsh_redir_data(redirs[i].path)) == -1)
+            {
+                fprintf(stderr, "minishell: cannot make here-document: %s\n", strerror(errno));
+                lsh_close_redirections(redirs, i);
+                return -1;
+            }
+        }
+        else if (redirs[i].type == LSH_REDIR_FILE)
+        {
+            redirs[i].src = open(redirs[i].path, redirs[i].flags | O_CLOEXEC, 0666);
+            if (redirs[i].src == -1)
+            {
+                fprintf(stderr, "minishell: cannot open %s for %s: %s\n", redirs[i].path,
+                        redirs[i].flags & O_APPEND ? "appending" : redirs[i].flags & O_WRONLY ? "writing" : "reading",
+                        strerror(errno));
+                lsh_close_redirections(redirs, i);
+                return -1;
+            }
+        }
+
+        // Opened descriptors move above the ones a script can name, so putting one in place never overwrites another
+        redirs[i].src = lsh_fd_high(redirs[i].src);
+    }
+    return 0;
+}
+
+/**********************************************************************  Close opened redirection targets **********************************************************************/
+void lsh_close_redirections(struct lsh_redir *redirs, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        if (redirs[i].src != -1)
+        {
+            close(redirs[i].src);
+            redirs[i].src = -1;
+        }
+    }
+}
+
+/**********************************************************************  Point descriptors at their opened targets **********************************************************************/
+int lsh_apply_redirections(struct lsh_redir *redirs, int n)
+{
+    int i;
+
+    // Left to right, so 2>&1 >file and >file 2>&1 differ the way they should
+    for (i = 0; i < n; i++)
+    {
+        if (redirs[i].type == LSH_REDIR_CLOSE)
+        {
+            close(redirs[i].fd);
+        }
+        else if (redirs[i].type == LSH_REDIR_DUP)
+        {
+            // 1>&1 changes nothing but still needs an open descriptor
+            int ret = redirs[i].dup == redirs[i].fd ? fcntl(redirs[i].fd, F_GETFD) : dup2(redirs[i].dup, redirs[i].fd);
+            if (ret == -1)
+            {
+                fprintf(stderr, "minishell: %d: %s\n", redirs[i].dup, strerror(errno));
+                return -1;
+            }
+        }
+        else if (dup2(redirs[i].src, redirs[i].fd) == -1)
+        {
+            fprintf(stderr, "minishell: failed to redirect %s: %s\n",
+                    redirs[i].fd == STDIN_FILENO ? "input" : "output", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************  Handle redirection **********************************************************************/
+int handle_redirection(char **args)
+{
+    struct lsh_redir *redirs;
+    int n = lsh_parse_redirections(args, &redirs);
+    int ret = n;
+
+    if (n > 0)
+    {
+        ret = lsh_open_redirections(redirs, n);
+        if (ret == 0)
+        {
+            ret = lsh_apply_redirections(redirs, n);
+            lsh_close_redirections(redirs, n);
+        }
+    }
+    return ret;
+}
+
+/**********************************************************************  Hash a built-in name for the dispatch table **********************************************************************/
+unsigned int lsh_builtin_hash(const char *name, unsigned int seed)
+{
+    unsigned int h = seed;
+    while (*name)
+    {
+        h = (h ^ (unsigned char)*name++) * 0x01000193u;
+    }
+    return (h ^ (h >> 15)) & (LSH_BUILTIN_SLOTS - 1);
+}
+
+/**********************************************************************  Build the perfect hash table of built-ins **********************************************************************/
+void lsh_init_builtins(void)
+{
+    unsigned int seed;
+    int i;
+
+    // Try seeds until every built-in name lands in its own slot; one probe per lookup after that
+    for (seed = 1;; seed++)
+    {
+        memset(lsh_builtin_slot, -1, sizeof(lsh_builtin_slot));
+        for (i = 0; i < lsh_num_builtins(); i++)
+        {
+            unsigned int slot = lsh_builtin_hash(builtin_str[i], seed);
+            if (lsh_builtin_slot[slot] != -1)
+            {
+                break;
+            }
+            lsh_builtin_slot[slot] = i;
+        }
+        if (i == lsh_num_builtins())
+        {
+            lsh_builtin_seed = seed;
+            return;
+        }
+    }
+}
+
+/**********************************************************************  Find a built-in command by name **********************************************************************/
+int lsh_find_builtin(const char *name)
+{
+    if (lsh_builtin_seed == 0)
+    {
+        lsh_init_builtins();
+    }
+    int i = lsh_builtin_slot[lsh_builtin_hash(name, lsh_builtin_seed)];
+    return i != -1 && strcmp(name, builtin_str[i]) == 0 ? i : -1;
+}
+
+/**********************************************************************  Convert a wait status into a shell exit status **********************************************************************/
+int lsh_exit_status(int status)
+{
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+/**********************************************************************  Variables: hash of a name of given length **********************************************************************/
+unsigned int lsh_var_hash(const char *name, size_t len)
+{
+    // FNV-1a, as lsh_hash_string, over a name that need not be NUL-terminated
+    unsigned int h = 2166136261u;
+    while (len-- > 0)
+    {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+/**********************************************************************  Variables: load the environment the shell started with **********************************************************************/
+void lsh_vars_init(void)
+{
+    int i;
+
+    lsh_vars_ready = 1;
+    lsh_shell_pid = getpid();
+    for (i = 0; environ[i] != NULL; i++)
+    {
+        const char *eq = strchr(environ[i], '=');
+        if (eq != NULL && eq > environ[i])
+        {
+            lsh_var_set(environ[i], eq - environ[i], eq + 1, 1);
+        }
+    }
+
+    // An inherited $PWD is kept only if it still names the directory the shell starts in
+    const char *pwd = lsh_var_get("PWD");
+    struct stat here, there;
+    if (pwd == NULL || pwd[0] != '/' || stat(".", &here) == -1 || stat(pwd, &there) == -1 ||
+        here.st_dev != there.st_dev || here.st_ino != there.st_ino)
+    {
+        lsh_pwd_update(0);
+    }
+}
+
+/**********************************************************************  Variables: $PWD follows the current directory **********************************************************************/
+void lsh_pwd_update(int moved)
+{
+    char *cwd = getcwd(NULL, 0);
+    const char *old = lsh_var_get("PWD");
+
+    // Exported, so commands see where they run; the old value is copied before PWD replaces it
+    if (cwd == NULL)
+    {
+        return;
+    }
+    if (moved && old != NULL)
+    {
+        lsh_var_set("OLDPWD", 6, old, 1);
+    }
+    lsh_var_set("PWD", 3, cwd, 1);
+    free(cwd);
+}
+
+/**********************************************************************  Variables: look up a name **********************************************************************/
+struct lsh_var *lsh_var_find(const char *name, size_t len)
+{
+    struct lsh_var *v;
+
+    if (!lsh_vars_ready)
+    {
+        lsh_vars_init();
+    }
+    for (v = lsh_vars[lsh_var_hash(name, len) % LSH_VAR_BUCKETS]; v != NULL; v = v->next)
+    {
+        if (v->name_len == len && memcmp(v->entry, name, len) == 0)
+        {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+/**********************************************************************  Variables: value of a variable, or NULL **********************************************************************/
+const char *lsh_var_get(const char *name)
+{
+    size_t len = strlen(name);
+    struct lsh_var *v = lsh_var_find(name, len);
+    return v != NULL ? v->entry + len + 1 : NULL;
+}
+
+/**********************************************************************  Variables: set a value (export 1 exports, 0 keeps the current flag) **********************************************************************/
+void lsh_var_set(const char *name, size_t len, const char *value, int export)
+{
+    struct lsh_var *v = lsh_var_find(name, len);
+    size_t value_len = strlen(value);
+    char *entry = malloc(len + value_len + 2);
+
+    if (!entry)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    // One "NAME=value" string serves both the shell and the envp of commands
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, value_len + 1);
+
+    if (v == NULL)
+    {
+        unsigned int bucket = lsh_var_hash(name, len) % LSH_VAR_BUCKETS;
+        v = calloc(1, sizeof(struct lsh_var));
+        if (!v)
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        v->name_len = len;
+        v->next = lsh_vars[bucket];
+        lsh_vars[bucket] = v;
+    }
+    else
+    {
+        free(v->entry);
+    }
+    v->entry = entry;
+    v->exported |= export;
+
+    // Only a change to an exported variable touches the environment of commands
+    if (v->exported)
+    {
+        lsh_env_dirty = 1;
+    }
+}
+
+/**********************************************************************  Variables: remove a variable **********************************************************************/
+void lsh_var_unset(const char *name)
+{
+    size_t len = strlen(name);
+    struct lsh_var **link = &lsh_vars[lsh_var_hash(name, len) % LSH_VAR_BUCKETS];
+
+    if (!lsh_vars_ready)
+    {
+        lsh_vars_init();
+    }
+    for (; *link != NULL; link = &(*link)->next)
+    {
+        struct lsh_var *v = *link;
+        if (v->name_len == len && memcmp(v->entry, name, len) == 0)
+        {
+            *link = v->next;
+            if (v->exported)
+            {
+                lsh_env_dirty = 1;
+            }
+            // A cached envp holding the entry is marked dirty above and rebuilt before its next use
+            free(v->entry);
+            free(v);
+            return;
+        }
+    }
+}
+
+/**********************************************************************  Variables: envp for exec, rebuilt only after a change **********************************************************************/
+char **lsh_env(void)
+{
+    int i, n = 0;
+    struct lsh_var *v;
+
+    if (!lsh_vars_ready)
+    {
+        lsh_vars_init();
+    }
+    if (!lsh_env_dirty)
+    {
+        return lsh_envp;
+    }
+    for (i = 0; i < LSH_VAR_BUCKETS; i++)
+    {
+        for (v = lsh_vars[i]; v != NULL; v = v->next)
+        {
+            n += v->exported;
+        }
+    }
+    lsh_envp = realloc(lsh_envp, (n + 1) * sizeof(char *));
+    if (!lsh_envp)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    n = 0;
+    for (i = 0; i < LSH_VAR_BUCKETS; i++)
+    {
+        for (v = lsh_vars[i]; v != NULL; v = v->next)
+        {
+            if (v->exported)
+            {
+                lsh_envp[n++] = v->entry;
+            }
+        }
+    }
+    lsh_envp[n] = NULL;
+    lsh_env_dirty = 0;
+    lsh_env_gen++;
+    return lsh_envp;
+}
+
+/**********************************************************************  Variables: length of NAME in a NAME=value word, or 0 **********************************************************************/
+size_t lsh_assignment_len(const char *word)
+{
+    size_t i = 0;
+
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_')
+    {
+        return 0;
+    }
+    while (isalnum((unsigned char)word[i]) || word[i] == '_')
+    {
+        i++;
+    }
+    return word[i] == '=' ? i : 0;
+}
+
+/**********************************************************************  Variables: number of leading NAME=value words **********************************************************************/
+int lsh_assignments(char **args)
+{
+    int n = 0;
+    while (args[n] != NULL && lsh_assignment_len(args[n]) > 0)
+    {
+        n++;
+    }
+    return n;
+}
+
+/**********************************************************************  Variables: set NAME=value prefixes for one command **********************************************************************/
+struct lsh_saved_var *lsh_var_push(char **args, int n, struct lsh_arena *a)
+{
+    struct lsh_saved_var *saved = lsh_arena_alloc(a, n * sizeof(struct lsh_saved_var));
+    int i;
+
+    // The old values come back in lsh_var_pop; the command sees the new ones in its environment
+    for (i = 0; i < n; i++)
+    {
+        size_t len = lsh_assignment_len(args[i]);
+        struct lsh_var *v = lsh_var_find(args[i], len);
+        saved[i].name = lsh_arena_alloc(a, len + 1);
+        memcpy(saved[i].name, args[i], len);
+        saved[i].name[len] = '\0';
+        saved[i].value = v != NULL ? lsh_arena_strdup(a, v->entry + len + 1) : NULL;
+        saved[i].exported = v != NULL && v->exported;
+        lsh_var_set(args[i], len, args[i] + len + 1, 1);
+    }
+    return saved;
+}
+
+/**********************************************************************  Variables: undo lsh_var_push **********************************************************************/
+void lsh_var_pop(struct lsh_saved_var *saved, int n)
+{
+    int i;
+
+    for (i = n - 1; i >= 0; i--)
+    {
+        if (saved[i].value == NULL)
+        {
+            lsh_var_unset(saved[i].name);
+            continue;
+        }
+        lsh_var_set(saved[i].name, strlen(saved[i].name), saved[i].value, 0);
+        struct lsh_var *v = lsh_var_find(saved[i].name, strlen(saved[i].name));
+        v->exported = saved[i].exported;
+        lsh_env_dirty = 1;
+    }
+}
+
+/**********************************************************************  Command path hash table **********************************************************************/
+unsigned int lsh_hash_string(const char *s)
+{
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    while (*s)
+    {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+/**********************************************************************  Empty the command path table **********************************************************************/
+void lsh_path_clear(void)
+{
+    int i;
+    for (i = 0; i < LSH_PATH_BUCKETS; i++)
+    {
+        while (lsh_path_table[i] != NULL)
+        {
+            struct lsh_path_entry *e = lsh_path_table[i];
+            lsh_path_table[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+    lsh_path_count = 0;
+}
+
+/**********************************************************************  Drop one command from the path table **********************************************************************/
+int lsh_path_forget(const char *name)
+{
+    struct lsh_path_entry **link = &lsh_path_table[lsh_hash_string(name) % LSH_PATH_BUCKETS];
+
+    for (; *link != NULL; link = &(*link)->next)
+    {
+        if (strcmp((*link)->name, name) == 0)
+        {
+            struct lsh_path_entry *e = *link;
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            lsh_path_count--;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**********************************************************************  Search $PATH for an executable **********************************************************************/
+char *lsh_path_search(const char *name)
+{
+    const char *path = lsh_var_get("PATH");
+    size_t name_len = strlen(name);
+    struct stat st;
+
+    if (path == NULL)
+    {
+        path = "/usr/local/bin:/bin:/usr/bin";
+    }
+
+    while (1)
+    {
+        const char *end = strchrnul(path, ':');
+        size_t dir_len = end - path;
+        char *candidate = malloc(dir_len + name_len + 2);
+        if (!candidate)
+        {
+            fprintf(stderr, "minishell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // An empty entry means the current directory
+        if (dir_len == 0)
+        {
+            memcpy(candidate, name, name_len + 1);
+        }
+        else
+        {
+            memcpy(candidate, path, dir_len);
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+        }
+
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+        {
+            return candidate;
+        }
+        free(candidate);
+
+        if (*end == '\0')
+        {
+            return NULL;
+        }
+        path = end + 1;
+    }
+}
+
+/**********************************************************************  Resolve a command to an absolute path through the table **********************************************************************/
+const char *lsh_path_lookup(const char *name)
+{
+    const char *path = lsh_var_get("PATH");
+    unsigned int bucket;
+    struct lsh_path_entry *e;
+
+    // Names with a slash are used as given
+    if (strchr(name, '/') != NULL)
+    {
+        return name;
+    }
+
+    // Any change of $PATH invalidates every cached location
+    if (path == NULL)
+    {
+        path = "";
+    }
+    if (lsh_path_env == NULL || strcmp(lsh_path_env, path) != 0)
+    {
+        lsh_path_clear();
+        free(lsh_path_env);
+        lsh_path_env = strdup(path);
+    }
+
+    bucket = lsh_hash_string(name) % LSH_PATH_BUCKETS;
+    for (e = lsh_path_table[bucket]; e != NULL; e = e->next)
+    {
+        if (strcmp(e->name, name) == 0)
+        {
+            e->hits++;
+            return e->path;
+        }
+    }
+
+    // First use: walk $PATH once and remember the result
+    char *found = lsh_path_search(name);
+    if (found == NULL)
+    {
+        return NULL;
+    }
+    e = malloc(sizeof(struct lsh_path_entry));
+    if (!e || !(e->name = strdup(name)))
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    e->path = found;
+    e->hits = 1;
+    e->next = lsh_path_table[bucket];
+    lsh_path_table[bucket] = e;
+    lsh_path_count++;
+    return e->path;
+}
+
+/**********************************************************************  Start a stage with fork and exec **********************************************************************/
+int lsh_fork_stage(struct lsh_stage *stage, int in_fd, int out_fd, int close_fd, pid_t pgid)
+{
+    char **args = stage->args;
+    int b = stage->node == NULL ? lsh_find_builtin(args[0]) : -1;
+    const char *path = b == -1 && stage->node == NULL ? lsh_path_lookup(args[0]) : NULL;
+    char **envp = stage->node == NULL ? lsh_env() : NULL; // Built before the fork so the cached copy is reused
+    int stale[2] = {-1, -1};
+    pid_t pid;
+
+    // The child reports a remembered path that no longer exists through a close-on-exec pipe
+    if (path != NULL && path != args[0] && pipe2(stale, O_CLOEXEC) == -1)
+    {
+        stale[0] = stale[1] = -1;
+    }
+    pid = fork();
+
+    if (pid == 0) // Child process
+    {
+        if (lsh_interactive)
+        {
+            // Join the pipeline's process group and restore job-control signals
+            setpgid(0, pgid);
+            signal(SIGTTOU, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGINT, SIG_DFL);
+        }
+        lsh_event_reset();
+
+        // Wire the stage to its neighbours; nothing else from the pipeline stays open
+        if (close_fd != -1)
+        {
+            close(close_fd);
+        }
+        if (in_fd != -1)
+        {
+            dup2(in_fd, STDIN_FILENO);
+            close(in_fd);
+        }
+        if (out_fd != -1)
+        {
+            dup2(out_fd, STDOUT_FILENO);
+            close(out_fd);
+        }
+        for (int i = 0; i < lsh_pipe_nwatch; i++)
+        {
+            close(lsh_pipe_watch[i]); // The shell's sampling copies would keep earlier pipes from closing
+        }
+
+        // Handle any redirections
+        if (lsh_apply_redirections(stage->redirs, stage->nredirs) == -1)
+        {
+            _exit(EXIT_FAILURE);
+        }
+
+        // Subshells evaluate their tree and exit with its status
+        if (stage->node != NULL)
+        {
+            lsh_exec_subshell(stage->node);
+            fflush(stdout);
+            _exit(lsh_last_status);
+        }
+
+        // Built-ins run directly in the child, no exec needed
+        if (b != -1)
+        {
+            lsh_last_status = 0;
+            lsh_stage_child = 1;
+            if ((*builtin_func[b])(args) != LSH_FALLBACK)
+            {
+                fflush(stdout);
+                _exit(lsh_last_status);
+            }
+        }
+
+        // Execute command from its remembered location, walking $PATH again only if it moved
+        environ = envp;
+        if (path != NULL)
+        {
+            execv(path, args);
+            if (errno == ENOEXEC)
+            {
+                char **sh = lsh_sh_argv(path, args);
+                if (sh != NULL)
+                {
+                    execv("/bin/sh", sh);
+                }
+                errno = ENOEXEC;
+            }
+        }
+        if (path == NULL || errno == ENOENT)
+        {
+            if (stale[1] != -1)
+            {
+                write(stale[1], "", 1);
+            }
+            execvp(args[0], args);
+        }
+        fprintf(stderr, "minishell: %s: %s\n", args[0], strerror(errno));
+        _exit(errno == ENOENT ? 127 : 126);
+    }
+    if (stale[1] != -1)
+    {
+        // EOF means the exec succeeded (or the child died); a byte means the entry is stale
+        char c;
+        close(stale[1]);
+        if (pid > 0 && read(stale[0], &c, 1) == 1)
+        {
+            lsh_path_forget(args[0]);
+        }
+        close(stale[0]);
+    }
+    if (pid < 0) // Error forking
+    {
+        perror("minishell");
+        return -1;
+    }
+
+    stage->pid = pid;
+    return 0;
+}
+
+/**********************************************************************  argv for a script without #! **********************************************************************/
+char **lsh_sh_argv(const char *path, char **args)
+{
+    int n;
+
+    // The kernel refuses a text file without #! (ENOEXEC); like execvp, /bin/sh is asked to run it instead
+    for (n = 1; args[n] != NULL; n++)
+    {
+    }
+    char **argv = malloc((n + 2) * sizeof(char *));
+    if (argv != NULL)
+    {
+        argv[0] = "sh";
+        argv[1] = (char *)path;
+        memcpy(argv + 2, args + 1, n * sizeof(char *));
+    }
+    return argv;
+}
+
+/**********************************************************************  Start a stage with posix_spawn **********************************************************************/
+int lsh_posix_spawn_stage(struct lsh_stage *stage, int in_fd, int out_fd, pid_t pgid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    pid_t pid;
+    int i, err;
+
+    // The child only sees dup2 file actions; every other descriptor of the shell is close-on-exec
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    for (i = 0; i < stage->nredirs; i++)
+    {
+        struct lsh_redir *r = &stage->redirs[i];
+        if (r->type == LSH_REDIR_CLOSE)
+        {
+            posix_spawn_file_actions_addclose(&actions, r->fd);
+        }
+        else
+        {
+            posix_spawn_file_actions_adddup2(&actions, r->type == LSH_REDIR_DUP ? r->dup : r->src, r->fd);
+        }
+    }
+
+    // Same process group and signal state the forked child sets up for itself
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGTTOU);
+    sigaddset(&sigs, SIGTTIN);
+    sigaddset(&sigs, SIGTSTP);
+    sigaddset(&sigs, SIGINT);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (lsh_interactive)
+    {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    // Direct execve of the remembered location; a stale entry is dropped and $PATH walked once more
+    const char *path = lsh_path_lookup(stage->args[0]);
+    err = path != NULL ? posix_spawn(&pid, path, &actions, &attr, stage->args, lsh_env()) : ENOENT;
+    if (err == ENOENT && path != NULL && path != stage->args[0])
+    {
+        lsh_path_forget(stage->args[0]);
+        path = lsh_path_lookup(stage->args[0]);
+        err = path != NULL ? posix_spawn(&pid, path, &actions, &attr, stage->args, lsh_env()) : ENOENT;
+    }
+    if (err == ENOEXEC)
+    {
+        char **sh = lsh_sh_argv(path, stage->args);
+        if (sh != NULL && posix_spawn(&pid, "/bin/sh", &actions, &attr, sh, lsh_env()) == 0)
+        {
+            err = 0;
+        }
+        free(sh);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0)
+    {
+        if (err == EAGAIN || err == ENOMEM)
+        {
+            fprintf(stderr, "minishell: %s\n", strerror(err));
+            return -1;
+        }
+        // The command could not be executed; the stage fails like a child whose exec failed
+        fprintf(stderr, "minishell: %s: %s\n", stage->args[0], strerror(err));
+        stage->status = err == ENOENT ? 127 : 126;
+        return 0;
+    }
+
+    stage->pid = pid;
+    return 0;
+}
+
+/**********************************************************************  Zygote: start the spawn helper **********************************************************************/
+int lsh_zygote_start(void)
+{
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    int sv[2], err;
+    pid_t pid;
+    char fd_arg[16];
+
+    // Only the shell's end is close-on-exec; the helper finds its end by number
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        fprintf(stderr, "minishell: zygote: %s\n", strerror(errno));
+        return -1;
+    }
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    sv[0] = lsh_fd_high(sv[0]);
+    snprintf(fd_arg, sizeof(fd_arg), "%d", sv[1]);
+    char *argv[] = {"minishell", "--zygote", fd_arg, NULL};
+
+    // A fresh exec of the shell binary, so the helper stays small however big the shell has grown.
+    // At a terminal its own process group keeps signals meant for jobs away from it; otherwise it
+    // stays in the shell's group, which its commands join as well, and ignores SIGINT itself
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGTTOU);
+    sigaddset(&sigs, SIGTTIN);
+    sigaddset(&sigs, SIGTSTP);
+    sigaddset(&sigs, SIGINT);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (lsh_interactive)
+    {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, 0);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    err = posix_spawn(&pid, "/proc/self/exe", NULL, &attr, argv, lsh_env());
+    posix_spawnattr_destroy(&attr);
+    close(sv[1]);
+
+    if (err != 0)
+    {
+        fprintf(stderr, "minishell: zygote: %s\n", strerror(err));
+        close(sv[0]);
+        return -1;
+    }
+    lsh_zygote_fd = sv[0];
+    lsh_zygote_pid = pid;
+    lsh_zygote_env_gen = 0;
+    return 0;
+}
+
+/**********************************************************************  Zygote: stop the spawn helper **********************************************************************/
+void lsh_zygote_stop(void)
+{
+    if (lsh_zygote_fd == -1)
+    {
+        return;
+    }
+    // EOF on its socket makes the helper exit
+    close(lsh_zygote_fd);
+    lsh_zygote_fd = -1;
+    waitpid(lsh_zygote_pid, NULL, 0);
+    lsh_zygote_pid = 0;
+}
+
+/**********************************************************************  Zygote: set -o zygote / set +o zygote **********************************************************************/
+void lsh_zygote_option(void)
+{
+    if (!lsh_opt_zygote)
+    {
+        lsh_zygote_stop();
+    }
+    else if (lsh_zygote_fd == -1 && lsh_zygote_start() == -1)
+    {
+        lsh_opt_zygote = 0;
+        lsh_last_status = 1;
+    }
+}
+
+/**********************************************************************  Zygote: read exactly len bytes **********************************************************************/
+int lsh_read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**********************************************************************  Zygote: send one launch request **********************************************************************/
+int lsh_zygote_request(const char *path, char **args, int *fds, pid_t pgid, struct lsh_zygote_reply *reply)
+{
+    struct lsh_zygote_req req;
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        char buf[CMSG_SPACE(LSH_ZYGOTE_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    size_t len = strlen(path) + 1;
+    char **envp = lsh_env();
+    int i;
+
+    // Payload: path, argv and the environment as consecutive NUL-terminated strings.
+    // The helper keeps the environment it was last sent, so it only travels after a change.
+    memset(&req, 0, sizeof(req));
+    for (i = 0; args[i] != NULL; i++)
+    {
+        len += strlen(args[i]) + 1;
+    }
+    req.argc = i;
+    req.envc = -1;
+    if (lsh_zygote_env_gen != lsh_env_gen)
+    {
+        for (i = 0; envp[i] != NULL; i++)
+        {
+            len += strlen(envp[i]) + 1;
+        }
+        req.envc = i;
+    }
+    req.len = len;
+    req.pgid = pgid;
+    req.setpgid = lsh_interactive;
+
+    char *payload = malloc(len), *p = payload;
+    if (!payload)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    p = stpcpy(p, path) + 1;
+    for (i = 0; args[i] != NULL; i++)
+    {
+        p = stpcpy(p, args[i]) + 1;
+    }
+    for (i = 0; i < req.envc; i++)
+    {
+        p = stpcpy(p, envp[i]) + 1;
+    }
+
+    // The descriptors ride along with the header; the payload follows on the stream
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(LSH_ZYGOTE_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, LSH_ZYGOTE_FDS * sizeof(int));
+
+    ssize_t n;
+    while ((n = sendmsg(lsh_zygote_fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+    {
+    }
+    for (p = payload; n == sizeof(req) && len > 0; p += n, len -= n)
+    {
+        while ((n = send(lsh_zygote_fd, p, len, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        {
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+    }
+    free(payload);
+    if (len > 0)
+    {
+        return -1; // The helper is gone
+    }
+    lsh_zygote_env_gen = lsh_env_gen;
+    return lsh_read_all(lsh_zygote_fd, reply, sizeof(*reply));
+}
+
+/**********************************************************************  Start a stage through the zygote **********************************************************************/
+int lsh_zygote_stage(struct lsh_stage *stage, int in_fd, int out_fd, pid_t pgid)
+{
+    struct lsh_zygote_reply reply;
+    int fds[LSH_ZYGOTE_FDS];
+    int i, tries;
+
+    if (lsh_zygote_fd == -1 && lsh_zygote_start() == -1)
+    {
+        return LSH_FALLBACK;
+    }
+
+    // Standard descriptors as the stage should see them, plus the shell's current directory
+    fds[0] = in_fd != -1 ? in_fd : STDIN_FILENO;
+    fds[1] = out_fd != -1 ? out_fd : STDOUT_FILENO;
+    fds[2] = STDERR_FILENO;
+    for (i = 0; i < stage->nredirs; i++)
+    {
+        // The helper only passes on the three standard descriptors; anything past them takes another path
+        struct lsh_redir *r = &stage->redirs[i];
+        if (r->fd > 2 || r->type == LSH_REDIR_CLOSE || (r->type == LSH_REDIR_DUP && r->dup > 2))
+        {
+            return LSH_FALLBACK;
+        }
+        fds[r->fd] = r->type == LSH_REDIR_DUP ? fds[r->dup] : r->src;
+    }
+    fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fds[3] == -1)
+    {
+        return LSH_FALLBACK;
+    }
+
+    // Retried once: after dropping a stale path entry, or with a new helper if the old one died
+    for (tries = 0; tries < 2; tries++)
+    {
+        const char *path = lsh_path_lookup(stage->args[0]);
+        if (path == NULL)
+        {
+            reply.pid = 0;
+            reply.err = ENOENT;
+            break;
+        }
+        if (lsh_zygote_request(path, stage->args, fds, pgid, &reply) == -1)
+        {
+            lsh_zygote_stop();
+            if (tries == 1 || lsh_zygote_start() == -1)
+            {
+                close(fds[3]);
+                return LSH_FALLBACK;
+            }
+            continue;
+        }
+        if (reply.pid > 0 && reply.err != 0)
+        {
+            // The child failed its exec and is exiting; it is ours to collect
+            waitpid(reply.pid, NULL, 0);
+        }
+        if (reply.err != ENOENT || path == stage->args[0] || tries == 1)
+        {
+            break;
+        }
+        lsh_path_forget(stage->args[0]);
+    }
+    close(fds[3]);
+
+    if (reply.err != 0)
+    {
+        if (reply.pid <= 0 && (reply.err == EAGAIN || reply.err == ENOMEM))
+        {
+            fprintf(stderr, "minishell: %s\n", strerror(reply.err));
+            return -1;
+        }
+        // Same report and status as a child whose exec failed
+        fprintf(stderr, "minishell: %s: %s\n", stage->args[0], strerror(reply.err));
+        stage->status = reply.err == ENOENT ? 127 : 126;
+        return 0;
+    }
+    stage->pid = reply.pid;
+    return 0;
+}
+
+/**********************************************************************  Zygote: the helper's request loop **********************************************************************/
+int lsh_zygote_serve(int sock)
+{
+    struct lsh_zygote_req req;
+    struct lsh_zygote_reply reply;
+    union
+    {
+        char buf[CMSG_SPACE(LSH_ZYGOTE_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char *env_payload = NULL; // Payload the current environment strings live in.
+    char **envp = NULL;       // Environment for every request until the shell sends a new one.
+    int i;
+
+    // Go away with the shell, but not with a Ctrl-C that shares the shell's process group
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+    while (1)
+    {
+        struct msghdr msg;
+        struct iovec iov;
+        int fds[LSH_ZYGOTE_FDS];
+        ssize_t n;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &req;
+        iov.iov_len = sizeof(req);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) == -1 && errno == EINTR)
+        {
+        }
+        if (n != sizeof(req))
+        {
+            return 0; // The shell closed the socket or exited
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(LSH_ZYGOTE_FDS * sizeof(int)))
+        {
+            return 1;
+        }
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+        char *payload = malloc(req.len);
+        char **argv = malloc((req.argc + 1) * sizeof(char *));
+        if (!payload || !argv || lsh_read_all(sock, payload, req.len) == -1)
+        {
+            return 1;
+        }
+        char *p = payload, *path = p;
+        p += strlen(p) + 1;
+        for (i = 0; i < req.argc; i++)
+        {
+            argv[i] = p;
+            p += strlen(p) + 1;
+        }
+        argv[req.argc] = NULL;
+        if (req.envc >= 0)
+        {
+            // A changed environment replaces the one kept from earlier requests
+            char **env = realloc(envp, (req.envc + 1) * sizeof(char *));
+            if (!env)
+            {
+                return 1;
+            }
+            envp = env;
+            for (i = 0; i < req.envc; i++)
+            {
+                envp[i] = p;
+                p += strlen(p) + 1;
+            }
+            envp[req.envc] = NULL;
+            free(env_payload);
+            env_payload = payload;
+        }
+        else if (envp == NULL)
+        {
+            return 1;
+        }
+
+        // CLONE_PARENT makes the command a child of the shell, which waits for it like any other
+        int err_pipe[2];
+        reply.err = 0;
+        if (pipe2(err_pipe, O_CLOEXEC) == -1)
+        {
+            reply.pid = -1;
+            reply.err = errno;
+        }
+        else
+        {
+            reply.pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+            if (reply.pid == 0)
+            {
+                if (req.setpgid)
+                {
+                    setpgid(0, req.pgid);
+                }
+                signal(SIGINT, SIG_DFL);
+                signal(SIGQUIT, SIG_DFL);
+                for (i = 0; i < 3; i++)
+                {
+                    dup2(fds[i], i);
+                }
+                if (fchdir(fds[3]) == 0)
+                {
+                    execve(path, argv, envp);
+                    if (errno == ENOEXEC)
+                    {
+                        char **sh = lsh_sh_argv(path, argv);
+                        if (sh != NULL)
+                        {
+                            execve("/bin/sh", sh, envp);
+                        }
+                        errno = ENOEXEC;
+                    }
+                }
+                int err = errno;
+                write(err_pipe[1], &err, sizeof(err));
+                _exit(err == ENOENT ? 127 : 126);
+            }
+            if (reply.pid == -1)
+            {
+                reply.err = errno;
+            }
+            close(err_pipe[1]);
+
+            // EOF means the exec went through; otherwise the child sent its errno
+            if (reply.pid > 0 && lsh_read_all(err_pipe[0], &reply.err, sizeof(reply.err)) == -1)
+            {
+                reply.err = 0;
+            }
+            close(err_pipe[0]);
+        }
+
+        for (i = 0; i < LSH_ZYGOTE_FDS; i++)
+        {
+            close(fds[i]);
+        }
+        if (payload != env_payload)
+        {
+            free(payload);
+        }
+        free(argv);
+        if (lsh_write_all(sock, (const char *)&reply, sizeof(reply)) == -1)
+        {
+            return 1;
+        }
+    }
+}
+
+/**********************************************************************  Server mode: accept sessions on a Unix socket **********************************************************************/
+int lsh_serve(const char *path, int max)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int sock, sessions = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "minishell: %s: %s\n", path, strerror(ENAMETOOLONG));
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // A socket left behind by an earlier server is replaced; any other file is not
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+    // Whoever can connect runs commands as this user, so only this user can
+    mode_t mask = umask(077);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int err = sock == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, SOMAXCONN) == -1;
+    umask(mask);
+    if (err)
+    {
+        fprintf(stderr, "minishell: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    while (1)
+    {
+        // Collect sessions that ended; at the limit, wait for one to end before taking another
+        while (sessions > 0 && waitpid(-1, NULL, sessions >= max ? 0 : WNOHANG) > 0)
+        {
+            sessions--;
+        }
+
+        int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            fprintf(stderr, "minishell: %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+
+        // Every session is a copy of the started server, so nothing a request changes reaches other sessions
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // A group of its own, so the session can hang up on everything its requests started
+            setpgid(0, 0);
+            close(sock);
+            lsh_event_reset();
+            lsh_event_init();
+            exit(lsh_serve_session(fd));
+        }
+        if (pid == -1)
+        {
+            fprintf(stderr, "minishell: fork: %s\n", strerror(errno));
+        }
+        else
+        {
+            sessions++;
+        }
+        close(fd);
+    }
+}
+
+/**********************************************************************  Server mode: run the requests of one connection **********************************************************************/
+int lsh_serve_session(int sock)
+{
+    struct lsh_serve_req req;
+    struct lsh_serve_frame frame;
+    struct lsh_arena arena;
+    union
+    {
+        char buf[CMSG_SPACE(LSH_SERVE_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int devnull = lsh_fd_high(open("/dev/null", O_RDWR | O_CLOEXEC));
+    struct sigaction sa;
+    int i;
+
+    // The connection and the client's descriptors stay clear of the ones its commands can name
+    sock = lsh_fd_high(sock);
+    lsh_serve_sock = sock;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lsh_serve_hangup;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGIO, &sa, NULL);
+    memset(&arena, 0, sizeof(arena));
+    while (1)
+    {
+        struct msghdr msg;
+        struct iovec iov;
+        int fds[LSH_SERVE_FDS], capture = 0;
+        ssize_t n;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &req;
+        iov.iov_len = sizeof(req);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) == -1 && errno == EINTR)
+        {
+        }
+        if (n != sizeof(req))
+        {
+            return n == 0 ? 0 : 1; // The client is done, or sent half a header
+        }
+        if (req.len == 0 || req.len > LSH_SERVE_MAX_REQUEST || req.envc < 0 || (size_t)req.envc > req.len)
+        {
+            return 1;
+        }
+
+        // The client's own descriptors, or collected output sent back as frames
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL)
+        {
+            if (cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(LSH_SERVE_FDS * sizeof(int)))
+            {
+                return 1;
+            }
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            for (i = 0; i < LSH_SERVE_FDS; i++)
+            {
+                fds[i] = lsh_fd_high(fds[i]);
+            }
+        }
+        else
+        {
+            capture = 1;
+            fds[0] = fcntl(devnull, F_DUPFD_CLOEXEC, 10);
+            fds[1] = lsh_fd_high(memfd_create("serve-out", MFD_CLOEXEC));
+            fds[2] = lsh_fd_high(memfd_create("serve-err", MFD_CLOEXEC));
+            if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1)
+            {
+                return 1;
+            }
+        }
+
+        // Payload: the command, the working directory (empty: keep the current one) and the NAME=value strings
+        char *payload = lsh_arena_alloc(&arena, req.len + 1);
+        char **env = lsh_arena_alloc(&arena, (req.envc + 1) * sizeof(char *));
+        char *p, *end = payload + req.len;
+        if (lsh_read_all(sock, payload, req.len) == -1)
+        {
+            return 1;
+        }
+        *end = '\0';
+        const char *line = payload;
+        const char *cwd = p = payload + strlen(payload) + 1;
+        for (i = 0; i < req.envc && p < end; i++)
+        {
+            p += strlen(p) + 1;
+            env[i] = p;
+        }
+        if (p >= end)
+        {
+            return 1; // The directory or a NAME=value string is missing
+        }
+        for (i = 0; i < LSH_SERVE_FDS; i++)
+        {
+            dup2(fds[i], i);
+        }
+
+        // While the commands run, a client that goes away (killed, timed out) cancels them. The socket
+        // raises SIGIO, so this works whether the shell waits for a job or runs a built-in itself.
+        int flags = fcntl(sock, F_GETFL);
+        fcntl(sock, F_SETOWN, getpid());
+        fcntl(sock, F_SETFL, flags | O_ASYNC);
+        lsh_serve_hangup(SIGIO); // It may have gone before the request was read
+        frame.type = LSH_SERVE_EXIT;
+        frame.len = lsh_serve_run(line, cwd, env, req.envc, &arena);
+        fcntl(sock, F_SETFL, flags);
+        fflush(stdout);
+        fflush(stderr);
+
+        // Let go of the client's descriptors, so its readers see EOF once the commands are done with them
+        for (i = 0; i < LSH_SERVE_FDS; i++)
+        {
+            dup2(devnull, i);
+        }
+        int err = capture && (lsh_serve_copy(sock, fds[1], LSH_SERVE_STDOUT) == -1 || lsh_serve_copy(sock, fds[2], LSH_SERVE_STDERR) == -1);
+        for (i = 0; i < LSH_SERVE_FDS; i++)
+        {
+            close(fds[i]);
+        }
+        lsh_arena_reset(&arena);
+        if (err || lsh_write_all(sock, (const char *)&frame, sizeof(frame)) == -1)
+        {
+            return 1;
+        }
+    }
+}
+
+/**********************************************************************  Server mode: run one request **********************************************************************/
+int lsh_serve_run(const char *line, const char *cwd, char **env, int envc, struct lsh_arena *a)
+{
+    struct lsh_saved_var *saved;
+    struct lsh_input in;
+    int i;
+
+    if (cwd[0] != '\0' && chdir(cwd) == -1)
+    {
+        fprintf(stderr, "minishell: cd: %s: %s\n", cwd, strerror(errno));
+        return 1;
+    }
+    if (cwd[0] != '\0')
+    {
+        lsh_pwd_update(1);
+    }
+    for (i = 0; i < envc; i++)
+    {
+        if (lsh_assignment_len(env[i]) == 0)
+        {
+            fprintf(stderr, "minishell: %s: not a NAME=value assignment\n", env[i]);
+            return 2;
+        }
+    }
+
+    // The request runs like minishell -c, with the overrides in place of NAME=value before it
+    saved = lsh_var_push(env, envc, a);
+    lsh_last_status = 0;
+    lsh_input_string(&in, line);
+    lsh_loop(&in);
+    lsh_input_close(&in);
+    lsh_var_pop(saved, envc);
+    return lsh_last_status;
+}
+
+/**********************************************************************  Server mode: the client went away **********************************************************************/
+void lsh_serve_hangup(int sig)
+{
+    struct pollfd pfd = {.fd = lsh_serve_sock, .events = POLLRDHUP};
+    int saved_errno = errno;
+
+    // SIGIO also comes with data; only a closed connection ends the session
+    if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)))
+    {
+        errno = saved_errno;
+        return;
+    }
+
+    // Like a closed terminal: everything in the session's group gets SIGHUP, then SIGTERM for what
+    // ignores that, and nobody is left to take the reply
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    kill(0, SIGHUP);
+    kill(0, SIGTERM);
+    _exit(1);
+}
+
+/**********************************************************************  Server mode: send collected output as frames **********************************************************************/
+int lsh_serve_copy(int sock, int fd, int type)
+{
+    struct lsh_serve_frame frame;
+    char buf[65536];
+    off_t off = 0;
+    ssize_t n;
+
+    frame.type = type;
+    while ((n = pread(fd, buf, sizeof(buf), off)) > 0)
+    {
+        frame.len = n;
+        if (lsh_write_all(sock, (const char *)&frame, sizeof(frame)) == -1 || lsh_write_all(sock, buf, n) == -1)
+        {
+            return -1;
+        }
+        off += n;
+    }
+    return n == 0 ? 0 : -1;
+}
+
+/**********************************************************************  Server mode: connect to a server **********************************************************************/
+int lsh_serve_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock, err;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+    {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+/**********************************************************************  Server mode: run a request and wait for its status **********************************************************************/
+int lsh_serve_request(int sock, const char *line, const char *cwd, char **env, int envc, const int *fds)
+{
+    struct lsh_serve_req req;
+    struct lsh_serve_frame frame;
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        char buf[CMSG_SPACE(LSH_SERVE_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char buf[65536];
+    int i;
+
+    // Command, directory and overrides as consecutive NUL-terminated strings
+    memset(&req, 0, sizeof(req));
+    req.len = strlen(line) + strlen(cwd) + 2;
+    req.envc = envc;
+    for (i = 0; i < envc; i++)
+    {
+        req.len += strlen(env[i]) + 1;
+    }
+    char *payload = malloc(req.len), *p = payload;
+    if (!payload)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    p = stpcpy(p, line) + 1;
+    p = stpcpy(p, cwd) + 1;
+    for (i = 0; i < envc; i++)
+    {
+        p = stpcpy(p, env[i]) + 1;
+    }
+
+    // With fds the commands write straight to the caller's descriptors; without, output comes back in frames
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fds != NULL)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(LSH_SERVE_FDS * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, LSH_SERVE_FDS * sizeof(int));
+    }
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+    {
+    }
+    n = n == sizeof(req) ? lsh_write_all(sock, payload, req.len) : -1;
+    free(payload);
+    if (n == -1)
+    {
+        return -1;
+    }
+
+    while (lsh_read_all(sock, &frame, sizeof(frame)) == 0)
+    {
+        if (frame.type == LSH_SERVE_EXIT)
+        {
+            return frame.len;
+        }
+        int out = frame.type == LSH_SERVE_STDERR ? STDERR_FILENO : STDOUT_FILENO;
+        while (frame.len > 0)
+        {
+            size_t chunk = (size_t)frame.len < sizeof(buf) ? (size_t)frame.len : sizeof(buf);
+            if (lsh_read_all(sock, buf, chunk) == -1)
+            {
+                return -1;
+            }
+            lsh_write_all(out, buf, chunk);
+            frame.len -= chunk;
+        }
+    }
+    return -1; // The session went away
+}
+
+/**********************************************************************  Server mode: minishell --client **********************************************************************/
+int lsh_client(int argc, char **argv)
+{
+    static const int fds[LSH_SERVE_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char cwd[PATH_MAX];
+    size_t len = 0;
+    int i, first, status;
+
+    // minishell --client SOCK [NAME=value...] command...: the words of the command are joined like ssh does
+    for (first = 3; first < argc && lsh_assignment_len(argv[first]) > 0; first++)
+    {
+    }
+    if (first == argc)
+    {
+        fprintf(stderr, "minishell: --client: usage: minishell --client socket [NAME=value...] command...\n");
+        return 2;
+    }
+    for (i = first; i < argc; i++)
+    {
+        len += strlen(argv[i]) + 1;
+    }
+    char *line = malloc(len), *p = line;
+    if (!line)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        return EXIT_FAILURE;
+    }
+    for (i = first; i < argc; i++)
+    {
+        p = stpcpy(p, argv[i]);
+        *p++ = ' ';
+    }
+    p[-1] = '\0';
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        cwd[0] = '\0';
+    }
+
+    int sock = lsh_serve_connect(argv[2]);
+    if (sock == -1)
+    {
+        fprintf(stderr, "minishell: %s: %s\n", argv[2], strerror(errno));
+        return 255;
+    }
+    status = lsh_serve_request(sock, line, cwd, argv + 3, first - 3, fds);
+    if (status == -1)
+    {
+        fprintf(stderr, "minishell: %s: connection lost\n", argv[2]);
+        return 255;
+    }
+    close(sock);
+    free(line);
+    return status;
+}
+
+/**********************************************************************  Start one pipeline stage in a child process **********************************************************************/
+int lsh_spawn(struct lsh_stage *stage, int in_fd, int out_fd, int close_fd, pid_t pgid)
+{
+    int ret = 0;
+
+    stage->pid = 0;
+    stage->status = 0;
+
+    // Redirection targets are opened by the shell for both launch paths, so errors read the same
+    stage->nredirs = stage->args != NULL ? lsh_parse_redirections(stage->args, &stage->redirs) : 0;
+    if (stage->nredirs == -1 || lsh_open_redirections(stage->redirs, stage->nredirs) == -1)
+    {
+        stage->redirs = NULL;
+        stage->nredirs = 0;
+        stage->status = EXIT_FAILURE;
+        return 0;
+    }
+
+    // NAME=value prefixes go into the environment of this command only
+    int nassign = stage->node == NULL ? lsh_assignments(stage->args) : 0;
+    struct lsh_saved_var *saved = nassign > 0 ? lsh_var_push(stage->args, nassign, &lsh_cmd_arena) : NULL;
+    stage->args += nassign;
+
+    if (stage->node != NULL)
+    {
+        // A subshell, group or list needs a copy of the shell to run in
+        ret = lsh_fork_stage(stage, in_fd, out_fd, close_fd, pgid);
+    }
+    else if (stage->args[0] == NULL)
+    {
+        // Redirections alone just create or truncate their files
+    }
+    else if (lsh_opt_zygote && lsh_find_builtin(stage->args[0]) == -1 &&
+             (ret = lsh_zygote_stage(stage, in_fd, out_fd, pgid)) != LSH_FALLBACK)
+    {
+        // Started by the helper process
+    }
+    else if (lsh_opt_spawn && lsh_find_builtin(stage->args[0]) == -1)
+    {
+        // Built-ins need a copy of the shell, so only external commands can use posix_spawn
+        ret = lsh_posix_spawn_stage(stage, in_fd, out_fd, pgid);
+    }
+    else
+    {
+        ret = lsh_fork_stage(stage, in_fd, out_fd, close_fd, pgid);
+    }
+
+    stage->args -= nassign;
+    if (nassign > 0)
+    {
+        lsh_var_pop(saved, nassign);
+    }
+    lsh_close_redirections(stage->redirs, stage->nredirs);
+    stage->redirs = NULL;
+    stage->nredirs = 0;
+
+    if (stage->pid > 0 && lsh_interactive)
+    {
+        // Also set the group in the parent so it exists before either side relies on it
+        setpgid(stage->pid, pgid ? pgid : stage->pid);
+    }
+    return ret;
+}
+
+/**********************************************************************  Job table: add a started pipeline **********************************************************************/
+struct lsh_job *lsh_job_add(struct lsh_stage *stages, int n, pid_t pgid, const char *text)
+{
+    struct lsh_job *job = calloc(1, sizeof(struct lsh_job) + n * sizeof(struct lsh_proc));
+    struct lsh_job **link = &lsh_jobs;
+    int i;
+
+    if (!job || !(job->text = strdup(text)))
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    job->pgid = pgid;
+    job->nprocs = n;
+    for (i = 0; i < n; i++)
+    {
+        // Stages that never started are already done with their failure status
+        job->procs[i].pid = stages[i].pid;
+        job->procs[i].status = stages[i].status;
+        job->procs[i].state = stages[i].pid > 0 ? LSH_JOB_RUNNING : LSH_JOB_DONE;
+        job->procs[i].text_off = stages[i].text_off;
+        job->procs[i].start = stages[i].start;
+        job->procs[i].pipe_fd = -1;
+        job->procs[i].pidfd = -1;
+        lsh_event_watch(&job->procs[i]);
+    }
+
+    // Lowest free job number, list kept in number order
+    job->id = 1;
+    while (*link != NULL && (*link)->id == job->id)
+    {
+        job->id++;
+        link = &(*link)->next;
+    }
+    job->next = *link;
+    *link = job;
+    return job;
+}
+
+/**********************************************************************  Job table: remove a job **********************************************************************/
+void lsh_job_remove(struct lsh_job *job)
+{
+    struct lsh_job **link;
+
+    for (link = &lsh_jobs; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == job)
+        {
+            *link = job->next;
+            break;
+        }
+    }
+    for (int i = 0; i < job->nprocs; i++)
+    {
+        lsh_event_forget(&job->procs[i]);
+    }
+    free(job->text);
+    free(job);
+}
+
+/**********************************************************************  Job table: overall state of a job **********************************************************************/
+int lsh_job_state(struct lsh_job *job)
+{
+    int i, stopped = 0;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (job->procs[i].state == LSH_JOB_RUNNING)
+        {
+            return LSH_JOB_RUNNING;
+        }
+        stopped |= job->procs[i].state == LSH_JOB_STOPPED;
+    }
+    return stopped ? LSH_JOB_STOPPED : LSH_JOB_DONE;
+}
+
+/**********************************************************************  Job table: record a wait status **********************************************************************/
+int lsh_job_update(pid_t pid, int status, struct rusage *ru)
+{
+    struct lsh_job *job;
+    int i;
+
+    for (job = lsh_jobs; job != NULL; job = job->next)
+    {
+        for (i = 0; i < job->nprocs; i++)
+        {
+            if (job->procs[i].pid == pid)
+            {
+                lsh_proc_update(&job->procs[i], status, ru);
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+/**********************************************************************  Job table: record the wait status of one stage **********************************************************************/
+void lsh_proc_update(struct lsh_proc *p, int status, struct rusage *ru)
+{
+    if (WIFSTOPPED(status))
+    {
+        p->state = LSH_JOB_STOPPED;
+    }
+    else if (WIFCONTINUED(status))
+    {
+        p->state = LSH_JOB_RUNNING;
+    }
+    else
+    {
+        p->state = LSH_JOB_DONE;
+        p->status = lsh_exit_status(status);
+        p->ru = *ru;
+        clock_gettime(CLOCK_MONOTONIC, &p->end);
+        lsh_event_forget(p);
+    }
+}
+
+/**********************************************************************  Job table: exit status of a finished job **********************************************************************/
+int lsh_job_status(struct lsh_job *job)
+{
+    int i, status = 0;
+
+    // Without pipefail the last stage decides; with it, the rightmost failure does
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (lsh_opt_pipefail ? job->procs[i].status != 0 : i == job->nprocs - 1)
+        {
+            status = job->procs[i].status;
+        }
+    }
+    return status;
+}
+
+/**********************************************************************  Job table: block until a job finishes or stops **********************************************************************/
+int lsh_job_wait(struct lsh_job *job)
+{
+    struct rusage ru;
+    int i, status;
+
+    sigset_t intr;
+
+    // A script's Ctrl-C reaches the job and the shell alike; the shell takes it as an event and decides once the job ends
+    sigemptyset(&intr);
+    sigaddset(&intr, SIGINT);
+    if (!lsh_interactive && lsh_event_fd != -1)
+    {
+        lsh_event_sigint = 0;
+        sigprocmask(SIG_BLOCK, &intr, NULL);
+    }
+    lsh_wait_job = job;
+
+    while (lsh_job_state(job) == LSH_JOB_RUNNING)
+    {
+        if (lsh_event_fd != -1)
+        {
+            // Sleep until a child or a signal needs attention; a timed pipeline also wakes to sample its pipes
+            lsh_event_poll(job->watched ? LSH_PIPE_SAMPLE_MS : -1);
+            if (job->watched)
+            {
+                lsh_pipe_sample(job);
+                lsh_pipe_release(job, 0);
+            }
+            continue;
+        }
+
+        // With job control the whole group is waited on so a stop of any stage is seen
+        pid_t target = job->pgid;
+        if (lsh_interactive && job->pgid > 0)
+        {
+            target = -job->pgid;
+        }
+        else
+        {
+            for (i = 0; job->procs[i].state != LSH_JOB_RUNNING; i++)
+            {
+            }
+            target = job->procs[i].pid;
+        }
+
+        // wait4 hands back the child's resource usage along with its status
+        pid_t pid = wait4(target, &status, WUNTRACED, &ru);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // Nothing left to wait for: whatever is still marked running is gone
+            for (i = 0; i < job->nprocs; i++)
+            {
+                if (job->procs[i].state == LSH_JOB_RUNNING)
+                {
+                    job->procs[i].state = LSH_JOB_DONE;
+                }
+            }
+            break;
+        }
+        lsh_job_update(pid, status, &ru);
+    }
+    lsh_wait_job = NULL;
+
+    if (!lsh_interactive && lsh_event_fd != -1)
+    {
+        // Take a pending SIGINT off the queue before unblocking it; the shell dies of it only if the job did
+        lsh_event_poll(0);
+        for (i = 0; lsh_event_sigint && i < job->nprocs; i++)
+        {
+            if (job->procs[i].status == 128 + SIGINT)
+            {
+                fflush(stdout);
+                signal(SIGINT, SIG_DFL);
+                raise(SIGINT);
+            }
+        }
+        sigprocmask(SIG_UNBLOCK, &intr, NULL);
+    }
+    return lsh_job_state(job);
+}
+
+/**********************************************************************  Job table: send SIGCONT to a job **********************************************************************/
+void lsh_job_continue(struct lsh_job *job)
+{
+    int i;
+
+    if (lsh_interactive && job->pgid > 0)
+    {
+        kill(-job->pgid, SIGCONT);
+        return;
+    }
+    // Without job control the stages share the shell's group; signal them one by one
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (job->procs[i].pid > 0 && job->procs[i].state != LSH_JOB_DONE)
+        {
+            kill(job->procs[i].pid, SIGCONT);
+        }
+    }
+}
+
+/**********************************************************************  Job table: run a job in the foreground **********************************************************************/
+int lsh_job_foreground(struct lsh_job *job, int resume)
+{
+    int i;
+
+    if (lsh_interactive && job->pgid > 0)
+    {
+        // Give the terminal to the job while it runs, with the modes it had when it stopped
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+        if (resume && job->has_tmodes)
+        {
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+        }
+    }
+    if (resume)
+    {
+        for (i = 0; i < job->nprocs; i++)
+        {
+            if (job->procs[i].state == LSH_JOB_STOPPED)
+            {
+                job->procs[i].state = LSH_JOB_RUNNING;
+            }
+        }
+        lsh_job_continue(job);
+    }
+
+    int state = lsh_job_wait(job);
+    lsh_pipe_release(job, 1);
+
+    if (lsh_interactive && job->pgid > 0)
+    {
+        // Take the terminal back and undo whatever modes the job left behind
+        tcsetpgrp(STDIN_FILENO, lsh_shell_pgid);
+        job->has_tmodes = tcgetattr(STDIN_FILENO, &job->tmodes) == 0;
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &lsh_shell_tmodes);
+    }
+
+    if (state == LSH_JOB_STOPPED)
+    {
+        job->background = 1;
+        job->notified = 1;
+        lsh_current_job = job->id;
+        fprintf(stderr, "\n[%d]+  Stopped                 %s\n", job->id, job->text);
+        lsh_last_status = 128 + SIGTSTP;
+        return state;
+    }
+
+    // Per-stage statuses of the finished foreground job
+    free(lsh_pipe_status);
+    lsh_pipe_status = malloc(job->nprocs * sizeof(int));
+    if (!lsh_pipe_status)
+    {
+        fprintf(stderr, "minishell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < job->nprocs; i++)
+    {
+        lsh_pipe_status[i] = job->procs[i].status;
+    }
+    lsh_pipe_nstatus = job->nprocs;
+    lsh_last_status = lsh_job_status(job);
+    lsh_time_report(job);
+    lsh_job_remove(job);
+    return state;
+}
+
+/**********************************************************************  Job table: collect children that changed state **********************************************************************/
+void lsh_reap_jobs(void)
+{
+    // With the event loop only the children that are ready get looked at
+    if (lsh_event_fd != -1)
+    {
+        while (lsh_event_poll(0) == LSH_EVENT_MAX)
+        {
+        }
+        return;
+    }
+
+    // Otherwise only look when SIGCHLD said something happened
+    if (!lsh_sigchld)
+    {
+        return;
+    }
+    lsh_sigchld = 0;
+    lsh_reap_scan(NULL, 1);
+}
+
+/**********************************************************************  Job table: wait4 running stages without blocking **********************************************************************/
+void lsh_reap_scan(struct lsh_job *only, int all)
+{
+    struct lsh_job *job;
+    struct rusage ru;
+    int i, status;
+
+    for (job = only != NULL ? only : lsh_jobs; job != NULL; job = only != NULL ? NULL : job->next)
+    {
+        for (i = 0; i < job->nprocs; i++)
+        {
+            struct lsh_proc *p = &job->procs[i];
+            if (p->state != LSH_JOB_DONE && p->pid > 0 && (all || p->blind) &&
+                wait4(p->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru) > 0)
+            {
+                lsh_proc_update(p, status, &ru);
+            }
+        }
+    }
+}
+
+/**********************************************************************  Job table: report and drop finished background jobs **********************************************************************/
+void lsh_notify_jobs(void)
+{
+    struct lsh_job *job, *next;
+
+    lsh_reap_jobs();
+    for (job = lsh_jobs; job != NULL; job = next)
+    {
+        int state = lsh_job_state(job);
+        next = job->next;
+
+        if (state == LSH_JOB_DONE)
+        {
+            if (lsh_interactive)
+            {
+                int status = lsh_job_status(job);
+                if (status == 0)
+                {
+                    fprintf(stderr, "[%d]%c  Done                    %s\n", job->id, job->id == lsh_current_job ? '+' : '-', job->text);
+                }
+                else
+                {
+                    fprintf(stderr, "[%d]%c  Exit %-19d %s\n", job->id, job->id == lsh_current_job ? '+' : '-', status, job->text);
+                }
+            }
+            lsh_time_report(job);
+            lsh_job_remove(job);
+        }
+        else if (state == LSH_JOB_STOPPED && !job->notified)
+        {
+            job->notified = 1;
+            if (lsh_interactive)
+            {
+                fprintf(stderr, "[%d]+  Stopped                 %s\n", job->id, job->text);
+            }
+        }
+    }
+}
+
+/**********************************************************************  SIGCHLD handler **********************************************************************/
+void lsh_sigchld_handler(int sig)
+{
+    lsh_sigchld = 1;
+}
+
+/**********************************************************************  Events: the epoll set and the signalfd **********************************************************************/
+int lsh_event_init(void)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    sigset_t sigs;
+
+    // SIGCHLD is blocked for good and read from the signalfd; SIGINT only queues there while a script waits for a job
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGCHLD);
+    sigaddset(&sigs, SIGINT);
+    lsh_signal_fd = lsh_fd_high(signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC));
+    lsh_event_fd = lsh_fd_high(epoll_create1(EPOLL_CLOEXEC));
+    if (lsh_signal_fd == -1 || lsh_event_fd == -1 || epoll_ctl(lsh_event_fd, EPOLL_CTL_ADD, lsh_signal_fd, &ev) == -1)
+    {
+        // Without them the SIGCHLD handler and blocking waits do the job
+        lsh_event_reset();
+        return -1;
+    }
+    sigdelset(&sigs, SIGINT);
+    sigprocmask(SIG_BLOCK, &sigs, NULL);
+    return 0;
+}
+
+/**********************************************************************  Events: drop the event loop (forked child, or no kernel support) **********************************************************************/
+void lsh_event_reset(void)
+{
+    // A forked child shares the parent's epoll set; it must not touch it, and its commands get the original mask
+    if (lsh_event_fd != -1)
+    {
+        close(lsh_event_fd);
+    }
+    if (lsh_signal_fd != -1)
+    {
+        close(lsh_signal_fd);
+    }
+    lsh_event_fd = lsh_signal_fd = -1;
+    lsh_event_blind = 0;
+    sigprocmask(SIG_SETMASK, &lsh_child_sigmask, NULL);
+}
+
+/**********************************************************************  Events: watch a job stage through a pidfd **********************************************************************/
+void lsh_event_watch(struct lsh_proc *p)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = p};
+
+    if (p->pid <= 0 || p->state == LSH_JOB_DONE || lsh_event_fd == -1)
+    {
+        return;
+    }
+    // The child cannot have been reaped yet, so the pid still names it even if it already exited
+    p->pidfd = lsh_fd_high(syscall(SYS_pidfd_open, p->pid, 0));
+    if (p->pidfd != -1 && epoll_ctl(lsh_event_fd, EPOLL_CTL_ADD, p->pidfd, &ev) == -1)
+    {
+        close(p->pidfd);
+        p->pidfd = -1;
+    }
+    if (p->pidfd == -1)
+    {
+        p->blind = 1;
+        lsh_event_blind++;
+    }
+}
+
+/**********************************************************************  Events: stop watching a job stage **********************************************************************/
+void lsh_event_forget(struct lsh_proc *p)
+{
+    // Removed before closing: forked stages hold copies of the pidfd, which would keep it in the set
+    if (p->pidfd != -1)
+    {
+        epoll_ctl(lsh_event_fd, EPOLL_CTL_DEL, p->pidfd, NULL);
+        close(p->pidfd);
+        p->pidfd = -1;
+    }
+    if (p->blind)
+    {
+        p->blind = 0;
+        lsh_event_blind--;
+    }
+}
+
+/**********************************************************************  Events: handle ready children and signals **********************************************************************/
+int lsh_event_poll(int timeout)
+{
+    struct epoll_event events[LSH_EVENT_MAX];
+    struct signalfd_siginfo si;
+    struct rusage ru;
+    int i, n, status, sigchld = 0, stopped = 0;
+
+    n = epoll_wait(lsh_event_fd, events, LSH_EVENT_MAX, timeout);
+    for (i = 0; i < n; i++)
+    {
+        struct lsh_proc *p = events[i].data.ptr;
+        if (p != NULL)
+        {
+            // A readable pidfd means that child exited: it alone is collected
+            pid_t pid = p->state != LSH_JOB_DONE ? wait4(p->pid, &status, WNOHANG | WUNTRACED, &ru) : 0;
+            if (pid > 0)
+            {
+                lsh_proc_update(p, status, &ru);
+            }
+            else if (pid == -1 && errno == ECHILD)
+            {
+                p->state = LSH_JOB_DONE;
+                lsh_event_forget(p);
+            }
+            continue;
+        }
+
+        // Exits are left to the pidfds; stops and continues only come as SIGCHLD
+        while (read(lsh_signal_fd, &si, sizeof(si)) == sizeof(si))
+        {
+            lsh_event_sigint |= si.ssi_signo == SIGINT;
+            sigchld |= si.ssi_signo == SIGCHLD;
+            stopped |= si.ssi_signo == SIGCHLD && (si.ssi_code == CLD_STOPPED || si.ssi_code == CLD_CONTINUED);
+        }
+    }
+
+    // SIGCHLDs arriving together merge into one record, so a stop can hide behind an exit: the job being
+    // waited for is always asked, every job when a stop was seen, and stages without a pidfd on any SIGCHLD
+    if (stopped)
+    {
+        lsh_reap_scan(NULL, 1);
+    }
+    else if (sigchld && lsh_wait_job != NULL)
+    {
+        lsh_reap_scan(lsh_wait_job, 1);
+    }
+    if (sigchld && lsh_event_blind > 0)
+    {
+        lsh_reap_scan(NULL, 0);
+    }
+    return n;
+}
+
+/**********************************************************************  Job table: a background job has something to report **********************************************************************/
+int lsh_jobs_changed(void)
+{
+    for (struct lsh_job *job = lsh_jobs; job != NULL; job = job->next)
+    {
+        int state = lsh_job_state(job);
+        if (job->background && (state == LSH_JOB_DONE || (state == LSH_JOB_STOPPED && !job->notified)))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************  Job table: find a job from a %n, %+, %- or pid argument **********************************************************************/
+struct lsh_job *lsh_job_find(const char *spec, const char *cmd)
+{
+    struct lsh_job *job;
+    int id = lsh_current_job;
+    pid_t pid = 0;
+
+    if (spec != NULL)
+    {
+        if (strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 || strcmp(spec, "%") == 0)
+        {
+            id = lsh_current_job;
+        }
+        else if (strcmp(spec, "%-") == 0)
+        {
+            // Previous job: the highest numbered one that is not current
+            id = 0;
+            for (job = lsh_jobs; job != NULL; job = job->next)
+            {
+                if (job->background && job->id != lsh_current_job)
+                {
+                    id = job->id;
+                }
+            }
+        }
+        else if (spec[0] == '%')
+        {
+            id = atoi(spec + 1);
+        }
+        else
+        {
+            pid = atoi(spec);
+        }
+    }
+
+    for (job = lsh_jobs; job != NULL; job = job->next)
+    {
+        if (!job->background)
+        {
+            continue;
+        }
+        if (pid > 0)
+        {
+            for (int i = 0; i < job->nprocs; i++)
+            {
+                if (job->procs[i].pid == pid)
+                {
+                    return job;
+                }
+            }
+        }
+        else if (job->id == id)
+        {
+            return job;
+        }
+    }
+
+    // With no current job fall back to the most recent one
+    if (spec == NULL)
+    {
+        struct lsh_job *last = NULL;
+        for (job = lsh_jobs; job != NULL; job = job->next)
+        {
+            if (job->background)
+            {
+                last = job;
+            }
+        }
+        if (last != NULL)
+        {
+            return last;
+        }
+    }
+    fprintf(stderr, "minishell: %s: %s: no such job\n", cmd, spec != NULL ? spec : "current");
+    return NULL;
+}
+
+/**********************************************************************  Nanoseconds between two times **********************************************************************/
+long lsh_elapsed_ns(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+/**********************************************************************  Time: print one line of a report **********************************************************************/
+void lsh_time_row(const char *label, double real, struct rusage *ru, const char *cmd, int len)
+{
+    fprintf(stderr, "%6s %9.3fs %9.3fs %9.3fs %8ldKB %7ld %7ld  %.*s\n", label, real,
+            ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6, ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+            ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, len, cmd);
+}
+
+/**********************************************************************  Time: report of a finished timed job **********************************************************************/
+void lsh_time_report(struct lsh_job *job)
+{
+    struct rusage total;
+    struct timespec end = job->start;
+    char label[24];
+    int i;
+
+    if (!job->timed)
+    {
+        return;
+    }
+
+    // One line per stage, then the stages added up (max RSS is the largest, not a sum)
+    memset(&total, 0, sizeof(total));
+    fprintf(stderr, "%6s %10s %10s %10s %10s %7s %7s  %s\n", "stage", "real", "user", "sys", "max rss", "vcsw", "ivcsw", "command");
+    for (i = 0; i < job->nprocs; i++)
+    {
+        struct lsh_proc *p = &job->procs[i];
+        const char *cmd = job->text + p->text_off;
+        int len = i + 1 < job->nprocs ? job->procs[i + 1].text_off - p->text_off - 3 : (int)strlen(cmd);
+        double real = p->pid > 0 ? lsh_elapsed_ns(&p->start, &p->end) / 1e9 : 0;
+
+        snprintf(label, sizeof(label), "%d", i + 1);
+        lsh_time_row(label, real, &p->ru, cmd, len);
+        if (p->pid > 0 && lsh_elapsed_ns(&end, &p->end) > 0)
+        {
+            end = p->end;
+        }
+        timeradd(&total.ru_utime, &p->ru.ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &p->ru.ru_stime, &total.ru_stime);
+        total.ru_maxrss = p->ru.ru_maxrss > total.ru_maxrss ? p->ru.ru_maxrss : total.ru_maxrss;
+        total.ru_nvcsw += p->ru.ru_nvcsw;
+        total.ru_nivcsw += p->ru.ru_nivcsw;
+    }
+    if (job->nprocs > 1)
+    {
+        lsh_time_row("total", lsh_elapsed_ns(&job->start, &end) / 1e9, &total, "", 0);
+    }
+
+    // How full each pipe got while the shell waited: peak and mean fill, share of samples full and empty
+    for (i = 0; i < job->nprocs; i++)
+    {
+        struct lsh_proc *p = &job->procs[i];
+        if (p->pipe_samples == 0)
+        {
+            continue;
+        }
+        if (i == 0 || job->procs[i - 1].pipe_samples == 0)
+        {
+            fprintf(stderr, "%6s %10s %10s %10s %7s %7s\n", "pipe", "size", "peak", "mean", "full", "empty");
+        }
+        snprintf(label, sizeof(label), "%d|%d", i + 1, i + 2);
+        fprintf(stderr, "%6s %9.1fK %9.1fK %9.1fK %6d%% %6d%%\n", label, p->pipe_size / 1024.0, p->pipe_peak / 1024.0,
+                (double)p->pipe_total / p->pipe_samples / 1024.0, p->pipe_full * 100 / p->pipe_samples,
+                p->pipe_empty * 100 / p->pipe_samples);
+    }
+    fprintf(stderr, "shell: parse %.3fms, spawn %.3fms\n", job->parse_ns / 1e6, job->spawn_ns / 1e6);
+}
+
+/**********************************************************************  Time: a command that runs inside the shell **********************************************************************/
+int lsh_time_builtin(char **args)
+{
+    struct rusage before, after;
+    struct timespec start, end;
+    int ret = 1;
+
+    getrusage(RUSAGE_SELF, &before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // A built-in that hands over to the external command starts a timed job, which reports itself
+    lsh_time_next = 1;
+    if (args[0] != NULL)
+    {
+        ret = lsh_run_builtin(lsh_find_builtin(args[0]), args);
+    }
+    if (!lsh_time_next)
+    {
+        return ret;
+    }
+    lsh_time_next = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &after);
+    timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+    after.ru_nvcsw -= before.ru_nvcsw;
+    after.ru_nivcsw -= before.ru_nivcsw;
+
+    // No child: the shell's own usage over the command (max RSS is the shell's)
+    fprintf(stderr, "%6s %10s %10s %10s %10s %7s %7s  %s\n", "stage", "real", "user", "sys", "max rss", "vcsw", "ivcsw", "command");
+    size_t len = 1;
+    int i;
+    for (i = 0; args[i] != NULL; i++)
+    {
+        len += strlen(args[i]) + 1;
+    }
+    char *text = lsh_arena_alloc(&lsh_cmd_arena, len), *t = text;
+    *t = '\0';
+    for (i = 0; args[i] != NULL; i++)
+    {
+        t += sprintf(t, i ? " %s" : "%s", args[i]);
+    }
+    lsh_time_row("shell", lsh_elapsed_ns(&start, &end) / 1e9, &after, text, t - text);
+    fprintf(stderr, "shell: parse %.3fms\n", lsh_parse_ns / 1e6);
+    return ret;
+}
+
+/**********************************************************************  Pipeline tuning: a variable as one stage sees it **********************************************************************/
+const char *lsh_stage_var(struct lsh_stage *stage, const char *name)
+{
+    const char *value = lsh_var_get(name);
+    size_t len = strlen(name);
+    int i;
+
+    // NAME=value in front of the stage wins over the shell variable
+    for (i = 0; stage->node == NULL && stage->args[i] != NULL && lsh_assignment_len(stage->args[i]) > 0; i++)
+    {
+        if (lsh_assignment_len(stage->args[i]) == len && strncmp(stage->args[i], name, len) == 0)
+        {
+            value = stage->args[i] + len + 1;
+        }
+    }
+    return value;
+}
+
+/**********************************************************************  Pipeline tuning: byte count such as 65536, 64K or 1M **********************************************************************/
+long lsh_parse_size(const char *s)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+
+    if (end == s || n < 0)
+    {
+        return -1;
+    }
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        n <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        n <<= 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        n <<= 30;
+        end++;
+        break;
+    }
+    return *end == '\0' ? n : -1;
+}
+
+/**********************************************************************  Pipeline tuning: parse a CPU list such as 0-3,8 **********************************************************************/
+int lsh_cpu_list(const char *s, int *cpus, int max)
+{
+    int n = 0;
+    char *end;
+
+    while (*s != '\0' && *s != '\n')
+    {
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0)
+        {
+            return -1;
+        }
+        if (*end == '-')
+        {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo)
+            {
+                return -1;
+            }
+        }
+        for (; lo <= hi && n < max; lo++)
+        {
+            cpus[n++] = lo;
+        }
+        if (*end == ',')
+        {
+            end++;
+        }
+        else if (*end != '\0' && *end != '\n')
+        {
+            return -1;
+        }
+        s = end;
+    }
+    return n;
+}
+
+/**********************************************************************  Pipeline tuning: the CPUs PIPE_CPUS gives a pipeline **********************************************************************/
+int lsh_pipe_cpus(const char *spec, struct lsh_pipe_cpus *pc)
+{
+    int cpus[CPU_SETSIZE], n = 0, start = 0, c;
+    unsigned int cpu = 0, node = 0;
+    cpu_set_t set;
+
+    // Worked out once per pipeline and value; stages take the CPUs in order, wrapping around when there are more stages
+    pc->spec = spec;
+    pc->cpus = NULL;
+    pc->n = pc->start = 0;
+    if (strcmp(spec, "auto") != 0 && strcmp(spec, "node") != 0)
+    {
+        n = lsh_cpu_list(spec, cpus, CPU_SETSIZE);
+    }
+    else
+    {
+        // auto and node take the CPUs the shell may use from the one it is on, so neighbouring stages get neighbouring cores
+        if (sched_getaffinity(0, sizeof(set), &set) == -1 || syscall(SYS_getcpu, &cpu, &node, NULL) == -1)
+        {
+            return -1;
+        }
+        if (strcmp(spec, "node") == 0)
+        {
+            // Only the CPUs of the shell's NUMA node, so the stages share its memory; without NUMA information all CPUs count
+            char path[64], buf[4096];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            ssize_t len = fd != -1 ? read(fd, buf, sizeof(buf) - 1) : -1;
+            if (fd != -1)
+            {
+                close(fd);
+            }
+            if (len > 0)
+            {
+                cpu_set_t local;
+                buf[len] = '\0';
+                CPU_ZERO(&local);
+                for (c = 0, n = lsh_cpu_list(buf, cpus, CPU_SETSIZE); c < n; c++)
+                {
+                    CPU_SET(cpus[c], &local);
+                }
+                CPU_AND(&local, &local, &set);
+                if (CPU_COUNT(&local) > 0)
+                {
+                    set = local;
+                }
+            }
+        }
+        for (c = 0, n = 0; c < CPU_SETSIZE; c++)
+        {
+            if (CPU_ISSET(c, &set))
+            {
+                start = c == (int)cpu ? n : start;
+                cpus[n++] = c;
+            }
+        }
+    }
+    if (n <= 0)
+    {
+        return -1;
+    }
+    pc->cpus = memcpy(lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(int)), cpus, n * sizeof(int));
+    pc->n = n;
+    pc->start = start;
+    return 0;
+}
+
+/**********************************************************************  Pipeline tuning: pin and prioritise a started stage **********************************************************************/
+void lsh_sched_stage(struct lsh_stage *stage, int index, struct lsh_pipe_cpus *pc)
+{
+    const char *spec;
+    char *end;
+
+    if (stage->pid <= 0)
+    {
+        return;
+    }
+
+    // Applied by the shell once the stage exists, so posix_spawn, fork and the zygote are treated alike
+    // A value is parsed and reported on once, not again for every stage it applies to
+    if ((spec = lsh_stage_var(stage, "PIPE_CPUS")) != NULL && spec[0] != '\0')
+    {
+        if ((pc->spec == NULL || strcmp(pc->spec, spec) != 0) && lsh_pipe_cpus(spec, pc) == -1)
+        {
+            fprintf(stderr, "minishell: PIPE_CPUS=%s: invalid CPU list\n", spec);
+        }
+        int cpu = pc->n > 0 ? pc->cpus[(pc->start + index) % pc->n] : -1;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+        {
+            CPU_SET(cpu, &set);
+        }
+        if (cpu != -1 && sched_setaffinity(stage->pid, sizeof(set), &set) == -1)
+        {
+            fprintf(stderr, "minishell: PIPE_CPUS=%s: CPU %d: %s\n", spec, cpu, strerror(errno));
+        }
+    }
+
+    // PIPE_NICE is added to the shell's own niceness
+    if ((spec = lsh_stage_var(stage, "PIPE_NICE")) != NULL && spec[0] != '\0')
+    {
+        long n = strtol(spec, &end, 10);
+        if (end == spec || *end != '\0')
+        {
+            fprintf(stderr, "minishell: PIPE_NICE=%s: invalid niceness\n", spec);
+        }
+        else if (setpriority(PRIO_PROCESS, stage->pid, getpriority(PRIO_PROCESS, 0) + (int)n) == -1)
+        {
+            fprintf(stderr, "minishell: PIPE_NICE=%s: %s\n", spec, strerror(errno));
+        }
+    }
+
+    // PIPE_IONICE is a class, as in ionice(1), with an optional level: idle, best-effort:7, realtime:0
+    if ((spec = lsh_stage_var(stage, "PIPE_IONICE")) != NULL && spec[0] != '\0')
+    {
+        const char *colon = strchr(spec, ':');
+        size_t len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+        int class = 0, level = 4;
+        if ((len == 4 && strncmp(spec, "idle", 4) == 0) || (len == 1 && spec[0] == '3'))
+        {
+            class = 3;
+            level = 0;
+        }
+        else if ((len == 11 && strncmp(spec, "best-effort", 11) == 0) || (len == 2 && strncmp(spec, "be", 2) == 0) ||
+                 (len == 1 && spec[0] == '2'))
+        {
+            class = 2;
+        }
+        else if ((len == 8 && strncmp(spec, "realtime", 8) == 0) || (len == 2 && strncmp(spec, "rt", 2) == 0) ||
+                 (len == 1 && spec[0] == '1'))
+        {
+            class = 1;
+        }
+        if (colon != NULL && class != 3)
+        {
+            level = colon[1] >= '0' && colon[1] <= '7' && colon[2] == '\0' ? colon[1] - '0' : -1;
+        }
+        if (class == 0 || level == -1)
+        {
+            fprintf(stderr, "minishell: PIPE_IONICE=%s: invalid I/O class\n", spec);
+        }
+        else if (syscall(SYS_ioprio_set, LSH_IOPRIO_WHO_PROCESS, stage->pid, class << LSH_IOPRIO_CLASS_SHIFT | level) == -1)
+        {
+            fprintf(stderr, "minishell: PIPE_IONICE=%s: %s\n", spec, strerror(errno));
+        }
+    }
+}
+
+/**********************************************************************  Pipeline tuning: sample how full the pipes of a job are **********************************************************************/
+void lsh_pipe_sample(struct lsh_job *job)
+{
+    int i, n;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        struct lsh_proc *p = &job->procs[i];
+        if (p->pipe_fd == -1 || ioctl(p->pipe_fd, FIONREAD, &n) == -1)
+        {
+            continue;
+        }
+        p->pipe_samples++;
+        p->pipe_total += n;
+        p->pipe_peak = n > p->pipe_peak ? n : p->pipe_peak;
+        p->pipe_full += p->pipe_size - n < PIPE_BUF; // The writer cannot add another page
+        p->pipe_empty += n == 0;
+    }
+}
+
+/**********************************************************************  Pipeline tuning: close sampled pipes **********************************************************************/
+void lsh_pipe_release(struct lsh_job *job, int all)
+{
+    int i;
+
+    // Once the reader is gone the shell's copy must go too, or a writer would block instead of getting SIGPIPE
+    job->watched = 0;
+    for (i = 0; i < job->nprocs; i++)
+    {
+        struct lsh_proc *p = &job->procs[i];
+        if (p->pipe_fd != -1 && (all || i + 1 >= job->nprocs || job->procs[i + 1].state == LSH_JOB_DONE))
+        {
+            close(p->pipe_fd);
+            p->pipe_fd = -1;
+        }
+        job->watched |= p->pipe_fd != -1;
+    }
+}
+
+/**********************************************************************  Start the stages of a pipeline and run it as a job **********************************************************************/
+int lsh_run_stages(struct lsh_stage *stages, int nstages, int background)
+{
+    int i, pipefd[2];
+    int prev_read = -1;
+    pid_t pgid = 0;
+    int timed = lsh_time_next;
+    int *pipe_sizes = NULL;
+    struct timespec start, now;
+    struct lsh_pipe_cpus cpus = {NULL, NULL, 0, 0}; // PIPE_CPUS as worked out for the last stage.
+    const char *size = NULL;                        // PIPE_SIZE value want was parsed from.
+    long want = lsh_pipe_size;
+    int size_failed = 0;                            // The kernel refused that size once already.
+
+    lsh_time_next = 0;
+    if (timed && !background && nstages > 1)
+    {
+        // A timed pipeline keeps a read end of each pipe so the shell can see how full it gets
+        lsh_pipe_watch = lsh_arena_alloc(&lsh_cmd_arena, nstages * sizeof(int));
+        pipe_sizes = lsh_arena_alloc(&lsh_cmd_arena, nstages * sizeof(int));
+    }
+
+    // Job text for jobs listings, taken before redirections are stripped out of the stages
+    size_t text_len = 0;
+    for (i = 0; i < nstages; i++)
+    {
+        char **words = stages[i].node ? stages[i].node->words : stages[i].args;
+        int nwords = stages[i].node ? stages[i].node->nwords : INT_MAX;
+        for (int j = 0; j < nwords && words[j] != NULL; j++)
+        {
+            text_len += strlen(words[j]) + 3;
+        }
+    }
+    char *text = lsh_arena_alloc(&lsh_cmd_arena, text_len + 1);
+    char *t = text;
+    for (i = 0; i < nstages; i++)
+    {
+        char **words = stages[i].node ? stages[i].node->words : stages[i].args;
+        int nwords = stages[i].node ? stages[i].node->nwords : INT_MAX;
+        t += sprintf(t, i ? " | " : "");
+        stages[i].text_off = t - text;
+        for (int j = 0; j < nwords && words[j] != NULL; j++)
+        {
+            t += sprintf(t, j && lsh_tok_kind(words[j - 1]) < LSH_TOK_FD0 ? " %s" : "%s", words[j]); // 2>err stays together
+        }
+    }
+    *t = '\0';
+    for (t = strpbrk(text, "\001\002\003\004" LSH_GLOB_CTL); t != NULL; t = strpbrk(t, "\001\002\003\004" LSH_GLOB_CTL))
+    {
+        // Unexpanded words of subshells still carry markers
+        *t = *t == LSH_CTL_DOLLAR || *t == LSH_CTL_QSUBST ? '$' : *t <= LSH_CTL_QTICK ? '`' : lsh_glob_byte(*t);
+    }
+
+    // Start every stage before waiting on any, each reading from the previous pipe
+    fflush(stdout);
+    if (timed)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    for (i = 0; i < nstages; i++)
+    {
+        int out_fd = -1, next_read = -1;
+
+        if (i < nstages - 1)
+        {
+            if (pipe2(pipefd, O_CLOEXEC) == -1)
+            {
+                perror("minishell");
+                break;
+            }
+            next_read = pipefd[0];
+            out_fd = pipefd[1];
+
+            // Larger buffers mean fewer wakeups between stages; the default is kept if refused. A value is
+            // parsed and reported on once, not again for every pipe it applies to.
+            const char *value = lsh_stage_var(&stages[i], "PIPE_SIZE");
+            if (value != NULL && value[0] == '\0')
+            {
+                value = NULL;
+            }
+            if (value != size && (value == NULL || size == NULL || strcmp(value, size) != 0))
+            {
+                size = value;
+                size_failed = 0;
+                want = size != NULL ? lsh_parse_size(size) : lsh_pipe_size;
+                if (want == -1)
+                {
+                    fprintf(stderr, "minishell: PIPE_SIZE=%s: invalid size\n", size);
+                    want = lsh_pipe_size;
+                }
+            }
+            if (want > 0 && fcntl(out_fd, F_SETPIPE_SZ, want > INT_MAX ? INT_MAX : (int)want) == -1 && size != NULL &&
+                !size_failed)
+            {
+                fprintf(stderr, "minishell: PIPE_SIZE=%s: %s\n", size, strerror(errno));
+                size_failed = 1;
+            }
+            if (pipe_sizes != NULL)
+            {
+                pipe_sizes[i] = fcntl(out_fd, F_GETPIPE_SZ);
+                lsh_pipe_watch[lsh_pipe_nwatch++] = fcntl(next_read, F_DUPFD_CLOEXEC, 10);
+            }
+        }
+
+        if (timed)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &stages[i].start);
+        }
+        int ret = lsh_spawn(&stages[i], prev_read, out_fd, next_read, pgid);
+
+        // The parent keeps only the read end feeding the next stage
+        if (prev_read != -1)
+        {
+            close(prev_read);
+        }
+        if (out_fd != -1)
+        {
+            close(out_fd);
+        }
+        prev_read = next_read;
+
+        if (ret == -1)
+        {
+            break;
+        }
+        if (pgid == 0)
+        {
+            pgid = stages[i].pid;
+        }
+        lsh_sched_stage(&stages[i], i, &cpus);
+    }
+    if (prev_read != -1)
+    {
+        close(prev_read);
+    }
+
+    int started = i;
+    struct lsh_job *job = lsh_job_add(stages, started, pgid, text);
+    for (i = 0; i < lsh_pipe_nwatch; i++)
+    {
+        if (i < started)
+        {
+            job->procs[i].pipe_fd = lsh_pipe_watch[i];
+            job->procs[i].pipe_size = pipe_sizes[i];
+            job->watched = 1;
+        }
+        else if (lsh_pipe_watch[i] != -1)
+        {
+            close(lsh_pipe_watch[i]);
+        }
+    }
+    lsh_pipe_watch = NULL;
+    lsh_pipe_nwatch = 0;
+    if (timed)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        job->timed = 1;
+        job->start = start;
+        job->spawn_ns = lsh_elapsed_ns(&start, &now);
+        job->parse_ns = lsh_parse_ns;
+    }
+
+    if (background)
+    {
+        // Report the job and return to the prompt at once; SIGCHLD tells us when it ends
+        job->background = 1;
+        lsh_current_job = job->id;
+        for (i = started - 1; i >= 0 && stages[i].pid <= 0; i--)
+        {
+        }
+        lsh_last_bg_pid = i >= 0 ? stages[i].pid : 0;
+        if (lsh_interactive)
+        {
+            fprintf(stderr, "[%d] %d\n", job->id, (int)lsh_last_bg_pid);
+        }
+        lsh_last_status = 0;
+    }
+    else
+    {
+        lsh_job_foreground(job, 0);
+    }
+
+    if (started < nstages)
+    {
+        lsh_last_status = 1;
+    }
+    return 1;
+}
+
+/**********************************************************************  Launch an external command **********************************************************************/
+int lsh_launch(char **args, int background)
+{
+    struct lsh_stage stage = {args, NULL, 0, 0, 0, 0, {0, 0}, NULL};
+    return lsh_run_stages(&stage, 1, background);
+}
+
+/**********************************************************************  Interrupt handler for built-ins running in the shell **********************************************************************/
+void lsh_sigint_handler(int sig)
+{
+    lsh_interrupted = 1;
+}
+
+/**********************************************************************  Call a built-in, letting Ctrl-C stop it instead of the shell **********************************************************************/
+int lsh_call_builtin(int b, char **args)
+{
+    struct sigaction sa, old;
+    int ret;
+
+    lsh_last_status = 0;
+    if (!lsh_interactive)
+    {
+        return (*builtin_func[b])(args);
+    }
+
+    // No SA_RESTART: blocking reads and sleeps return EINTR and the built-in gives up
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lsh_sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    lsh_interrupted = 0;
+    sigaction(SIGINT, &sa, &old);
+    ret = (*builtin_func[b])(args);
+    sigaction(SIGINT, &old, NULL);
+    if (lsh_interrupted)
+    {
+        // Like an interrupted child: status 130 and a fresh line for the prompt
+        fputc('\n', stderr);
+        lsh_last_status = 130;
+        lsh_interrupted = 0;
+    }
+    return ret;
+}
+
+/**********************************************************************  Run a built-in in the shell with its redirections **********************************************************************/
+int lsh_run_builtin(int b, char **args)
+{
+    struct lsh_redir *redirs;
+    int ret = 1;
+    char **argv;
+    int argc = 0;
+
+    // Parse a copy so the original command is intact if the built-in hands it to the external one
+    while (args[argc] != NULL)
+    {
+        argc++;
+    }
+    argv = memcpy(lsh_arena_alloc(&lsh_cmd_arena, (argc + 1) * sizeof(char *)), args, (argc + 1) * sizeof(char *));
+    int n = lsh_parse_redirections(argv, &redirs);
+
+    if (n == 0)
+    {
+        // No redirection, just run the built-in directly
+        ret = lsh_call_builtin(b, argv);
+        return ret == LSH_FALLBACK ? lsh_launch(args, 0) : ret;
+    }
+    if (n == -1 || lsh_open_redirections(redirs, n) == -1)
+    {
+        lsh_last_status = EXIT_FAILURE;
+        return 1;
+    }
+
+    int *saved = lsh_save_redirections(redirs, n);
+    if (lsh_apply_redirections(redirs, n) == 0 && argv[0] != NULL)
+    {
+        ret = lsh_call_builtin(b, argv);
+    }
+    else
+    {
+        lsh_last_status = EXIT_FAILURE;
+    }
+    lsh_restore_redirections(redirs, n, saved);
+    lsh_close_redirections(redirs, n);
+    return ret == LSH_FALLBACK ? lsh_launch(args, 0) : ret;
+}
+
+/**********************************************************************  Park the descriptors redirections are about to replace **********************************************************************/
+int *lsh_save_redirections(struct lsh_redir *redirs, int n)
+{
+    int *saved = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(int));
+    int i, j;
+
+    // The shell's own descriptors move above the range redirections use
+    fflush(stdout);
+    for (i = 0; i < n; i++)
+    {
+        saved[i] = -2; // Already saved by an earlier redirection of the same descriptor
+        for (j = 0; j < i && redirs[j].fd != redirs[i].fd; j++)
+        {
+        }
+        if (j == i)
+        {
+            saved[i] = fcntl(redirs[i].fd, F_DUPFD_CLOEXEC, 10); // -1: was closed
+        }
+    }
+    return saved;
+}
+
+/**********************************************************************  Put parked descriptors back **********************************************************************/
+void lsh_restore_redirections(struct lsh_redir *redirs, int n, int *saved)
+{
+    int i;
+
+    fflush(stdout);
+    for (i = n - 1; i >= 0; i--)
+    {
+        if (saved[i] >= 0)
+        {
+            dup2(saved[i], redirs[i].fd);
+            close(saved[i]);
+        }
+        else if (saved[i] == -1)
+        {
+            close(redirs[i].fd);
+        }
+    }
+}
+
+/**********************************************************************  Expansion: make room in a word being built **********************************************************************/
+void lsh_expand_reserve(struct lsh_expand_buf *b, size_t n)
+{
+    if (b->len + n + 1 > b->cap)
+    {
+        size_t cap = b->cap ? b->cap : 64;
+        while (b->len + n + 1 > cap)
+        {
+            cap *= 2;
+        }
+        b->buf = lsh_arena_grow(&lsh_cmd_arena, b->buf, b->cap, cap);
+        b->cap = cap;
+    }
+}
+
+/**********************************************************************  Expansion: append to a word being built **********************************************************************/
+void lsh_expand_append(struct lsh_expand_buf *b, const char *s, size_t n)
+{
+    lsh_expand_reserve(b, n);
+    memcpy(b->buf + b->len, s, n);
+    b->len += n;
+    b->buf[b->len] = '\0';
+}
+
+/**********************************************************************  Expansion: append everything a descriptor delivers **********************************************************************/
+void lsh_expand_read(struct lsh_expand_buf *b, int fd)
+{
+    ssize_t n;
+
+    // Read straight into the word; it doubles as it fills, so long outputs are not copied again and again
+    do
+    {
+        lsh_expand_reserve(b, 4096);
+        n = read(fd, b->buf + b->len, b->cap - b->len - 1);
+        if (n > 0)
+        {
+            b->len += n;
+        }
+    } while (n > 0 || (n == -1 && errno == EINTR));
+    b->buf[b->len] = '\0';
+}
+
+/**********************************************************************  Expansion: can a command substitution run in the shell **********************************************************************/
+int lsh_subst_inline(struct lsh_node *node)
+{
+    int i;
+
+    // Only built-ins that do nothing but write output; cd or export in $( ) must not change the shell
+    if (node->type != LSH_NODE_COMMAND || node->background || node->args[0] == NULL)
+    {
+        return 0;
+    }
+    for (i = 0; builtin_pure[i] != NULL; i++)
+    {
+        if (strcmp(node->args[0], builtin_pure[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************  Expansion: run a command substitution and append its output **********************************************************************/
+void lsh_expand_command(struct lsh_expand_buf *b, const char *text, size_t len, int split)
+{
+    char *line = lsh_arena_alloc(&lsh_cmd_arena, len + 1);
+    int error, status = 0, out = -1, saved = -1;
+    size_t start = b->len;
+
+    memcpy(line, text, len);
+    line[len] = '\0';
+    struct lsh_node *node = lsh_parse(lsh_split_line(line), &error);
+    lsh_subst_count++;
+    if (error)
+    {
+        lsh_last_status = 2;
+        return;
+    }
+    if (node == NULL)
+    {
+        return;
+    }
+
+    // echo, pwd, printf and friends write into an in-memory file from the shell itself: no fork at all
+    if (lsh_subst_inline(node))
+    {
+        fflush(stdout);
+        out = lsh_fd_high(memfd_create("subst", MFD_CLOEXEC));
+        saved = out != -1 ? fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10) : -1;
+        if (saved != -1 && dup2(out, STDOUT_FILENO) != -1)
+        {
+            lsh_exec_node(node);
+            fflush(stdout);
+            dup2(saved, STDOUT_FILENO);
+            lseek(out, 0, SEEK_SET);
+            lsh_expand_read(b, out);
+            status = lsh_last_status;
+        }
+        else
+        {
+            node = NULL;
+        }
+        if (saved != -1)
+        {
+            close(saved);
+        }
+        if (out != -1)
+        {
+            close(out);
+        }
+        if (node == NULL)
+        {
+            fprintf(stderr, "minishell: command substitution: %s\n", strerror(errno));
+            status = 1;
+        }
+    }
+    else
+    {
+        // Anything else runs as a child writing into a pipe, read here until the child closes it
+        struct lsh_stage stage;
+        int fds[2];
+        memset(&stage, 0, sizeof(stage));
+        if (node->type == LSH_NODE_COMMAND && !node->background)
+        {
+            stage.args = lsh_expand_words(node->args);
+        }
+        else
+        {
+            stage.node = node;
+            stage.args = node->type == LSH_NODE_SUBSHELL || node->type == LSH_NODE_GROUP ? node->args : NULL;
+        }
+        if (pipe2(fds, O_CLOEXEC) == -1)
+        {
+            fprintf(stderr, "minishell: command substitution: %s\n", strerror(errno));
+            lsh_last_status = 1;
+            return;
+        }
+        lsh_spawn(&stage, -1, fds[1], fds[0], getpgrp());
+        close(fds[1]);
+        lsh_expand_read(b, fds[0]);
+        close(fds[0]);
+        lsh_close_redirections(stage.redirs, stage.nredirs);
+        status = stage.status;
+        if (stage.pid > 0)
+        {
+            int ws;
+            while (waitpid(stage.pid, &ws, 0) == -1 && errno == EINTR)
+            {
+            }
+            status = lsh_exit_status(ws);
+        }
+    }
+    lsh_last_status = status;
+
+    // Trailing newlines go; unquoted, every run of blanks inside becomes a break between words
+    while (b->len > start && b->buf[b->len - 1] == '\n')
+    {
+        b->buf[--b->len] = '\0';
+    }
+    for (; split && start < b->len; start++)
+    {
+        if (b->buf[start] == ' ' || b->buf[start] == '\t' || b->buf[start] == '\n')
+        {
+            b->buf[start] = LSH_CTL_FIELD;
+        }
+    }
+}
+
+/**********************************************************************  Expansion: one word **********************************************************************/
+char *lsh_expand_word(const char *word, int *split)
+{
+    struct lsh_expand_buf b = {NULL, 0, 0};
+    const char *p = word, *end = word + strlen(word);
+    int fields = 0;
+    char num[24];
+    int j;
+
+    while (*p != '\0')
+    {
+        // Copy up to the next $, ` or marker
+        size_t run = strcspn(p, LSH_EXPAND_CHARS);
+        lsh_expand_append(&b, p, run);
+        p += run;
+        if (*p == '\0')
+        {
+            break;
+        }
+        if (*p == LSH_CTL_DOLLAR || *p == LSH_CTL_TICK)
+        {
+            // A $ or ` that was quoted or escaped on the command line
+            lsh_expand_append(&b, *p == LSH_CTL_DOLLAR ? "$" : "`", 1);
+            p++;
+            continue;
+        }
+        if (*p == '`' || *p == LSH_CTL_QTICK || *p == LSH_CTL_QSUBST || (p[0] == '$' && p[1] == '('))
+        {
+            // Command substitution; outside double quotes its output is split into words
+            int tick = *p == '`' || *p == LSH_CTL_QTICK;
+            int quoted = *p == LSH_CTL_QTICK || *p == LSH_CTL_QSUBST;
+            const char *body = p + (tick ? 1 : 2);
+            const char *close = tick ? lsh_lex_unescaped(body, end, '`') : lsh_lex_subst(body, end);
+            if (close == NULL)
+            {
+                close = end; // Unclosed: the rest of the word is the command
+            }
+            size_t from = b.len;
+            lsh_expand_command(&b, body, close - body, !quoted && *split);
+            lsh_expand_protect(&b, from);
+            fields |= !quoted;
+            p = close + (close < end);
+            continue;
+        }
 
-            // Open file in append mode
-            FILE *fp = fopen(filename, "a");
-            if (fp == NULL)
+        p++;
+        if (*p == '?' || *p == '$' || *p == '!')
+        {
+            // Special parameters
+            int value = *p == '?' ? lsh_last_status : *p == '$' ? (int)lsh_shell_pid : (int)lsh_last_bg_pid;
+            if (*p != '!' || lsh_last_bg_pid > 0)
             {
-                fprintf(stderr, "minishell: cannot open %s for appending: %s\n",
-                        filename, strerror(errno));
-                return -1;
+                lsh_expand_append(&b, num, snprintf(num, sizeof(num), "%d", value));
+            }
+            p++;
+            continue;
+        }
+
+        // $NAME or ${NAME}; anything else leaves the $ as it is
+        int braced = *p == '{';
+        const char *name = p + braced;
+        size_t len = 0;
+        if (isalpha((unsigned char)name[0]) || name[0] == '_')
+        {
+            while (isalnum((unsigned char)name[len]) || name[len] == '_')
+            {
+                len++;
+            }
+        }
+        if (len == 0 || (braced && name[len] != '}'))
+        {
+            lsh_expand_append(&b, "$", 1);
+            continue;
+        }
+        p = name + len + braced;
+
+        if (len == 10 && memcmp(name, "PIPESTATUS", 10) == 0)
+        {
+            // Per-stage statuses of the last foreground pipeline, space separated
+            for (j = 0; j < lsh_pipe_nstatus; j++)
+            {
+                lsh_expand_append(&b, num, snprintf(num, sizeof(num), j ? " %d" : "%d", lsh_pipe_status[j]));
+            }
+            continue;
+        }
+        struct lsh_var *v = lsh_var_find(name, len);
+        if (v != NULL)
+        {
+            const char *value = v->entry + len + 1;
+            size_t from = b.len;
+            lsh_expand_append(&b, value, strlen(value));
+            lsh_expand_protect(&b, from);
+        }
+    }
+    *split = *split && fields;
+    return b.buf != NULL ? b.buf : "";
+}
+
+/**********************************************************************  Expansion: add a word to an expanded command **********************************************************************/
+char **lsh_expand_push(char **out, int *n, int *cap, char *word)
+{
+    if (*n + 1 >= *cap)
+    {
+        out = lsh_arena_grow(&lsh_cmd_arena, out, *cap * sizeof(char *), 2 * *cap * sizeof(char *));
+        *cap *= 2;
+    }
+    out[(*n)++] = word;
+    return out;
+}
+
+/**********************************************************************  Expansion: keep pattern bytes of a value literal **********************************************************************/
+void lsh_expand_protect(struct lsh_expand_buf *b, size_t from)
+{
+    char *p;
+
+    // What a variable or a substitution delivers is never a pattern, like quoted text
+    for (p = b->buf != NULL ? b->buf + from : NULL; p != NULL && (p = strpbrk(p, "*?[")) != NULL; p++)
+    {
+        *p = LSH_CTL_GLOB + (strchr(LSH_GLOB_QUOTE, *p) - LSH_GLOB_QUOTE);
+    }
+}
+
+/**********************************************************************  Expansion: turn pattern markers back into bytes **********************************************************************/
+char *lsh_expand_literal(const char *word)
+{
+    char *copy, *p;
+
+    if (strpbrk(word, LSH_GLOB_CTL) == NULL)
+    {
+        return (char *)word;
+    }
+    copy = lsh_arena_strdup(&lsh_cmd_arena, word);
+    for (p = copy; (p = strpbrk(p, LSH_GLOB_CTL)) != NULL; p++)
+    {
+        *p = lsh_glob_byte(*p);
+    }
+    return copy;
+}
+
+/**********************************************************************  Expansion: add a field, globbed if it is a pattern **********************************************************************/
+char **lsh_expand_fields(char **out, int *n, int *cap, char *word, int glob, struct lsh_glob **g)
+{
+    // A pattern becomes the names it matches; one that matches nothing stays as written
+    if (glob && lsh_glob_meta(word))
+    {
+        if (*g == NULL)
+        {
+            *g = memset(lsh_arena_alloc(&lsh_cmd_arena, sizeof(struct lsh_glob)), 0, sizeof(struct lsh_glob));
+        }
+        (*g)->out = &out;
+        (*g)->n = n;
+        (*g)->cap = cap;
+        if (lsh_glob(*g, word) > 0)
+        {
+            return out;
+        }
+    }
+    return lsh_expand_push(out, n, cap, lsh_expand_literal(word));
+}
+
+/**********************************************************************  Braces: end of a substitution that starts at p **********************************************************************/
+const char *lsh_brace_skip(const char *p, const char *end)
+{
+    const char *close = p;
+
+    // Braces inside $( ) or backquotes belong to the command, which expands them when it runs
+    if (*p == '`' || *p == LSH_CTL_QTICK)
+    {
+        close = lsh_lex_unescaped(p + 1, end, '`');
+    }
+    else if ((*p == '$' || *p == LSH_CTL_QSUBST) && p[1] == '(')
+    {
+        close = lsh_lex_subst(p + 2, end);
+    }
+    return close != NULL ? close : end - 1;
+}
+
+/**********************************************************************  Braces: one end or the step of a sequence **********************************************************************/
+int lsh_brace_number(const char *p, const char *end, long *value)
+{
+    const char *digits = p + (p < end && (*p == '-' || *p == '+'));
+    const char *q;
+
+    if (digits == end || end - digits > 18)
+    {
+        return -1;
+    }
+    for (q = digits; q < end; q++)
+    {
+        if (!isdigit((unsigned char)*q))
+        {
+            return -1;
+        }
+    }
+    *value = strtol(p, NULL, 10);
+    return *digits == '0' && end - digits > 1; // Written with a leading zero: pad the items
+}
+
+/**********************************************************************  Braces: parse first..last[..step] **********************************************************************/
+int lsh_brace_sequence(const char *s, size_t len, struct lsh_brace_seq *seq)
+{
+    const char *end = s + len;
+    const char *dots = memmem(s, len, "..", 2);
+
+    if (dots == NULL)
+    {
+        return -1;
+    }
+    const char *dots2 = memmem(dots + 2, end - dots - 2, "..", 2);
+    const char *last_end = dots2 != NULL ? dots2 : end;
+    seq->step = 1;
+    if (dots2 != NULL && lsh_brace_number(dots2 + 2, end, &seq->step) == -1)
+    {
+        return -1;
+    }
+    seq->step = seq->step < 0 ? -seq->step : seq->step == 0 ? 1 : seq->step;
+
+    // {a..e} runs over letters, {1..10} and {01..10} over numbers
+    seq->chars = dots - s == 1 && last_end - dots == 3 && isalpha((unsigned char)s[0]) && isalpha((unsigned char)dots[2]);
+    if (seq->chars)
+    {
+        seq->first = (unsigned char)s[0];
+        seq->last = (unsigned char)dots[2];
+        seq->width = 0;
+        return 0;
+    }
+    int pad_first = lsh_brace_number(s, dots, &seq->first);
+    int pad_last = lsh_brace_number(dots + 2, last_end, &seq->last);
+    if (pad_first == -1 || pad_last == -1)
+    {
+        return -1;
+    }
+    seq->width = !pad_first && !pad_last ? 0 : dots - s > last_end - dots - 2 ? dots - s : last_end - dots - 2;
+    return 0;
+}
+
+/**********************************************************************  Braces: find the first group that expands **********************************************************************/
+const char *lsh_brace_group(const char *word, const char **close, struct lsh_brace_seq *seq)
+{
+    const char *end = word + strlen(word), *p, *q;
+
+    for (p = word; p < end; p++)
+    {
+        p = lsh_brace_skip(p, end);
+        if (*p != '{' || (p > word && p[-1] == '$'))
+        {
+            continue; // Not a brace, or the one of ${NAME}
+        }
+
+        // The matching brace; a comma at the top level or a sequence makes it a group, {x} and {} stay as written
+        int depth = 0, comma = 0;
+        for (q = p; q < end; q++)
+        {
+            q = lsh_brace_skip(q, end);
+            depth += *q == '{' ? 1 : *q == '}' ? -1 : 0;
+            comma |= depth == 1 && *q == ',';
+            if (depth == 0)
+            {
+                break;
+            }
+        }
+        if (q == end)
+        {
+            continue;
+        }
+        seq->step = 0;
+        if (comma || lsh_brace_sequence(p + 1, q - p - 1, seq) == 0)
+        {
+            *close = q;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**********************************************************************  Braces: expand a word with one group replaced by an item **********************************************************************/
+char **lsh_brace_item(char **out, int *n, int *cap, const char *word, const char *open, const char *item, size_t len, const char *rest)
+{
+    size_t pre = open - word, post = strlen(rest);
+    char *w = lsh_arena_alloc(&lsh_cmd_arena, pre + len + post + 1);
+
+    memcpy(w, word, pre);
+    memcpy(w + pre, item, len);
+    memcpy(w + pre + len, rest, post + 1);
+    return lsh_brace_expand(out, n, cap, w); // Groups inside the item and after it
+}
+
+/**********************************************************************  Braces: expand every group of a word **********************************************************************/
+char **lsh_brace_expand(char **out, int *n, int *cap, char *word)
+{
+    struct lsh_brace_seq seq;
+    const char *close, *open = lsh_brace_group(word, &close, &seq);
+    const char *end = word + strlen(word), *p, *alt;
+    char item[32];
+    int depth = 0;
+
+    if (open == NULL)
+    {
+        return lsh_expand_push(out, n, cap, word);
+    }
+    if (seq.step != 0)
+    {
+        // first..last in steps, counting down if last is smaller
+        long v = seq.first, dir = seq.first <= seq.last ? 1 : -1;
+        while (1)
+        {
+            size_t len = seq.chars ? (item[0] = v, 1) : (size_t)snprintf(item, sizeof(item), "%0*ld", seq.width, v);
+            out = lsh_brace_item(out, n, cap, word, open, item, len, close + 1);
+            if ((seq.last - v) * dir < seq.step)
+            {
+                return out;
+            }
+            v += dir * seq.step;
+        }
+    }
+
+    // One word per alternative between top-level commas
+    for (p = alt = open + 1; p <= close; p++)
+    {
+        p = lsh_brace_skip(p, end);
+        if (p == close || (depth == 0 && *p == ','))
+        {
+            out = lsh_brace_item(out, n, cap, word, open, alt, p - alt, close + 1);
+            alt = p + 1;
+            continue;
+        }
+        depth += *p == '{' ? 1 : *p == '}' ? -1 : 0;
+    }
+    return out;
+}
+
+/**********************************************************************  Glob: byte a pattern byte stands for **********************************************************************/
+int lsh_glob_byte(unsigned char c)
+{
+    // Quoted pattern bytes were turned into markers by the tokenizer; they only match themselves
+    return c >= LSH_CTL_GLOB && c < LSH_CTL_GLOB + sizeof(LSH_GLOB_QUOTE) - 1 ? LSH_GLOB_QUOTE[c - LSH_CTL_GLOB] : c;
+}
+
+/**********************************************************************  Glob: closing ] of a bracket expression **********************************************************************/
+const char *lsh_glob_bracket(const char *p)
+{
+    const char *q = p + 1;
+
+    q += *q == '!' || *q == '^';
+    q += *q == ']'; // A ] right after the [ is a member
+    while (*q != '\0' && *q != ']' && *q != '/')
+    {
+        q++;
+    }
+    return *q == ']' ? q : NULL;
+}
+
+/**********************************************************************  Glob: does a word have pattern bytes **********************************************************************/
+int lsh_glob_meta(const char *s)
+{
+    for (; (s = strpbrk(s, "*?[")) != NULL; s++)
+    {
+        if (*s != '[' || lsh_glob_bracket(s) != NULL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************  Glob: match a name against one component of a pattern **********************************************************************/
+int lsh_glob_match(const char *p, const char *s)
+{
+    const char *star = NULL, *retry = NULL;
+
+    // Iterative: on a mismatch the last * takes one more byte
+    while (*s != '\0')
+    {
+        if (*p == '*')
+        {
+            star = ++p;
+            retry = s;
+            continue;
+        }
+        unsigned char c = *s;
+        int hit = 0;
+        const char *next = p + 1, *close;
+        if (*p == '?')
+        {
+            hit = 1;
+        }
+        else if (*p == '[' && (close = lsh_glob_bracket(p)) != NULL)
+        {
+            const char *q = p + 1;
+            int negate = *q == '!' || *q == '^';
+            for (q += negate; q < close; q++)
+            {
+                int lo = lsh_glob_byte(*q);
+                if (q[1] == '-' && q + 2 < close)
+                {
+                    hit |= c >= lo && c <= lsh_glob_byte(q[2]);
+                    q += 2;
+                }
+                else
+                {
+                    hit |= c == lo;
+                }
             }
+            hit ^= negate;
+            next = close + 1;
+        }
+        else
+        {
+            hit = *p != '\0' && lsh_glob_byte(*p) == c;
+        }
+        if (hit)
+        {
+            p = next;
+            s++;
+        }
+        else if (star != NULL)
+        {
+            p = star;
+            s = ++retry;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    while (*p == '*')
+    {
+        p++;
+    }
+    return *p == '\0';
+}
+
+/**********************************************************************  Glob: sort names by bytes, one byte position at a time **********************************************************************/
+void lsh_glob_sort(char **names, char **tmp, int count, size_t depth)
+{
+    int counts[256], starts[256];
+    int i, j, b;
 
-            // Get file descriptor and redirect stdout
-            int fd = fileno(fp);
-            if (dup2(fd, STDOUT_FILENO) == -1)
+    // Short runs go to insertion sort, comparing only the bytes not yet known to be equal
+    if (count < 32)
+    {
+        for (i = 1; i < count; i++)
+        {
+            char *name = names[i];
+            for (j = i; j > 0 && strcmp(names[j - 1] + depth, name + depth) > 0; j--)
             {
-                fprintf(stderr, "minishell: failed to redirect output: %s\n", strerror(errno));
-                fclose(fp);
-                return -1;
+                names[j] = names[j - 1];
             }
+            names[j] = name;
+        }
+        return;
+    }
 
-            // Remove redirection tokens from args
-            args[i] = NULL;
-            i++; // Skip the filename
+    // Bucket by the byte at depth; names ending here (byte 0) are equal and come first
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < count; i++)
+    {
+        counts[(unsigned char)names[i][depth]]++;
+    }
+    for (b = 0, j = 0; b < 256; b++)
+    {
+        starts[b] = j;
+        j += counts[b];
+    }
+    for (i = 0; i < count; i++)
+    {
+        tmp[starts[(unsigned char)names[i][depth]]++] = names[i];
+    }
+    memcpy(names, tmp, count * sizeof(char *));
+    for (b = 1, j = counts[0]; b < 256; j += counts[b++])
+    {
+        if (counts[b] > 1)
+        {
+            lsh_glob_sort(names + j, tmp, counts[b], depth + 1);
         }
+    }
+}
 
-        // Input redirection
-        else if (strcmp(args[i], REDIRECT_INPUT) == 0)
+/**********************************************************************  Glob: entries of a directory, read once per command **********************************************************************/
+struct lsh_glob_dir *lsh_glob_read(struct lsh_glob *g, size_t plen)
+{
+    struct lsh_glob_dir *d;
+    unsigned int bucket;
+    int fd, cap = 0;
+    long n;
+
+    g->path[plen] = '\0';
+    bucket = lsh_hash_string(g->path) % LSH_GLOB_BUCKETS;
+    for (d = g->dirs[bucket]; d != NULL; d = d->next)
+    {
+        if (strcmp(d->path, g->path) == 0)
         {
-            if (args[i + 1] == NULL)
-            {
-                fprintf(stderr, "minishell: expected file after %s\n", REDIRECT_INPUT);
-                return -1;
-            }
+            return d;
+        }
+    }
+    d = lsh_arena_alloc(&lsh_cmd_arena, sizeof(*d));
+    d->path = lsh_arena_strdup(&lsh_cmd_arena, g->path);
+    d->names = NULL;
+    d->count = 0;
+    d->next = g->dirs[bucket];
+    g->dirs[bucket] = d;
 
-            char *filename = args[i + 1];
+    // A directory that cannot be read has no entries; the buffer is shared by every read
+    fd = open(plen > 0 ? g->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return d;
+    }
+    if (lsh_glob_dents == NULL && (lsh_glob_dents = malloc(LSH_GLOB_DENTS)) == NULL)
+    {
+        close(fd);
+        return d;
+    }
 
-            FILE *fp = fopen(filename, "r");
-            if (fp == NULL)
+    // getdents64 fills the buffer with as many entries as fit; names are packed into the arena
+    // one batch at a time, each after a byte holding its d_type
+    while ((n = syscall(SYS_getdents64, fd, lsh_glob_dents, LSH_GLOB_DENTS)) > 0)
+    {
+        char *names = lsh_arena_alloc(&lsh_cmd_arena, n), *w = names;
+        long off;
+        for (off = 0; off < n; off += ((struct dirent64 *)(lsh_glob_dents + off))->d_reclen)
+        {
+            struct dirent64 *e = (struct dirent64 *)(lsh_glob_dents + off);
+            if (e->d_name[0] == '.' && (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0')))
             {
-                fprintf(stderr, "minishell: cannot open %s for reading: %s\n",
-                        filename, strerror(errno));
-                return -1;
+                continue;
             }
-
-            // Get file descriptor and redirect stdin
-            int fd = fileno(fp);
-            if (dup2(fd, STDIN_FILENO) == -1)
+            if (d->count == cap)
             {
-                fprintf(stderr, "minishell: failed to redirect input: %s\n", strerror(errno));
-                fclose(fp);
-                return -1;
+                d->names = lsh_arena_grow(&lsh_cmd_arena, d->names, cap * sizeof(char *), (cap ? 2 * cap : 64) * sizeof(char *));
+                cap = cap ? 2 * cap : 64;
             }
-
-            // Remove redirection tokens from args
-            args[i] = NULL;
-            i++; // Skip the filename
+            *w++ = e->d_type;
+            d->names[d->count++] = w;
+            w = stpcpy(w, e->d_name) + 1;
         }
     }
-    return 0;
-}
+    close(fd);
 
-// Find pipe in arguments
-int find_pipe(char **args)
-{
-    int i;
-    for (i = 0; args[i] != NULL; i++)
+    // Sorted once here, so matches come out in order without sorting them
+    if (d->count > 1)
     {
-        if (strcmp(args[i], PIPE_TOKEN) == 0)
-        {
-            return i;
-        }
+        lsh_glob_sort(d->names, lsh_arena_alloc(&lsh_cmd_arena, d->count * sizeof(char *)), d->count, 0);
     }
-    return -1;
+    return d;
 }
 
-/**********************************************************************  Execute a pipeline of commands **********************************************************************/
-int execute_pipeline(char **args)
+/**********************************************************************  Glob: is an entry a directory **********************************************************************/
+int lsh_glob_isdir(struct lsh_glob *g, size_t len, const char *name, int follow)
 {
-    int pipe_pos = find_pipe(args);
+    struct stat st;
+    unsigned char type = name[-1];
 
-    // If no pipe is found, execute as normal command
-    if (pipe_pos == -1)
+    // d_type answers without a stat, except for links and file systems that do not fill it in
+    if (type == DT_DIR || (type != DT_UNKNOWN && (type != DT_LNK || !follow)))
     {
-        return lsh_launch(args);
+        return type == DT_DIR;
     }
+    g->path[len] = '\0';
+    return (follow ? stat(g->path, &st) : lstat(g->path, &st)) == 0 && S_ISDIR(st.st_mode);
+}
 
-    // Split command at pipe
-    args[pipe_pos] = NULL;
-    char **next_cmd = &args[pipe_pos + 1];
-
-    int pipefd[2];
-    pid_t pid1, pid2;
-
-    // Create pipe
-    if (pipe(pipefd) == -1)
+/**********************************************************************  Glob: add a match to the command **********************************************************************/
+void lsh_glob_add(struct lsh_glob *g, size_t len, const char *name)
+{
+    // Names in the current directory are used straight from the cache, anything else is copied out of the path
+    char *word = (char *)name;
+    if (word == NULL)
     {
-        perror("minishell");
-        return 1;
+        word = memcpy(lsh_arena_alloc(&lsh_cmd_arena, len + 1), g->path, len);
+        word[len] = '\0';
     }
+    *g->out = lsh_expand_push(*g->out, g->n, g->cap, word);
+    g->matches++;
+}
 
-    // Fork first process
-    pid1 = fork();
-    if (pid1 < 0)
-    {
-        perror("minishell");
-        return 1;
-    }
+/**********************************************************************  Glob: match the components from ci on below path **********************************************************************/
+void lsh_glob_walk(struct lsh_glob *g, size_t plen, int ci)
+{
+    const char *comp = g->comps[ci];
+    int last = ci == g->ncomps - 1, i;
+    int globstar = strcmp(comp, "**") == 0;
+    size_t len;
 
-    if (pid1 == 0) // First child process
+    if (!globstar && !lsh_glob_meta(comp))
     {
-        // Redirect stdout to pipe
-        close(pipefd[0]);
-        if (dup2(pipefd[1], STDOUT_FILENO) == -1)
+        // A plain component is taken as it is; only the full path is checked at the end
+        struct stat st;
+        for (len = 0; comp[len] != '\0' && plen + len < PATH_MAX - 2; len++)
         {
-            perror("minishell");
-            exit(EXIT_FAILURE);
+            g->path[plen + len] = lsh_glob_byte(comp[len]);
         }
-        close(pipefd[1]);
-
-        // Handle any redirections in the first command
-        if (handle_redirection(args) == -1)
+        g->path[plen + len] = '\0';
+        if (!last)
         {
-            exit(EXIT_FAILURE);
+            g->path[plen + len] = '/';
+            lsh_glob_walk(g, plen + len + 1, ci + 1);
         }
-
-        // Execute first command
-        if (execvp(args[0], args) == -1)
+        else if (len == 0 || lstat(g->path, &st) == 0)
         {
-            perror("minishell");
-            exit(EXIT_FAILURE);
+            lsh_glob_add(g, plen + len, NULL);
         }
+        return;
     }
 
-    // Fork second process
-    pid2 = fork();
-    if (pid2 < 0)
+    // ** is any number of directories, itself included; it does not follow links
+    if (globstar && !last)
     {
-        perror("minishell");
-        return 1;
+        lsh_glob_walk(g, plen, ci + 1);
     }
-
-    if (pid2 == 0) // Second child process
+    struct lsh_glob_dir *d = lsh_glob_read(g, plen);
+    for (i = 0; i < d->count; i++)
     {
-        // Redirect stdin to pipe
-        close(pipefd[1]);
-        if (dup2(pipefd[0], STDIN_FILENO) == -1)
+        const char *name = d->names[i];
+        if (name[0] == '.' && (globstar || comp[0] != '.'))
         {
-            perror("minishell");
-            exit(EXIT_FAILURE);
+            continue; // Hidden entries only match a pattern that starts with a dot
         }
-        close(pipefd[0]);
-
-        // Handle any redirections in the second command
-        if (handle_redirection(next_cmd) == -1)
+        if (!globstar && !lsh_glob_match(comp, name))
         {
-            exit(EXIT_FAILURE);
+            continue;
         }
-
-        // Execute second command
-        if (execvp(next_cmd[0], next_cmd) == -1)
+        len = strlen(name);
+        if (plen + len >= PATH_MAX - 2)
         {
-            perror("minishell");
-            exit(EXIT_FAILURE);
+            continue;
+        }
+        memcpy(g->path + plen, name, len);
+        if (last)
+        {
+            lsh_glob_add(g, plen + len, plen == 0 ? name : NULL);
+        }
+        if ((!last || globstar) && lsh_glob_isdir(g, plen + len, name, !globstar))
+        {
+            g->path[plen + len] = '/';
+            lsh_glob_walk(g, plen + len + 1, globstar ? ci : ci + 1);
         }
     }
+}
 
-    // Parent process
-    close(pipefd[0]);
-    close(pipefd[1]);
-
-    // Wait for both processes to finish
-    int status;
-    waitpid(pid1, &status, 0);
-    waitpid(pid2, &status, 0);
+/**********************************************************************  Glob: expand a pattern word into the command **********************************************************************/
+int lsh_glob(struct lsh_glob *g, char *word)
+{
+    int start = *g->n, i, patterned = 0, globstar = 0;
+    char *p;
 
-    // Check if there are more pipes in the second command
-    if (find_pipe(next_cmd) != -1)
+    // Components between slashes; a leading slash leaves an empty first component
+    g->ncomps = 1;
+    for (p = word; *p != '\0'; p++)
     {
-        return execute_pipeline(next_cmd);
+        g->ncomps += *p == '/';
+    }
+    g->comps = lsh_arena_alloc(&lsh_cmd_arena, g->ncomps * sizeof(char *));
+    g->comps[0] = word = lsh_arena_strdup(&lsh_cmd_arena, word);
+    for (i = 1, p = word; (p = strchr(p, '/')) != NULL; i++)
+    {
+        *p++ = '\0';
+        g->comps[i] = p;
+    }
+    for (i = 0; i < g->ncomps; i++)
+    {
+        patterned += lsh_glob_meta(g->comps[i]);
+        globstar |= strcmp(g->comps[i], "**") == 0;
     }
 
-    return 1;
+    g->matches = 0;
+    lsh_glob_walk(g, 0, 0);
+
+    // Listings are sorted, so one patterned component gives sorted matches; deeper patterns are sorted as a whole
+    if ((patterned > 1 || globstar) && g->matches > 1)
+    {
+        lsh_glob_sort(*g->out + start, lsh_arena_alloc(&lsh_cmd_arena, g->matches * sizeof(char *)), g->matches, 0);
+    }
+    return g->matches;
 }
 
-/**********************************************************************  Launch an external command **********************************************************************/
-int lsh_launch(char **args)
+/**********************************************************************  Expansion: every word of a command **********************************************************************/
+char **lsh_expand_words(char **args)
 {
-    pid_t pid, wpid;
-    int status;
+    char **out = args;
+    struct lsh_glob *g = NULL; // Directories read for patterns; lives as long as the command
+    int i, j, n = 0, cap = 0, assign = 1;
 
-    pid = fork();
-    if (pid == 0) // Child process
+    // The parsed words stay untouched; a new array is made only if some word changes
+    for (i = 0; args[i] != NULL; i++)
     {
-        // Handle any redirections
-        if (handle_redirection(args) == -1)
+        assign = assign && lsh_assignment_len(args[i]) > 0;
+        if (strpbrk(args[i], LSH_EXPAND_CHARS LSH_GLOB_CHARS) == NULL)
         {
-            perror("minishell");
-            exit(EXIT_FAILURE);
+            if (out == args)
+            {
+                n++;
+            }
+            else
+            {
+                out = lsh_expand_push(out, &n, &cap, args[i]);
+            }
+            continue;
+        }
+        if (out == args)
+        {
+            for (cap = i + 1; args[cap] != NULL; cap++)
+            {
+            }
+            cap = 2 * cap + 2;
+            out = memcpy(lsh_arena_alloc(&lsh_cmd_arena, cap * sizeof(char *)), args, n * sizeof(char *));
         }
 
-        // Execute command
-        if (execvp(args[0], args) == -1)
+        // Leading NAME=value words and redirection targets are never split into several words or expanded into names
+        int expand = !assign && (i == 0 || !lsh_tok_redirect(lsh_tok_kind(args[i - 1])));
+        char **words = &args[i];
+        int nwords = 1, wcap = 8;
+        if (expand && strchr(args[i], '{') != NULL)
         {
-            perror("minishell");
+            // Braces first, then $ and patterns in every word they make
+            nwords = 0;
+            words = lsh_brace_expand(lsh_arena_alloc(&lsh_cmd_arena, wcap * sizeof(char *)), &nwords, &wcap, args[i]);
+        }
+        for (j = 0; j < nwords; j++)
+        {
+            int split = expand;
+            char *word = words[j];
+            if (strpbrk(word, LSH_EXPAND_CHARS) != NULL)
+            {
+                word = lsh_expand_word(word, &split);
+            }
+            else
+            {
+                split = 0;
+            }
+            if (!split)
+            {
+                out = lsh_expand_fields(out, &n, &cap, word, expand, &g);
+                continue;
+            }
+            for (char *f = word; *f != '\0'; f++)
+            {
+                // Empty pieces vanish, so $(true) alone gives no word at all
+                char *stop = strchr(f, LSH_CTL_FIELD);
+                if (stop == NULL)
+                {
+                    out = lsh_expand_fields(out, &n, &cap, f, expand, &g);
+                    break;
+                }
+                *stop = '\0';
+                if (stop > f)
+                {
+                    out = lsh_expand_fields(out, &n, &cap, f, expand, &g);
+                }
+                f = stop;
+            }
         }
-        exit(EXIT_FAILURE);
     }
-    else if (pid < 0) // Error forking
+    if (out != args)
     {
-        perror("minishell");
+        out[n] = NULL;
+    }
+    return out;
+}
+
+/**********************************************************************  Run a pipeline node as a job **********************************************************************/
+int lsh_exec_pipeline(struct lsh_node *node, int background)
+{
+    int i, n = node->type == LSH_NODE_PIPELINE ? node->nstages : 1;
+    struct lsh_node **nodes = node->type == LSH_NODE_PIPELINE ? node->stages : &node;
+
+    if (node->type == LSH_NODE_PIPELINE && node->timed)
+    {
+        // time on a built-in measures the shell itself; anything else becomes a timed job
+        if (n == 0 || (n == 1 && !background && nodes[0]->type == LSH_NODE_COMMAND && nodes[0]->args[0] != NULL &&
+                       lsh_find_builtin(nodes[0]->args[0]) != -1))
+        {
+            char *none[] = {NULL};
+            if (n == 0)
+            {
+                return lsh_time_builtin(none);
+            }
+            return lsh_time_builtin(lsh_expand_words(nodes[0]->args));
+        }
+        lsh_time_next = 1;
     }
-    else // Parent process
+
+    // Commands become stages directly; subshells, groups and lists run in a forked copy of the shell
+    struct lsh_stage *stages = lsh_arena_alloc(&lsh_cmd_arena, n * sizeof(struct lsh_stage));
+    memset(stages, 0, n * sizeof(struct lsh_stage));
+    for (i = 0; i < n; i++)
     {
-        do
+        if (nodes[i]->type == LSH_NODE_COMMAND)
+        {
+            stages[i].args = lsh_expand_words(nodes[i]->args);
+        }
+        else
         {
-            wpid = waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+            stages[i].node = nodes[i];
+            stages[i].args = nodes[i]->type == LSH_NODE_SUBSHELL || nodes[i]->type == LSH_NODE_GROUP ? nodes[i]->args : NULL;
+        }
     }
+    return lsh_run_stages(stages, n, background);
+}
 
-    return 1;
+/**********************************************************************  Run a tree in a forked child (subshell) **********************************************************************/
+int lsh_exec_subshell(struct lsh_node *node)
+{
+    struct lsh_node copy = *node;
+
+    // The child is a plain shell: no job control of its own, and the spawn helper belongs to the parent
+    lsh_interactive = 0;
+    lsh_opt_zygote = 0;
+    lsh_jobs = NULL;
+    lsh_event_init();
+
+    if (node->type == LSH_NODE_SUBSHELL || node->type == LSH_NODE_GROUP)
+    {
+        // Redirections of ( ) and { } were applied by the stage already
+        return lsh_exec_node(node->left);
+    }
+    copy.background = 0;
+    return lsh_exec_node(&copy);
 }
 
-/**********************************************************************  Command execution **********************************************************************/
-int lsh_execute(char **args)
+/**********************************************************************  Run a { group } in the shell with its redirections **********************************************************************/
+int lsh_exec_group(struct lsh_node *node)
 {
-    int i;
-    int has_redirection = 0;
+    struct lsh_redir *redirs;
+    int ret = 1;
+    int n = lsh_parse_redirections(node->args, &redirs);
 
-    if (args[0] == NULL)
+    if (n == 0)
+    {
+        return lsh_exec_node(node->left);
+    }
+    if (n == -1 || lsh_open_redirections(redirs, n) == -1)
     {
+        lsh_last_status = EXIT_FAILURE;
         return 1;
     }
+    int *saved = lsh_save_redirections(redirs, n);
+    if (lsh_apply_redirections(redirs, n) == 0)
+    {
+        ret = lsh_exec_node(node->left);
+    }
+    else
+    {
+        lsh_last_status = EXIT_FAILURE;
+    }
+    lsh_restore_redirections(redirs, n, saved);
+    lsh_close_redirections(redirs, n);
+    return ret;
+}
 
-    // Check if there's any redirection in the command
-    for (i = 0; args[i] != NULL; i++)
+/**********************************************************************  Evaluate a parsed line **********************************************************************/
+int lsh_exec_node(struct lsh_node *node)
+{
+    int i, ret;
+
+    if (node->background)
     {
-        if (strcmp(args[i], REDIRECT_INPUT) == 0 ||
-            strcmp(args[i], REDIRECT_OUTPUT) == 0 ||
-            strcmp(args[i], REDIRECT_OUTPUT_APPEND) == 0)
+        // Commands and pipelines are background jobs as they are; anything larger runs in a subshell job
+        if (node->type == LSH_NODE_COMMAND || node->type == LSH_NODE_PIPELINE)
         {
-            has_redirection = 1;
-            break;
+            return lsh_exec_pipeline(node, 1);
         }
+        struct lsh_stage stage = {node->type == LSH_NODE_SUBSHELL || node->type == LSH_NODE_GROUP ? node->args : NULL,
+                                  NULL, 0, 0, 0, 0, {0, 0}, node};
+        return lsh_run_stages(&stage, 1, 1);
     }
 
-    /**********************************************************************  Built-in command handling **********************************************************************/
-    for (i = 0; i < lsh_num_builtins(); i++)
+    switch (node->type)
     {
-        if (strcmp(args[0], builtin_str[i]) == 0)
+    case LSH_NODE_COMMAND:
+    {
+        int substs = lsh_subst_count;
+        char **args = lsh_expand_words(node->args);
+        int nassign = lsh_assignments(args);
+        if (nassign > 0 && args[nassign] == NULL)
         {
-            if (has_redirection)
+            // A line of bare assignments sets shell variables for good; its status is that of the last $( ), if any
+            for (i = 0; i < nassign; i++)
             {
-                // For built-ins with redirection, fork a child process
-                pid_t pid = fork();
-
-                if (pid == 0)
-                {
-                    // Child process - set up redirection
-                    if (handle_redirection(args) == -1)
-                    {
-                        exit(EXIT_FAILURE);
-                    }
-
-                    // Execute the built-in
-                    exit((*builtin_func[i])(args) ? EXIT_SUCCESS : EXIT_FAILURE);
-                }
-                else if (pid < 0)
-                {
-                    perror("minishell");
-                    return 1;
-                }
-                else
-                {
-                    // Parent process - wait for child
-                    int status;
-                    waitpid(pid, &status, 0);
-                    return 1;
-                }
+                size_t len = lsh_assignment_len(args[i]);
+                lsh_var_set(args[i], len, args[i] + len + 1, 0);
             }
-            else
+            lsh_last_status = lsh_subst_count != substs ? lsh_last_status : 0;
+            return 1;
+        }
+        if (args[nassign] != NULL && (ret = lsh_find_builtin(args[nassign])) != -1)
+        {
+            // Built-ins always run in the shell itself, redirections and NAME=value prefixes included
+            struct lsh_saved_var *saved = nassign > 0 ? lsh_var_push(args, nassign, &lsh_cmd_arena) : NULL;
+            ret = lsh_run_builtin(ret, args + nassign);
+            if (nassign > 0)
             {
-                // No redirection, just run the built-in directly
-                return (*builtin_func[i])(args);
+                lsh_var_pop(saved, nassign);
             }
+            return ret;
+        }
+        return lsh_launch(args, 0);
+    }
+    case LSH_NODE_PIPELINE:
+    case LSH_NODE_SUBSHELL:
+        return lsh_exec_pipeline(node, 0);
+    case LSH_NODE_GROUP:
+        return lsh_exec_group(node);
+    case LSH_NODE_AND:
+    case LSH_NODE_OR:
+        // The right side runs only if the left one succeeded (&&) or failed (||)
+        if ((ret = lsh_exec_node(node->left)) == 0)
+        {
+            return 0;
+        }
+        if ((lsh_last_status == 0) == (node->type == LSH_NODE_AND))
+        {
+            return lsh_exec_node(node->right);
         }
+        return ret;
+    case LSH_NODE_LIST:
+        if ((ret = lsh_exec_node(node->left)) == 0)
+        {
+            return 0;
+        }
+        if (lsh_interactive && lsh_last_status == 128 + SIGINT)
+        {
+            // Ctrl-C stops the rest of the line, not just the running command
+            return 1;
+        }
+        return lsh_exec_node(node->right);
     }
+    return 1;
+}
+
+/**********************************************************************  Command execution **********************************************************************/
+int lsh_execute(char **args)
+{
+    int error;
+    struct lsh_node *node;
 
-    // Check for pipes and handle accordingly
-    if (find_pipe(args) != -1)
+    if (args[0] == NULL)
+    {
+        return 1;
+    }
+    node = lsh_parse(args, &error);
+    if (error)
     {
-        return execute_pipeline(args);
+        lsh_last_status = 2;
+        return 1;
     }
-
-    // Otherwise execute as a regular command
-    return lsh_launch(args);
+    return node != NULL ? lsh_exec_node(node) : 1;
 }
 
 /**********************************************************************  Main shell loop **********************************************************************/
-void lsh_loop(void)
+void lsh_loop(struct lsh_input *in)
 {
     char *line;
     char **args;
@@ -636,22 +9691,165 @@ void lsh_loop(void)
 
     do
     {
-        printf("T-12_MiniShell_Sasken >");
-        line = lsh_read_line();
+        // Collect finished background jobs before the next command
+        lsh_notify_jobs();
+
+        if (in == NULL)
+        {
+            // Interactive: prompt and read from the terminal
+            printf(LSH_PROMPT);
+            line = lsh_read_line(LSH_PROMPT);
+            if (line != NULL)
+            {
+                lsh_history_add(line);
+            }
+        }
+        else
+        {
+            // Batch: lines come straight out of the input buffer
+            line = lsh_input_line(in);
+        }
+        if (line == NULL)
+        {
+            break;
+        }
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
         args = lsh_split_line(line);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        lsh_parse_ns = lsh_elapsed_ns(&t0, &t1);
+        lsh_read_heredocs(args, in);
         status = lsh_execute(args);
+        lsh_cmd_count++;
 
-        free(line);
-        free(args);
+        if (in == NULL)
+        {
+            free(line);
+        }
+        lsh_arena_reset(&lsh_cmd_arena); // Every token and argv of the command goes at once
     } while (status);
 }
 
+/**********************************************************************  Interactive job-control setup **********************************************************************/
+void lsh_init(void)
+{
+    lsh_interactive = 1;
+    lsh_shell_pgid = getpgrp();
+    const char *term = lsh_var_get("TERM");
+    lsh_edit_enabled = tcgetattr(STDIN_FILENO, &lsh_shell_tmodes) == 0 && (term == NULL || strcmp(term, "dumb") != 0);
+
+    // The shell hands the terminal to each job and must be able to take it back; Ctrl-Z stops jobs and Ctrl-C
+    // interrupts them, never the shell (built-ins that run in the shell catch SIGINT while they run)
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+
+    lsh_history_init();
+}
+
+/**********************************************************************  Child reaping setup **********************************************************************/
+void lsh_init_signals(void)
+{
+    struct sigaction sa;
+
+    // Children changing state arrive as events; the SIGCHLD handler only serves when the event loop is unavailable
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lsh_sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    sigprocmask(SIG_SETMASK, NULL, &lsh_child_sigmask);
+    lsh_event_init();
+}
+
 /**********************************************************************  Main entry point **********************************************************************/
+#ifndef LSH_NO_MAIN // The benchmark harness includes this file and brings its own main
 int main(int argc, char **argv)
 {
-    // Run command loop
-    lsh_loop();
+    struct lsh_input input;
+
+    // minishell --zygote FD: the spawn helper started by set -o zygote
+    if (argc == 3 && strcmp(argv[1], "--zygote") == 0)
+    {
+        return lsh_zygote_serve(atoi(argv[2]));
+    }
+    // minishell --client SOCK [NAME=value...] command: run a command on a server started with --serve
+    if (argc > 1 && strcmp(argv[1], "--client") == 0)
+    {
+        return lsh_client(argc, argv);
+    }
+
+    lsh_init_signals();
+    lsh_vars_init();
+
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0)
+    {
+        // minishell --serve SOCK [-j N]: run requests from clients, up to N sessions at a time
+        if (argc != 3 && !(argc == 5 && strcmp(argv[3], "-j") == 0 && atoi(argv[4]) > 0))
+        {
+            fprintf(stderr, "minishell: --serve: usage: minishell --serve socket [-j sessions]\n");
+            return 2;
+        }
+        return lsh_serve(argv[2], argc == 5 ? atoi(argv[4]) : 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        // minishell -c "command"
+        if (argc < 3)
+        {
+            fprintf(stderr, "minishell: -c: option requires an argument\n");
+            return EXIT_FAILURE;
+        }
+        lsh_input_string(&input, argv[2]);
+    }
+    else if (argc > 1 && strcmp(argv[1], "-C") == 0)
+    {
+        // minishell -C script.sh: run the compiled form, compiling it first when the script changed
+        struct lsh_cache cache;
+        if (argc < 3)
+        {
+            fprintf(stderr, "minishell: -C: option requires an argument\n");
+            return EXIT_FAILURE;
+        }
+        if (lsh_cache_open(&cache, argv[2]) == 0)
+        {
+            lsh_cache_loop(&cache);
+            lsh_cache_close(&cache);
+            return lsh_last_status;
+        }
+        if (lsh_input_file(&input, argv[2]) == -1)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    else if (argc > 1)
+    {
+        // minishell script.sh
+        if (lsh_input_file(&input, argv[1]) == -1)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    else if (!isatty(STDIN_FILENO))
+    {
+        // Commands piped or redirected into the shell
+        lsh_input_fd(&input, STDIN_FILENO);
+    }
+    else
+    {
+        // Run interactive command loop
+        lsh_init();
+        lsh_loop(NULL);
+        return lsh_last_status;
+    }
+
+    // Run batch command loop
+    lsh_loop(&input);
 
     // Perform any shutdown/cleanup
-    return EXIT_SUCCESS;
+    lsh_input_close(&input);
+    return lsh_last_status;
 }
+#endif